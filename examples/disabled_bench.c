@@ -0,0 +1,56 @@
+#include <ftr.h>
+#include <stdio.h>
+#include <time.h>
+
+// Cost of an FTR_SCOPE while no session is open: compiled in as usual, with
+// FTR_STATIC_KEYS (patched to a NOP), and compiled out with FTR_NO_TRACE.
+// The same loop is built three times (see disabled_bench/workload.c). The
+// static-key loop is timed again in a session paused with ftr_stop().
+
+#define ITERATIONS 20000000ULL
+
+uint64_t bench_plain(uint64_t iterations);
+uint64_t bench_static_keys(uint64_t iterations);
+uint64_t bench_no_trace(uint64_t iterations);
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void discard(const void *data, size_t len, void *userdata) {
+  (void)data;
+  (void)len;
+  (void)userdata;
+}
+
+static double run(uint64_t (*fn)(uint64_t)) {
+  fn(ITERATIONS / 10); // warm up
+  double best = 1e9;
+  for (int rep = 0; rep < 5; rep++) {
+    double t0 = now_sec();
+    fn(ITERATIONS);
+    double t = (now_sec() - t0) * 1e9 / (double)ITERATIONS;
+    best = t < best ? t : best;
+  }
+  return best;
+}
+
+int main(void) {
+  double none = run(bench_no_trace);
+  double keys = run(bench_static_keys);
+  double plain = run(bench_plain);
+  ftr_init(discard, NULL);
+  ftr_stop();
+  double paused = run(bench_static_keys);
+  ftr_close();
+  printf("%-14s %6.2f ns/iter\n", "FTR_NO_TRACE", none);
+  printf("%-14s %6.2f ns/iter  (+%.2f ns per disabled site)\n",
+         "static keys", keys, keys - none);
+  printf("%-14s %6.2f ns/iter  (+%.2f ns per disabled site)\n", "  paused",
+         paused, paused - none);
+  printf("%-14s %6.2f ns/iter  (+%.2f ns per disabled site)\n", "default",
+         plain, plain - none);
+  return 0;
+}
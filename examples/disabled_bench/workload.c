@@ -0,0 +1,13 @@
+#include <ftr.h>
+#include <stdint.h>
+
+// Built once per way of disabling tracing; BENCH_NAME names each copy.
+uint64_t BENCH_NAME(uint64_t iterations) {
+  uint64_t acc = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    FTR_SCOPE("bench.site");
+    acc += i;
+    __asm__ volatile("" : "+r"(acc)); // keep the loop body
+  }
+  return acc;
+}
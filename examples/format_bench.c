@@ -0,0 +1,57 @@
+#include <ftr.h>
+#include <stdio.h>
+#include <time.h>
+
+// Encodes the same workload with the FXT and Perfetto writers and reports
+// trace size and encode cost per event. Output goes to a byte counter, so
+// only the encoders are measured.
+
+#define ITERATIONS 200000
+#define INNER 4
+
+static void count_bytes(const void *data, size_t len, void *userdata) {
+  (void)data;
+  *(size_t *)userdata += len;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void workload(void) {
+  for (int i = 0; i < ITERATIONS; i++) {
+    FTR_SCOPE("bench.outer");
+    for (int j = 0; j < INNER; j++) {
+      FTR_SCOPE("bench.inner_scope_with_a_longer_name");
+    }
+    if (i % 16 == 0)
+      FTR_COUNTER("bench.iteration", i);
+  }
+}
+
+static void run(const char *label, ftr_format_t format) {
+  size_t bytes = 0;
+  ftr_set_format(format);
+  ftr_init(count_bytes, &bytes);
+  workload(); // warm up: interning, sequence setup, page faults
+  ftr_close();
+
+  bytes = 0;
+  ftr_init(count_bytes, &bytes);
+  double t0 = now_sec();
+  workload();
+  double t1 = now_sec();
+  ftr_close();
+
+  double events = (double)ITERATIONS * (1 + INNER + 1.0 / 16);
+  printf("%-9s %8.2f MB  %6.2f bytes/event  %6.1f ns/event\n", label,
+         (double)bytes / 1e6, (double)bytes / events, (t1 - t0) * 1e9 / events);
+}
+
+int main(void) {
+  run("fxt", FTR_FORMAT_FXT);
+  run("perfetto", FTR_FORMAT_PERFETTO);
+  return 0;
+}
@@ -0,0 +1,25 @@
+#include <ftr.h>
+
+// Built with -finstrument-functions and linked with ftr_instrument: every
+// call below becomes a span without any FTR_* annotations. Run the trace
+// through ftr-symbolize to turn the "@0x..." names into function names.
+
+__attribute__((noinline)) int fib(int n) {
+  if (n <= 1)
+    return n;
+  return fib(n - 1) + fib(n - 2);
+}
+
+__attribute__((noinline)) int sum_fibs(int upto) {
+  int total = 0;
+  for (int i = 0; i < upto; i++)
+    total += fib(i);
+  return total;
+}
+
+int main(void) {
+  ftr_init_file(NULL);
+  int total = sum_fibs(20);
+  ftr_close();
+  return total == 0;
+}
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <ftr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Cost the allocation tracer adds to malloc, and to a malloc/free pair. Run
+// it under the tracer:
+//   LD_PRELOAD=libftr_malloc.so ./malloc_bench
+// It times the same loops through the interposed functions and through the
+// C library's own, with a session open, and exits non-zero if the tracer adds
+// 10 ns or more to a malloc call.
+
+#define ITERATIONS 10000000ULL
+#define BATCH 1024
+#define SIZE 64
+#define BUDGET_NS 10.0
+
+typedef void *(*malloc_fn)(size_t);
+typedef void (*free_fn)(void *);
+
+static void discard(const void *data, size_t len, void *userdata) {
+  (void)data;
+  (void)len;
+  (void)userdata;
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Seconds spent in `m` alone: blocks are allocated a batch at a time and
+// freed untimed.
+static double mallocs(malloc_fn m, free_fn f, uint64_t iterations) {
+  static void *blocks[BATCH];
+  double total = 0;
+  for (uint64_t i = 0; i < iterations; i += BATCH) {
+    double t0 = now_sec();
+    for (size_t j = 0; j < BATCH; j++)
+      blocks[j] = m(SIZE);
+    total += now_sec() - t0;
+    for (size_t j = 0; j < BATCH; j++)
+      f(blocks[j]);
+  }
+  return total;
+}
+
+static double pairs(malloc_fn m, free_fn f, uint64_t iterations) {
+  double t0 = now_sec();
+  for (uint64_t i = 0; i < iterations; i++) {
+    void *p = m(SIZE);
+    __asm__ volatile("" : : "r"(p) : "memory"); // keep the pair
+    f(p);
+  }
+  return now_sec() - t0;
+}
+
+static double run(double (*loop)(malloc_fn, free_fn, uint64_t), malloc_fn m,
+                  free_fn f) {
+  loop(m, f, ITERATIONS / 10); // warm up
+  double best = 1e9;
+  for (int rep = 0; rep < 5; rep++) {
+    double t = loop(m, f, ITERATIONS) * 1e9 / (double)ITERATIONS;
+    best = t < best ? t : best;
+  }
+  return best;
+}
+
+int main(void) {
+  void *libc = dlopen("libc.so.6", RTLD_NOW | RTLD_NOLOAD);
+  malloc_fn libc_malloc = libc ? (malloc_fn)dlsym(libc, "malloc") : NULL;
+  free_fn libc_free = libc ? (free_fn)dlsym(libc, "free") : NULL;
+  if (!libc_malloc || !libc_free) {
+    fprintf(stderr, "cannot find the C library's malloc\n");
+    return 1;
+  }
+  malloc_fn traced_malloc = (malloc_fn)dlsym(RTLD_DEFAULT, "malloc");
+  free_fn traced_free = (free_fn)dlsym(RTLD_DEFAULT, "free");
+  int preloaded = traced_malloc != libc_malloc;
+
+  ftr_init(discard, NULL);
+  double plain = run(mallocs, libc_malloc, libc_free);
+  double traced = run(mallocs, traced_malloc, traced_free);
+  double plain_pair = run(pairs, libc_malloc, libc_free);
+  double traced_pair = run(pairs, traced_malloc, traced_free);
+  ftr_close();
+
+  printf("%-14s %6.2f ns/malloc  %6.2f ns/pair\n", "libc", plain,
+         plain_pair);
+  printf("%-14s %6.2f ns/malloc  %6.2f ns/pair  (+%.2f ns, +%.2f ns)\n",
+         "libftr_malloc", traced, traced_pair, traced - plain,
+         traced_pair - plain_pair);
+  if (!preloaded) {
+    printf("libftr_malloc.so is not preloaded; nothing to compare\n");
+    return 0;
+  }
+  return traced - plain < BUDGET_NS ? 0 : 1;
+}
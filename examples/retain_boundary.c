@@ -0,0 +1,91 @@
+#include <ftr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Checks tail-based retention across a window boundary: a parent span that
+// starts in one window and ends in the next must not write a child that its
+// first window already kept. Exits non-zero if any span is in the FXT output
+// twice.
+
+#define WINDOW_MS 20
+#define MAX_SPANS 4096
+
+typedef struct {
+  uint8_t *data;
+  size_t len, cap;
+} capture_t;
+
+static void capture(const void *data, size_t len, void *userdata) {
+  capture_t *c = userdata;
+  if (c->len + len > c->cap) {
+    c->cap = (c->len + len) * 2;
+    c->data = realloc(c->data, c->cap);
+    if (!c->data)
+      abort();
+  }
+  memcpy(c->data + c->len, data, len);
+  c->len += len;
+}
+
+static void sleep_ms(long ms) {
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+static void workload(void) {
+  for (int i = 0; i < 3; i++) {
+    FTR_SCOPE("parent");
+    {
+      FTR_SCOPE("child");
+      sleep_ms(2);
+    }
+    sleep_ms(WINDOW_MS + 5); // the parent ends in a later window
+  }
+}
+
+static int read_u64(const capture_t *c, size_t word, uint64_t *v) {
+  if ((word + 1) * 8 > c->len)
+    return 0;
+  memcpy(v, c->data + word * 8, 8);
+  return 1;
+}
+
+int main(void) {
+  capture_t out = {NULL, 0, 0};
+  ftr_set_format(FTR_FORMAT_FXT);
+  ftr_set_retention(1, WINDOW_MS * 1000000ULL);
+  ftr_init(capture, &out);
+  workload();
+  ftr_close();
+
+  // Complete events (type 4, event type 4) without arguments: header, start,
+  // pid, tid, end.
+  static uint64_t spans[MAX_SPANS][3];
+  size_t n = 0, dups = 0;
+  uint64_t hdr;
+  for (size_t w = 0; read_u64(&out, w, &hdr);) {
+    size_t size = (hdr >> 4) & 0xfff;
+    if (size == 0)
+      break;
+    if ((hdr & 0xf) == 4 && ((hdr >> 16) & 0xf) == 4 &&
+        ((hdr >> 20) & 0xf) == 0 && size == 5 && n < MAX_SPANS) {
+      uint64_t start, end;
+      read_u64(&out, w + 1, &start);
+      read_u64(&out, w + 4, &end);
+      for (size_t i = 0; i < n; i++)
+        if (spans[i][0] == hdr && spans[i][1] == start && spans[i][2] == end)
+          dups++;
+      spans[n][0] = hdr;
+      spans[n][1] = start;
+      spans[n][2] = end;
+      n++;
+    }
+    w += size;
+  }
+  free(out.data);
+
+  printf("%zu spans retained, %zu duplicates\n", n, dups);
+  return n > 0 && dups == 0 ? 0 : 1;
+}
@@ -1,10 +1,18 @@
 #include "ftr.h"
 #include <assert.h>
 #include <stdarg.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#endif
 
 #undef ftr_logf
 #ifdef __APPLE__
@@ -12,6 +20,7 @@ static const char *os_getprogname(void) { return getprogname(); }
 #elif defined(__linux__)
 #include <errno.h>
 extern char *program_invocation_short_name;
+extern int sched_getcpu(void); // <sched.h> only declares it for _GNU_SOURCE
 static const char *os_getprogname(void) {
   return program_invocation_short_name;
 }
@@ -84,17 +93,92 @@ typedef union {
 
 #define FXT_MAX_STRINGS 0x7FFF // max unique interned strings
 #define FXT_STRING_MAXLEN 63   // max string length in bytes
+#define FTR_NAME_MAXLEN 1024   // names are kept up to this length (Perfetto)
 
+// The pool outlives trace sessions: an index, once assigned, names the same
+// string for the life of the process. `gen` is the session generation whose
+// trace last received the string record, so a new session re-emits each
+// string the first time it is used instead of starting the table over.
 typedef struct {
   const char *key;
+  uint16_t len;
+  uint32_t gen;
 } ftr_intern_entry_t;
 
 static ftr_intern_entry_t intern_pool[FXT_MAX_STRINGS];
 static uint16_t intern_count = 0;
+static atomic_flag intern_lock = ATOMIC_FLAG_INIT;
+
+// Content-keyed lookup for strings interned with ftr_intern_dynamic(). Open
+// addressing over string indexes (0 = empty); twice the pool size keeps the
+// load factor at or below 1/2. The keys themselves are owned copies that live
+// in a chain of bump-allocated chunks.
+#define FTR_DYN_TABLE_SIZE 0x10000
+#define FTR_DYN_CHUNK_SIZE (64 * 1024)
+
+typedef struct ftr_dyn_chunk {
+  struct ftr_dyn_chunk *next;
+  size_t pos;
+  char data[FTR_DYN_CHUNK_SIZE];
+} ftr_dyn_chunk_t;
+
+static uint16_t dyn_table[FTR_DYN_TABLE_SIZE];
+static ftr_dyn_chunk_t *dyn_chunks = NULL;
 
 #define FTR_SHARED_BUF_SIZE (256 * 1024 * 1024) // 256 KB
 
-static int trace_enabled = 0;
+// TRACE_OPEN spans ftr_init..ftr_close; TRACE_CAPTURE is whether events are
+// being captured within it (cleared by ftr_stop). Both live in one word so
+// that capture is only ever turned on while the session is still open.
+// Metadata such as string records is still written while a session is
+// paused. `session_meta` gates the metadata; it is raised before the session
+// is set up and published.
+#define TRACE_OPEN 1u
+#define TRACE_CAPTURE 2u
+static int session_meta = 0;
+static unsigned trace_state = 0;
+
+// Set while probe_calibrate times the write path on this thread: capture is
+// on for this thread alone, and its records go to a scratch buffer instead of
+// the shared one.
+#define FTR_PROBE_BUF_SIZE (64 * 1024)
+static __thread uint8_t *tls_probe_buf = NULL;
+static __thread size_t tls_probe_pos = 0;
+
+static inline int session_open(void) {
+  return (__atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) & TRACE_OPEN) != 0;
+}
+
+static inline int trace_enabled(void) {
+  if (__builtin_expect(
+          __atomic_load_n(&trace_state, __ATOMIC_RELAXED) & TRACE_CAPTURE, 1))
+    return 1;
+  return __builtin_expect(tls_probe_buf != NULL, 0);
+}
+
+// Turn capture on or off within the open session. Returns whether it
+// changed; nothing changes once the session is closed.
+static int capture_set(int on) {
+  unsigned s = __atomic_load_n(&trace_state, __ATOMIC_RELAXED);
+  for (;;) {
+    if (!(s & TRACE_OPEN) || !(s & TRACE_CAPTURE) == !on)
+      return 0;
+    unsigned next = on ? s | TRACE_CAPTURE : s & ~TRACE_CAPTURE;
+    if (__atomic_compare_exchange_n(&trace_state, &s, next, 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return 1;
+  }
+}
+
+// Bumped whenever a session opens or closes; see ftr_site_t.
+uint32_t ftr_generation = 1;
+// Bumped whenever capture (re)starts so coalesced counters are written again.
+static uint32_t counter_epoch = 0;
+
+static int g_format = FTR_FORMAT_FXT; // output format of the open session
+static unsigned g_retain_k = 0; // see "Tail-based retention", 0 = off
+static int g_cpu_mode = FTR_CPU_OFF; // see "CPU annotation"
+static int g_format_requested = -1;   // from ftr_set_format, -1 = unset
 static ftr_write_fn g_write_fn = NULL;
 static void *g_write_userdata = NULL;
 static FILE *g_file_handle = NULL;
@@ -103,7 +187,23 @@ static uint8_t shared_buf[FTR_SHARED_BUF_SIZE];
 static size_t shared_buf_pos = 0;
 static atomic_flag shared_buf_lock = ATOMIC_FLAG_INIT;
 
+// Number of ftr locks held by the calling thread. Interposers (malloc, ...)
+// check it through ftr_thread_busy() so that an allocation made by ftr itself
+// while holding a lock never calls back into ftr.
+static __thread int tls_locks_held = 0;
+
+// Self-overhead accounting (FTR_OVERHEAD) times every buffer lock section;
+// see "Self-overhead accounting" below.
+static int g_self_accounting = 0;
+static void self_buf_lock(void);
+static void self_buf_unlocked(void);
+
 static inline void buf_lock(void) {
+  tls_locks_held++;
+  if (__builtin_expect(g_self_accounting, 0)) {
+    self_buf_lock();
+    return;
+  }
   while (atomic_flag_test_and_set_explicit(&shared_buf_lock,
                                            memory_order_acquire)) {
   }
@@ -111,6 +211,29 @@ static inline void buf_lock(void) {
 
 static inline void buf_unlock(void) {
   atomic_flag_clear_explicit(&shared_buf_lock, memory_order_release);
+  tls_locks_held--;
+  if (__builtin_expect(g_self_accounting, 0))
+    self_buf_unlocked();
+}
+
+static inline void intern_lock_acquire(void) {
+  tls_locks_held++;
+  while (
+      atomic_flag_test_and_set_explicit(&intern_lock, memory_order_acquire)) {
+  }
+}
+
+static inline void intern_lock_release(void) {
+  atomic_flag_clear_explicit(&intern_lock, memory_order_release);
+  tls_locks_held--;
+}
+
+// Set on ftr's own background threads, whose waits and allocations belong
+// to ftr rather than to the program.
+static __thread int tls_internal_thread = 0;
+
+int ftr_thread_busy(void) {
+  return tls_locks_held != 0 || tls_internal_thread;
 }
 
 // ---------------------------------------------------------------------------
@@ -142,8 +265,23 @@ static inline void rec_str_padded(ftr_record_t *r, const char *s, size_t len) {
   }
 }
 
+static inline uint8_t *put_u64(uint8_t *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (uint8_t)(v >> (8 * i));
+  return p + 8;
+}
+
 static uint64_t g_ftr_pid = 0;
 
+// Clock domain of the current trace. Timestamps are in ticks (TSC on x86,
+// CLOCK_MONOTONIC_RAW nanoseconds elsewhere); the base pair ties one tick
+// reading to a CLOCK_MONOTONIC reading taken at the same instant, and the
+// 32.32 fixed-point multiplier converts nanoseconds to ticks without a divide.
+static uint64_t g_ticks_per_sec = 1000000000ULL;
+static uint64_t g_clock_base_ticks = 0;
+static uint64_t g_clock_base_ns = 0;
+static uint64_t g_ns_to_ticks_mult = 1ULL << 32;
+
 static _Atomic uint64_t next_local_thread_id = 0;
 static __thread uint64_t g_ftr_tid = (uint64_t)-1;
 
@@ -158,12 +296,56 @@ static uint64_t get_local_thread_id(void) {
 // referential (buf_append_locked flushes when the buffer is full, and
 // flush_locked appends a duration record after writing).
 static void flush_locked(void);
+static void write_clock_sync_locked(void);
+static void counter_session_start(void);
+static void counter_session_end(void);
+static void counter_sample(int final);
+static void counter_sampler_start(void);
+static void jump_labels_sync(int quiescent);
+static void pf_ftr_slice_locked(const char *name, ftr_timestamp_t start_ticks,
+                                ftr_timestamp_t end_ticks);
+static void pf_clock_snapshot_locked(uint64_t mono_ns, uint64_t real_ns);
+static void self_add_flush(uint64_t ticks);
+static void write_counter_at(uint16_t name_ref, ftr_timestamp_t ts,
+                             uint64_t tid, int64_t value,
+                             const int64_t *summary);
+static void self_session_start(void);
+static void self_session_end(void);
+static void probe_calibrate(void);
+static void write_probe_cost(void);
+static int retain_span(ftr_str_t name_ref, ftr_timestamp_t start,
+                       ftr_timestamp_t end, uint32_t start_cpu,
+                       uint32_t end_cpu);
+static int retain_flow(ftr_str_t name_ref, uint64_t flow_id, int event_type,
+                       ftr_timestamp_t ts);
+static void retain_flush_all(void);
+static void retain_session_end(void);
+static void retain_session_start(void);
+static void cpu_session_start(void);
+
+// Reserve `len` bytes of the calibration scratch buffer. Its contents are
+// never written out, so it simply wraps around.
+static uint8_t *probe_buf_reserve(size_t len) {
+  if (len > FTR_PROBE_BUF_SIZE)
+    return NULL;
+  if (tls_probe_pos + len > FTR_PROBE_BUF_SIZE)
+    tls_probe_pos = 0;
+  uint8_t *p = tls_probe_buf + tls_probe_pos;
+  tls_probe_pos += len;
+  return p;
+}
 
 // Append `len` bytes from `data` into the shared buffer, flushing first if
 // there isn't enough room.  The entire `len` bytes are guaranteed to land in a
 // single flush – a record is never split across two g_write_fn calls.
 // Must be called with the lock held.
 static void buf_append_locked(const void *data, size_t len) {
+  if (__builtin_expect(tls_probe_buf != NULL, 0)) {
+    uint8_t *p = probe_buf_reserve(len);
+    if (p)
+      memcpy(p, data, len);
+    return;
+  }
   if (shared_buf_pos + len > FTR_SHARED_BUF_SIZE) {
     flush_locked();
   }
@@ -177,6 +359,21 @@ static void buf_append_locked(const void *data, size_t len) {
   shared_buf_pos += len;
 }
 
+// Reserve `len` contiguous bytes in the shared buffer, flushing first if
+// there isn't enough room. Returns NULL if `len` exceeds the whole buffer.
+// Must be called with the lock held.
+static uint8_t *buf_reserve_locked(size_t len) {
+  if (__builtin_expect(tls_probe_buf != NULL, 0))
+    return probe_buf_reserve(len);
+  if (len > FTR_SHARED_BUF_SIZE)
+    return NULL;
+  if (shared_buf_pos + len > FTR_SHARED_BUF_SIZE)
+    flush_locked();
+  uint8_t *p = shared_buf + shared_buf_pos;
+  shared_buf_pos += len;
+  return p;
+}
+
 // Must be called with the lock held.
 static void flush_locked(void) {
   if (shared_buf_pos == 0)
@@ -187,9 +384,17 @@ static void flush_locked(void) {
     g_write_fn(shared_buf, shared_buf_pos, g_write_userdata);
   shared_buf_pos = 0;
   ftr_timestamp_t end_ns = ftr_now_ns();
+  if (g_self_accounting)
+    self_add_flush(end_ns - start_ns);
 
   // Record the flush itself as a duration event with inline name.
   static const char flush_name[] = "-flush-";
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    pf_ftr_slice_locked(flush_name, start_ns, end_ns);
+    if (trace_enabled())
+      write_clock_sync_locked();
+    return;
+  }
   size_t name_len = sizeof(flush_name) - 1;
   size_t name_words = (name_len + 7) / 8;
   size_t size_words = 1 + 3 + name_words + 1;
@@ -211,20 +416,742 @@ static void flush_locked(void) {
   rec_str_padded(&r, flush_name, name_len);
   rec_u64(&r, end_ns);
   buf_append_locked(r.data, r.pos);
+
+  if (trace_enabled())
+    write_clock_sync_locked();
+}
+
+// One-word argument (uint64 = 4, pointer = 7) with an inline name.
+static inline void rec_arg_word(ftr_record_t *r, int type, const char *name,
+                                uint64_t value) {
+  size_t name_len = strlen(name);
+  uint64_t arg_hdr = 0;
+  arg_hdr |= (uint64_t)type;
+  arg_hdr |= (uint64_t)(1 + (name_len + 7) / 8 + 1) << 4; // size_words
+  arg_hdr |= (uint64_t)(0x8000 | name_len) << 16;         // inline name
+  rec_u64(r, arg_hdr);
+  rec_str_padded(r, name, name_len);
+  rec_u64(r, value);
+}
+
+static inline void rec_arg_u64(ftr_record_t *r, const char *name,
+                               uint64_t value) {
+  rec_arg_word(r, 4, name, value);
+}
+
+// Process kernel object record naming `koid`.
+static inline void rec_process(ftr_record_t *r, uint64_t koid,
+                               const char *name, size_t name_len) {
+  size_t name_words = (name_len + 7) / 8;
+  size_t size_words = 2 + name_words;
+
+  uint64_t hdr = 0;
+  hdr |= (uint64_t)7; // Record Type: Kernel Object
+  hdr |= (uint64_t)size_words << 4;
+  hdr |= (uint64_t)1 << 16;                   // Object Type: 1 (Process)
+  hdr |= (uint64_t)(0x8000 | name_len) << 24; // Name string ref (inline)
+
+  rec_u64(r, hdr);
+  rec_u64(r, koid); // Word 1: Object ID
+  rec_str_padded(r, name, name_len);
+}
+
+// String argument with an inline name and inline value.
+static inline void rec_arg_str(ftr_record_t *r, const char *name,
+                               const char *value, size_t value_len) {
+  size_t name_len = strlen(name);
+  uint64_t arg_hdr = 0;
+  arg_hdr |= (uint64_t)6; // type: string
+  arg_hdr |= (uint64_t)(1 + (name_len + 7) / 8 + (value_len + 7) / 8) << 4;
+  arg_hdr |= (uint64_t)(0x8000 | name_len) << 16;
+  arg_hdr |= (uint64_t)(0x8000 | value_len) << 32;
+  rec_u64(r, arg_hdr);
+  rec_str_padded(r, name, name_len);
+  rec_str_padded(r, value, value_len);
+}
+
+// ---------------------------------------------------------------------------
+// Clock synchronization points
+//
+// A sync point pairs a tick reading with CLOCK_MONOTONIC and CLOCK_REALTIME,
+// emitted as a two-argument counter named "ftr.clock_sync". Offline tools
+// (ftr-merge) interpolate between them to move a trace onto a shared
+// timebase. One is written when tracing starts, after every flush, before
+// close, and every FTR_SYNC_INTERVAL_MS while events keep arriving.
+// ---------------------------------------------------------------------------
+
+#define FTR_SYNC_COUNTER_ID 0x636c6b73 // "clks"
+#define FTR_SYNC_CHECK_RECORDS 256     // records between interval checks
+
+static uint64_t g_sync_interval_ticks = 0; // 0 = no periodic sync points
+static uint64_t g_last_sync_ticks = 0;
+static uint32_t records_since_sync_check = 0;
+
+static uint64_t timespec_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+}
+
+// Must be called with the lock held.
+static void write_clock_sync_locked(void) {
+  struct timespec mono, real;
+  uint64_t t0 = ftr_now_ns();
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  uint64_t t1 = ftr_now_ns();
+  uint64_t ticks = t0 + (t1 - t0) / 2;
+  g_last_sync_ticks = ticks;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    pf_clock_snapshot_locked(timespec_ns(&mono), timespec_ns(&real));
+    return;
+  }
+
+  static const char name[] = "ftr.clock_sync";
+  size_t name_len = sizeof(name) - 1;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, 0); // header, patched below
+  rec_u64(&r, ticks);
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, get_local_thread_id());
+  rec_str_padded(&r, name, name_len);
+  rec_arg_u64(&r, "monotonic_ns", timespec_ns(&mono));
+  rec_arg_u64(&r, "realtime_ns", timespec_ns(&real));
+  rec_u64(&r, FTR_SYNC_COUNTER_ID);
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)(r.pos / 8);
+  ev.event_type = 1; // counter
+  ev.arg_count = 2;
+  ev.thread_ref = 0;
+  ev.name_ref = (uint16_t)(0x8000 | name_len);
+  ev.category_ref = 0;
+  put_u64(r.data, ev.raw);
+
+  buf_append_locked(r.data, r.pos);
+}
+
+// Must be called with the lock held.
+static inline void clock_sync_poll_locked(uint32_t nrecords) {
+  records_since_sync_check += nrecords;
+  if (records_since_sync_check < FTR_SYNC_CHECK_RECORDS)
+    return;
+  records_since_sync_check = 0;
+  if (g_sync_interval_ticks &&
+      ftr_now_ns() - g_last_sync_ticks >= g_sync_interval_ticks)
+    write_clock_sync_locked();
+}
+
+void ftr_clock_sync(void) {
+  if (!trace_enabled())
+    return;
+  buf_lock();
+  write_clock_sync_locked();
+  buf_unlock();
 }
 
 static void commit_record(ftr_record_t *r) {
-  if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+  if (!trace_enabled())
+    return;
+  buf_lock();
+  buf_append_locked(r->data, r->pos);
+  clock_sync_poll_locked(1);
+  buf_unlock();
+}
+
+// Like commit_record, but also written while capture is paused: for records
+// that later events depend on (strings, modules, process names).
+static void commit_meta_record(ftr_record_t *r) {
+  if (!__atomic_load_n(&session_meta, __ATOMIC_RELAXED))
     return;
   buf_lock();
   buf_append_locked(r->data, r->pos);
   buf_unlock();
 }
 
+// ---------------------------------------------------------------------------
+// Perfetto backend
+//
+// Writes Perfetto's protobuf trace format (a stream of `Trace.packet`
+// fields) instead of FXT. Every thread writes its own packet sequence with
+// incremental state: an event name is interned on the sequence the first
+// time the thread uses it, and timestamps are deltas on a sequence-scoped
+// incremental clock anchored to CLOCK_MONOTONIC. Packets are encoded straight
+// into the shared buffer under the buffer lock, so a sequence's state always
+// matches the bytes that reach the output. Process-wide packets (track
+// descriptors, clock snapshots, flushes) go on sequence 1 with absolute
+// timestamps.
+// ---------------------------------------------------------------------------
+
+// Field numbers from perfetto/protos/perfetto/trace/**.proto.
+enum {
+  PF_TRACE_PACKET = 1,
+
+  PF_PKT_CLOCK_SNAPSHOT = 6,
+  PF_PKT_TIMESTAMP = 8,
+  PF_PKT_SEQ_ID = 10,
+  PF_PKT_TRACK_EVENT = 11,
+  PF_PKT_INTERNED_DATA = 12,
+  PF_PKT_SEQUENCE_FLAGS = 13,
+  PF_PKT_TIMESTAMP_CLOCK_ID = 58,
+  PF_PKT_DEFAULTS = 59,
+  PF_PKT_TRACK_DESCRIPTOR = 60,
+
+  PF_DEFAULTS_TRACK_EVENT = 11, // TracePacketDefaults
+  PF_TE_DEFAULTS_TRACK_UUID = 11,
+
+  PF_CLOCKS = 1, // ClockSnapshot
+  PF_CLOCK_ID = 1,
+  PF_CLOCK_TIMESTAMP = 2,
+  PF_CLOCK_IS_INCREMENTAL = 3,
+
+  PF_INTERNED_EVENT_NAMES = 2, // InternedData
+  PF_IID = 1,
+  PF_INTERNED_NAME = 2,
+
+  PF_TD_UUID = 1, // TrackDescriptor
+  PF_TD_NAME = 2,
+  PF_TD_PROCESS = 3,
+  PF_TD_THREAD = 4,
+  PF_TD_PARENT_UUID = 5,
+  PF_TD_COUNTER = 8,
+  PF_PROC_PID = 1,
+  PF_PROC_NAME = 6,
+  PF_THREAD_PID = 1,
+  PF_THREAD_TID = 2,
+
+  PF_TE_DEBUG_ANNOTATIONS = 4, // TrackEvent
+  PF_TE_TYPE = 9,
+  PF_TE_NAME_IID = 10,
+  PF_TE_TRACK_UUID = 11,
+  PF_TE_CATEGORIES = 22,
+  PF_TE_NAME = 23,
+  PF_TE_COUNTER_VALUE = 30,
+  PF_TE_FLOW_IDS = 47,
+  PF_TE_TERMINATING_FLOW_IDS = 48,
+
+  PF_DA_UINT = 3, // DebugAnnotation
+  PF_DA_INT = 4,
+  PF_DA_STRING = 6,
+  PF_DA_POINTER = 7,
+  PF_DA_NAME = 10,
+};
+
+enum { PF_SLICE_BEGIN = 1, PF_SLICE_END = 2, PF_INSTANT = 3, PF_COUNTER = 4 };
+
+#define PF_CLOCK_REALTIME 1
+#define PF_CLOCK_MONOTONIC 3
+#define PF_CLOCK_BOOTTIME 6
+#define PF_CLOCK_INCREMENTAL 64 // first sequence-scoped clock id
+#define PF_SEQ_STATE_CLEARED 1
+#define PF_GLOBAL_SEQ 1
+
+static inline uint8_t *pb_varint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static inline uint8_t *pb_uint(uint8_t *p, uint32_t field, uint64_t v) {
+  p = pb_varint(p, (uint64_t)field << 3);
+  return pb_varint(p, v);
+}
+
+static inline uint8_t *pb_fixed64(uint8_t *p, uint32_t field, uint64_t v) {
+  p = pb_varint(p, (uint64_t)field << 3 | 1);
+  return put_u64(p, v);
+}
+
+static inline uint8_t *pb_str(uint8_t *p, uint32_t field, const char *s,
+                              size_t len) {
+  p = pb_varint(p, (uint64_t)field << 3 | 2);
+  p = pb_varint(p, len);
+  memcpy(p, s, len);
+  return p + len;
+}
+
+// Nested messages: reserve one length byte and open the body; pb_close
+// fills in the length, shifting the body up if it needs a longer varint.
+// Callers reserve a few spare bytes per nesting level for that.
+static inline uint8_t *pb_open(uint8_t *p, uint32_t field) {
+  p = pb_varint(p, (uint64_t)field << 3 | 2);
+  return p + 1;
+}
+
+static inline uint8_t *pb_close(uint8_t *body, uint8_t *end) {
+  size_t len = (size_t)(end - body);
+  if (len < 0x80) {
+    body[-1] = (uint8_t)len;
+    return end;
+  }
+  uint8_t tmp[10];
+  size_t n = (size_t)(pb_varint(tmp, len) - tmp);
+  memmove(body + n - 1, body, len);
+  memcpy(body - 1, tmp, n);
+  return end + n - 1;
+}
+
+// Give back the unused tail of a buf_reserve_locked() reservation.
+static inline void buf_trim_locked(uint8_t *start, size_t reserved,
+                                   uint8_t *end) {
+  size_t unused = reserved - (size_t)(end - start);
+  if (__builtin_expect(tls_probe_buf != NULL, 0))
+    tls_probe_pos -= unused;
+  else
+    shared_buf_pos -= unused;
+}
+
+static uint64_t g_ticks_to_ns_mult = 1ULL << 32; // 32.32 fixed point
+
+static inline uint64_t pf_ns(ftr_timestamp_t ticks) {
+  int64_t delta = (int64_t)(ticks - g_clock_base_ticks);
+  return g_clock_base_ns +
+         (uint64_t)(((__int128)delta * g_ticks_to_ns_mult) >> 32);
+}
+
+enum {
+  PF_TRACK_PROCESS = 1,
+  PF_TRACK_THREAD,
+  PF_TRACK_COUNTER,
+  PF_TRACK_FTR,
+  PF_TRACK_CPU,
+};
+
+static uint64_t pf_uuid(uint64_t kind, uint64_t id) {
+  uint64_t x = ((g_ftr_pid << 8 | kind) * 0x9E3779B97F4A7C15ULL) ^ id;
+  x ^= x >> 31;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 29;
+  return x | 1; // 0 means "the thread's own track"
+}
+
+static uint64_t pf_os_tid(void) {
+#if defined(__linux__)
+  return (uint64_t)syscall(SYS_gettid);
+#else
+  return get_local_thread_id() + 1;
+#endif
+}
+
+// Incremental state of the calling thread's sequence, valid for the session
+// generation it was started in.
+typedef struct {
+  uint32_t gen;
+  uint32_t seq_id;
+  uint64_t last_ns; // current value of the incremental clock
+  uint64_t names[FXT_MAX_STRINGS / 64 + 1]; // string indexes interned
+} pf_seq_t;
+
+static __thread pf_seq_t pf_seq;
+
+static const ftr_intern_entry_t pf_unnamed = {"unnamed", 7, 0};
+
+static inline const ftr_intern_entry_t *pf_string(ftr_str_t ref) {
+  return ref ? &intern_pool[ref - 1] : &pf_unnamed;
+}
+
+// Per-session descriptor bookkeeping, guarded by the buffer lock.
+static uint32_t pf_counter_gen[FXT_MAX_STRINGS + 1];
+#define PF_FOREIGN_TRACKS 1024
+static struct {
+  uint64_t tid;
+  uint32_t gen;
+} pf_foreign[PF_FOREIGN_TRACKS];
+
+// Start a packet on sequence 1 with an absolute CLOCK_MONOTONIC timestamp
+// (or none when `ns` is 0).
+static inline uint8_t *pf_global_packet(uint8_t **p, uint64_t ns) {
+  uint8_t *pkt = pb_open(*p, PF_TRACE_PACKET);
+  uint8_t *q = pkt;
+  if (ns) {
+    q = pb_uint(q, PF_PKT_TIMESTAMP, ns);
+    q = pb_uint(q, PF_PKT_TIMESTAMP_CLOCK_ID, PF_CLOCK_MONOTONIC);
+  }
+  *p = pb_uint(q, PF_PKT_SEQ_ID, PF_GLOBAL_SEQ);
+  return pkt;
+}
+
+// Must be called with the lock held.
+static void pf_thread_track_locked(uint64_t uuid, uint64_t tid) {
+  size_t reserved = 64;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint8_t *pkt = pf_global_packet(&p, 0);
+  uint8_t *td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+  p = pb_uint(td, PF_TD_UUID, uuid);
+  p = pb_uint(p, PF_TD_PARENT_UUID, pf_uuid(PF_TRACK_PROCESS, 0));
+  uint8_t *th = pb_open(p, PF_TD_THREAD);
+  p = pb_uint(th, PF_THREAD_PID, g_ftr_pid);
+  p = pb_uint(p, PF_THREAD_TID, tid);
+  p = pb_close(th, p);
+  p = pb_close(td, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+}
+
+// Open the calling thread's sequence for the current session: a packet that
+// clears incremental state, sets the packet defaults (incremental clock,
+// thread track) and ties the incremental clock to CLOCK_MONOTONIC.
+// Must be called with the lock held.
+static pf_seq_t *pf_seq_begin_locked(void) {
+  pf_seq_t *seq = &pf_seq;
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+  if (seq->gen == gen)
+    return seq;
+  uint64_t tid = get_local_thread_id();
+  uint64_t track = pf_uuid(PF_TRACK_THREAD, tid);
+  seq->gen = gen;
+  seq->seq_id = (uint32_t)tid + 2; // 1 is the global sequence
+  // Anchor at the session start so the thread's first events, written when
+  // their scopes close, can still use deltas.
+  seq->last_ns = g_clock_base_ns;
+  memset(seq->names, 0, sizeof(seq->names));
+  pf_thread_track_locked(track, pf_os_tid());
+
+  size_t reserved = 128;
+  uint8_t *start = buf_reserve_locked(reserved), *p;
+  uint8_t *pkt = pb_open(start, PF_TRACE_PACKET);
+  p = pb_uint(pkt, PF_PKT_TIMESTAMP, seq->last_ns);
+  p = pb_uint(p, PF_PKT_TIMESTAMP_CLOCK_ID, PF_CLOCK_MONOTONIC);
+  p = pb_uint(p, PF_PKT_SEQ_ID, seq->seq_id);
+  p = pb_uint(p, PF_PKT_SEQUENCE_FLAGS, PF_SEQ_STATE_CLEARED);
+  uint8_t *d = pb_open(p, PF_PKT_DEFAULTS);
+  p = pb_uint(d, PF_PKT_TIMESTAMP_CLOCK_ID, PF_CLOCK_INCREMENTAL);
+  uint8_t *ted = pb_open(p, PF_DEFAULTS_TRACK_EVENT);
+  p = pb_uint(ted, PF_TE_DEFAULTS_TRACK_UUID, track);
+  p = pb_close(ted, p);
+  p = pb_close(d, p);
+  uint8_t *cs = pb_open(p, PF_PKT_CLOCK_SNAPSHOT);
+  uint8_t *c = pb_open(cs, PF_CLOCKS);
+  p = pb_uint(c, PF_CLOCK_ID, PF_CLOCK_MONOTONIC);
+  p = pb_uint(p, PF_CLOCK_TIMESTAMP, seq->last_ns);
+  p = pb_close(c, p);
+  c = pb_open(p, PF_CLOCKS);
+  p = pb_uint(c, PF_CLOCK_ID, PF_CLOCK_INCREMENTAL);
+  p = pb_uint(p, PF_CLOCK_TIMESTAMP, seq->last_ns);
+  p = pb_uint(p, PF_CLOCK_IS_INCREMENTAL, 1);
+  p = pb_close(c, p);
+  p = pb_close(cs, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+  return seq;
+}
+
+// Must be called with the lock held.
+static uint64_t pf_counter_track_locked(ftr_str_t name_ref) {
+  uint64_t uuid = pf_uuid(PF_TRACK_COUNTER, name_ref);
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+  if (pf_counter_gen[name_ref] == gen)
+    return uuid;
+  pf_counter_gen[name_ref] = gen;
+
+  const ftr_intern_entry_t *name = pf_string(name_ref);
+  size_t reserved = 64 + name->len;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint8_t *pkt = pf_global_packet(&p, 0);
+  uint8_t *td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+  p = pb_uint(td, PF_TD_UUID, uuid);
+  p = pb_uint(p, PF_TD_PARENT_UUID, pf_uuid(PF_TRACK_PROCESS, 0));
+  p = pb_str(p, PF_TD_NAME, name->key, name->len);
+  p = pb_open(p, PF_TD_COUNTER);
+  p = pb_close(p, p);
+  p = pb_close(td, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+  return uuid;
+}
+
+// Track for events attributed to a thread id other than the caller's (bulk
+// import, ftr_write_span). Must be called with the lock held.
+static uint64_t pf_foreign_track_locked(uint64_t tid) {
+  if (tid == get_local_thread_id())
+    return 0;
+  uint64_t uuid = pf_uuid(PF_TRACK_THREAD, tid);
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+  uint32_t slot = (uint32_t)(tid * 0x9E3779B97F4A7C15ULL >> 54);
+  for (uint32_t probe = 0; probe < PF_FOREIGN_TRACKS; probe++) {
+    uint32_t i = (slot + probe) & (PF_FOREIGN_TRACKS - 1);
+    if (pf_foreign[i].gen == gen && pf_foreign[i].tid == tid)
+      return uuid;
+    if (pf_foreign[i].gen != gen) {
+      pf_foreign[i].tid = tid;
+      pf_foreign[i].gen = gen;
+      pf_thread_track_locked(uuid, tid);
+      return uuid;
+    }
+  }
+  return 0; // table full: fall back to the caller's track
+}
+
+typedef struct {
+  int type;                 // PF_SLICE_BEGIN, ...
+  ftr_timestamp_t ts;       // ticks
+  ftr_str_t name_ref;       // interned name, or 0
+  const char *name;         // inline name used when name_ref is 0
+  size_t name_len;
+  const char *cat;          // optional category
+  size_t cat_len;
+  int foreign;              // attribute to `tid` instead of the caller
+  uint64_t tid;
+  uint64_t track;           // explicit track uuid, or 0
+  int64_t counter_value;    // PF_COUNTER
+  uint64_t flow_id;         // 0 = none
+  int flow_terminating;
+  const ftr_arg_t *args;    // int64 debug annotations
+  size_t arg_count;
+} pf_event_t;
+
+// Must be called with the lock held.
+static void pf_write_event_locked(const pf_event_t *e) {
+  pf_seq_t *seq = pf_seq_begin_locked();
+  uint64_t track = e->track;
+  if (!track && e->type == PF_COUNTER)
+    track = pf_counter_track_locked(e->name_ref);
+  else if (!track && e->foreign)
+    track = pf_foreign_track_locked(e->tid);
+
+  const ftr_intern_entry_t *ne =
+      e->name_ref && e->type != PF_COUNTER ? &intern_pool[e->name_ref - 1]
+                                           : NULL;
+  size_t reserved = 128 + e->name_len + e->cat_len + (ne ? ne->len : 0);
+  for (size_t i = 0; i < e->arg_count; i++)
+    reserved += 32 + pf_string(e->args[i].name_ref)->len;
+  uint8_t *start = buf_reserve_locked(reserved), *p;
+  if (!start)
+    return;
+
+  uint8_t *pkt = pb_open(start, PF_TRACE_PACKET);
+  uint64_t ns = pf_ns(e->ts);
+  if (ns >= seq->last_ns) {
+    p = pb_uint(pkt, PF_PKT_TIMESTAMP, ns - seq->last_ns);
+    seq->last_ns = ns;
+  } else {
+    // Deltas can't go backwards (e.g. an enclosing scope's begin, written
+    // when the scope closes); use an absolute timestamp instead.
+    p = pb_uint(pkt, PF_PKT_TIMESTAMP, ns);
+    p = pb_uint(p, PF_PKT_TIMESTAMP_CLOCK_ID, PF_CLOCK_MONOTONIC);
+  }
+  p = pb_uint(p, PF_PKT_SEQ_ID, seq->seq_id);
+
+  uint64_t bit = 1ULL << (e->name_ref & 63);
+  if (ne && !(seq->names[e->name_ref >> 6] & bit)) {
+    seq->names[e->name_ref >> 6] |= bit;
+    uint8_t *id = pb_open(p, PF_PKT_INTERNED_DATA);
+    uint8_t *en = pb_open(id, PF_INTERNED_EVENT_NAMES);
+    p = pb_uint(en, PF_IID, e->name_ref);
+    p = pb_str(p, PF_INTERNED_NAME, ne->key, ne->len);
+    p = pb_close(en, p);
+    p = pb_close(id, p);
+  }
+
+  uint8_t *te = pb_open(p, PF_PKT_TRACK_EVENT);
+  p = pb_uint(te, PF_TE_TYPE, (uint64_t)e->type);
+  if (track)
+    p = pb_uint(p, PF_TE_TRACK_UUID, track);
+  if (ne)
+    p = pb_uint(p, PF_TE_NAME_IID, e->name_ref);
+  else if (e->name)
+    p = pb_str(p, PF_TE_NAME, e->name, e->name_len);
+  if (e->cat)
+    p = pb_str(p, PF_TE_CATEGORIES, e->cat, e->cat_len);
+  if (e->type == PF_COUNTER)
+    p = pb_uint(p, PF_TE_COUNTER_VALUE, (uint64_t)e->counter_value);
+  if (e->flow_id)
+    p = pb_fixed64(p,
+                   e->flow_terminating ? PF_TE_TERMINATING_FLOW_IDS
+                                       : PF_TE_FLOW_IDS,
+                   e->flow_id);
+  for (size_t i = 0; i < e->arg_count; i++) {
+    const ftr_intern_entry_t *an = pf_string(e->args[i].name_ref);
+    uint8_t *da = pb_open(p, PF_TE_DEBUG_ANNOTATIONS);
+    p = pb_str(da, PF_DA_NAME, an->key, an->len);
+    p = pb_uint(p, PF_DA_INT, (uint64_t)e->args[i].value);
+    p = pb_close(da, p);
+  }
+  p = pb_close(te, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+}
+
+// Fast path for the most common event pair: a slice on the caller's track
+// whose name the sequence has already interned. Both packets are short, so
+// their lengths fit in the single reserved byte.
+static inline uint8_t *pf_slice_packet(pf_seq_t *seq, uint8_t *p, int type,
+                                       uint64_t ns, ftr_str_t name_ref) {
+  uint8_t *pkt = pb_open(p, PF_TRACE_PACKET);
+  if (ns >= seq->last_ns) {
+    p = pb_uint(pkt, PF_PKT_TIMESTAMP, ns - seq->last_ns);
+    seq->last_ns = ns;
+  } else {
+    p = pb_uint(pkt, PF_PKT_TIMESTAMP, ns);
+    p = pb_uint(p, PF_PKT_TIMESTAMP_CLOCK_ID, PF_CLOCK_MONOTONIC);
+  }
+  p = pb_uint(p, PF_PKT_SEQ_ID, seq->seq_id);
+  uint8_t *te = pb_open(p, PF_PKT_TRACK_EVENT);
+  p = pb_uint(te, PF_TE_TYPE, (uint64_t)type);
+  if (name_ref)
+    p = pb_uint(p, PF_TE_NAME_IID, name_ref);
+  te[-1] = (uint8_t)(p - te);
+  pkt[-1] = (uint8_t)(p - pkt);
+  return p;
+}
+
+static void pf_write_slice(ftr_str_t name_ref, ftr_timestamp_t start_ticks,
+                           ftr_timestamp_t end_ticks) {
+  buf_lock();
+  if (trace_enabled()) {
+    pf_seq_t *seq = pf_seq_begin_locked();
+    if (name_ref && (seq->names[name_ref >> 6] & 1ULL << (name_ref & 63))) {
+      size_t reserved = 96;
+      uint8_t *start = buf_reserve_locked(reserved), *p = start;
+      p = pf_slice_packet(seq, p, PF_SLICE_BEGIN, pf_ns(start_ticks),
+                          name_ref);
+      p = pf_slice_packet(seq, p, PF_SLICE_END, pf_ns(end_ticks), 0);
+      buf_trim_locked(start, reserved, p);
+    } else {
+      pf_event_t begin = {
+          .type = PF_SLICE_BEGIN, .ts = start_ticks, .name_ref = name_ref};
+      pf_event_t end = {.type = PF_SLICE_END, .ts = end_ticks};
+      pf_write_event_locked(&begin);
+      pf_write_event_locked(&end);
+    }
+    clock_sync_poll_locked(2);
+  }
+  buf_unlock();
+}
+
+static void pf_commit_events(const pf_event_t *evs, size_t n) {
+  buf_lock();
+  if (trace_enabled()) {
+    for (size_t i = 0; i < n; i++)
+      pf_write_event_locked(&evs[i]);
+    clock_sync_poll_locked((uint32_t)n);
+  }
+  buf_unlock();
+}
+
+// Process descriptor plus the "ftr" track that carries ftr's own events.
+// Must be called with the lock held.
+static void pf_process_locked(const char *name, size_t name_len) {
+  size_t reserved = 128 + name_len;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint8_t *pkt = pf_global_packet(&p, 0);
+  uint8_t *td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+  p = pb_uint(td, PF_TD_UUID, pf_uuid(PF_TRACK_PROCESS, 0));
+  uint8_t *pd = pb_open(p, PF_TD_PROCESS);
+  p = pb_uint(pd, PF_PROC_PID, g_ftr_pid);
+  p = pb_str(p, PF_PROC_NAME, name, name_len);
+  p = pb_close(pd, p);
+  p = pb_close(td, p);
+  p = pb_close(pkt, p);
+
+  pkt = pf_global_packet(&p, 0);
+  td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+  p = pb_uint(td, PF_TD_UUID, pf_uuid(PF_TRACK_FTR, 0));
+  p = pb_uint(p, PF_TD_PARENT_UUID, pf_uuid(PF_TRACK_PROCESS, 0));
+  p = pb_str(p, PF_TD_NAME, "ftr", 3);
+  p = pb_close(td, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+}
+
+// A slice on the "ftr" track. Must be called with the lock held.
+static void pf_ftr_slice_locked(const char *name, ftr_timestamp_t start_ticks,
+                                ftr_timestamp_t end_ticks) {
+  size_t name_len = strlen(name);
+  size_t reserved = 128 + name_len;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint64_t track = pf_uuid(PF_TRACK_FTR, 0);
+  for (int end = 0; end < 2; end++) {
+    uint8_t *pkt = pf_global_packet(&p, pf_ns(end ? end_ticks : start_ticks));
+    uint8_t *te = pb_open(p, PF_PKT_TRACK_EVENT);
+    p = pb_uint(te, PF_TE_TYPE, end ? PF_SLICE_END : PF_SLICE_BEGIN);
+    p = pb_uint(p, PF_TE_TRACK_UUID, track);
+    if (!end)
+      p = pb_str(p, PF_TE_NAME, name, name_len);
+    p = pb_close(te, p);
+    p = pb_close(pkt, p);
+  }
+  buf_trim_locked(start, reserved, p);
+}
+
+// Snapshot of the clocks Perfetto knows, so that CLOCK_MONOTONIC timestamps
+// can be placed on the trace's BOOTTIME timeline (and realtime). Must be
+// called with the lock held.
+static void pf_clock_snapshot_locked(uint64_t mono_ns, uint64_t real_ns) {
+  uint64_t clocks[3][2] = {{PF_CLOCK_MONOTONIC, mono_ns},
+                           {PF_CLOCK_REALTIME, real_ns},
+                           {PF_CLOCK_BOOTTIME, 0}};
+  size_t nclocks = 2;
+#if defined(CLOCK_BOOTTIME)
+  struct timespec boot;
+  clock_gettime(CLOCK_BOOTTIME, &boot);
+  clocks[2][1] = (uint64_t)boot.tv_sec * 1000000000ULL + (uint64_t)boot.tv_nsec;
+  nclocks = 3;
+#endif
+  size_t reserved = 96;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint8_t *pkt = pf_global_packet(&p, 0);
+  uint8_t *cs = pb_open(p, PF_PKT_CLOCK_SNAPSHOT);
+  p = cs;
+  for (size_t i = 0; i < nclocks; i++) {
+    uint8_t *c = pb_open(p, PF_CLOCKS);
+    p = pb_uint(c, PF_CLOCK_ID, clocks[i][0]);
+    p = pb_uint(p, PF_CLOCK_TIMESTAMP, clocks[i][1]);
+    p = pb_close(c, p);
+  }
+  p = pb_close(cs, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+}
+
+// ftr.module as an instant on the "ftr" track with debug annotations.
+// Must be called with the lock held.
+static void pf_module_locked(const char *path, size_t path_len,
+                             uint64_t load_bias, uint64_t start_addr,
+                             uint64_t size) {
+  size_t reserved = 192 + path_len;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  uint8_t *pkt = pf_global_packet(&p, pf_ns(ftr_now_ns()));
+  uint8_t *te = pb_open(p, PF_PKT_TRACK_EVENT);
+  p = pb_uint(te, PF_TE_TYPE, PF_INSTANT);
+  p = pb_uint(p, PF_TE_TRACK_UUID, pf_uuid(PF_TRACK_FTR, 0));
+  p = pb_str(p, PF_TE_NAME, "ftr.module", 10);
+  struct {
+    const char *name;
+    uint32_t field;
+    uint64_t value;
+  } words[3] = {{"load_bias", PF_DA_POINTER, load_bias},
+                {"start", PF_DA_POINTER, start_addr},
+                {"size", PF_DA_UINT, size}};
+  uint8_t *da = pb_open(p, PF_TE_DEBUG_ANNOTATIONS);
+  p = pb_str(da, PF_DA_NAME, "path", 4);
+  p = pb_str(p, PF_DA_STRING, path, path_len);
+  p = pb_close(da, p);
+  for (int i = 0; i < 3; i++) {
+    da = pb_open(p, PF_TE_DEBUG_ANNOTATIONS);
+    p = pb_str(da, PF_DA_NAME, words[i].name, strlen(words[i].name));
+    p = pb_uint(p, words[i].field, words[i].value);
+    p = pb_close(da, p);
+  }
+  p = pb_close(te, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+}
+
 #if defined(__i386__) || defined(__x86_64__)
 static inline uint64_t rdtsc(void) {
   uint32_t lo, hi;
-  __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi));
+  __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi) : : "ecx");
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// rdtscp also loads IA32_TSC_AUX into ecx; Linux sets it to node << 12 | cpu.
+static inline uint64_t rdtscp_aux(uint32_t *aux) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(*aux));
   return ((uint64_t)hi << 32) | lo;
 }
 static uint64_t tsc_freq_calibrate(void) {
@@ -284,55 +1211,193 @@ static void file_write_fn(const void *data, size_t len, void *userdata) {
   fwrite(data, 1, len, (FILE *)userdata);
 }
 
+// Other threads may still be running at exit, so the call sites are only
+// patched there if that is safe; otherwise they are left enabled, and with
+// the session closed they record nothing.
+static int g_exiting = 0;
+
 static void ftr_on_exit(void) {
-  if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+  g_exiting = 1;
+  if (session_open())
     ftr_close();
 }
 
-static void ftr_do_init(void) {
-  g_ftr_pid = (uint64_t)getpid();
-  intern_count = 0;
+// Pair a tick reading with CLOCK_MONOTONIC, bracketing the clock_gettime call
+// with two tick reads and keeping the tightest of a few attempts.
+static void clock_base_calibrate(uint64_t ticks_per_sec) {
+  uint64_t best_window = UINT64_MAX;
+  for (int i = 0; i < 8; i++) {
+    struct timespec ts;
+    uint64_t t0 = ftr_now_ns();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t t1 = ftr_now_ns();
+    if (t1 - t0 < best_window) {
+      best_window = t1 - t0;
+      g_clock_base_ticks = t0 + (t1 - t0) / 2;
+      g_clock_base_ns =
+          (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+  }
+  g_ticks_per_sec = ticks_per_sec;
+  g_ns_to_ticks_mult =
+      (uint64_t)(((unsigned __int128)ticks_per_sec << 32) / 1000000000ULL);
+  g_ticks_to_ns_mult =
+      (uint64_t)(((unsigned __int128)1000000000ULL << 32) / ticks_per_sec);
+}
+
+#if defined(__linux__)
+// Call sites can't be patched from a signal handler, so the handler leaves
+// that to a thread of its own.
+static sem_t toggle_sem;
+static int toggle_thread_started = 0;
+
+static void *toggle_main(void *arg) {
+  (void)arg;
+  tls_internal_thread = 1;
+  for (;;) {
+    if (sem_wait(&toggle_sem) == 0)
+      jump_labels_sync(0);
+  }
+  return NULL;
+}
+
+static void toggle_thread_start(void) {
+  pthread_t thread;
+  if (sem_init(&toggle_sem, 0, 0) == 0 &&
+      pthread_create(&thread, NULL, toggle_main, NULL) == 0) {
+    pthread_detach(thread);
+    toggle_thread_started = 1;
+  }
+}
+#endif
+
+static void ftr_toggle_handler(int sig) {
+  (void)sig;
+  int on = !trace_enabled();
+  if (on)
+    __atomic_add_fetch(&counter_epoch, 1, __ATOMIC_RELEASE);
+  capture_set(on);
+#if defined(__linux__)
+  if (toggle_thread_started)
+    sem_post(&toggle_sem);
+#endif
+}
+
+// FTR_TOGGLE_SIGNAL names a signal ("USR2", "SIGUSR2" or a number) that
+// pauses and resumes capture. The handler only flips a flag.
+static void install_toggle_signal(void) {
+  const char *v = getenv("FTR_TOGGLE_SIGNAL");
+  if (!v || !*v)
+    return;
+  if (strncmp(v, "SIG", 3) == 0)
+    v += 3;
+  int sig = strcmp(v, "USR1") == 0   ? SIGUSR1
+            : strcmp(v, "USR2") == 0 ? SIGUSR2
+            : strcmp(v, "PROF") == 0 ? SIGPROF
+                                     : atoi(v);
+  if (sig <= 0)
+    return;
+#if defined(__linux__)
+  toggle_thread_start();
+#endif
+  struct sigaction sa = {0};
+  sa.sa_handler = ftr_toggle_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(sig, &sa, NULL);
+}
 
-  uint64_t ticks_per_sec = 1000000000ULL;
+static void ftr_do_init(void) {
+  // Process-wide setup survives ftr_close(), so later sessions skip the TSC
+  // calibration and don't stack atexit handlers.
+  static int process_setup_done = 0;
+  static uint64_t ticks_per_sec = 1000000000ULL;
+  if (!process_setup_done) {
 #if defined(__i386__) || defined(__x86_64__)
-  ticks_per_sec = tsc_freq_calibrate();
-  printf("[ftr] Calibrated TSC frequency: %lu Hz\n",
-         (unsigned long)ticks_per_sec);
+    ticks_per_sec = tsc_freq_calibrate();
+    printf("[ftr] Calibrated TSC frequency: %lu Hz\n",
+           (unsigned long)ticks_per_sec);
 #endif
+    install_toggle_signal();
+    atexit(ftr_on_exit);
+    process_setup_done = 1;
+  }
+  g_ftr_pid = (uint64_t)getpid();
+  clock_base_calibrate(ticks_per_sec);
+
+  // Write header directly — the session isn't open yet, so commit_record
+  // would drop it. Perfetto traces have no header.
+  if (g_format == FTR_FORMAT_FXT) {
+    ftr_record_t r = {.pos = 0};
+    rec_u64(&r, FXT_MAGIC);
+    fxt_init_hdr init = {0};
+    init.type = 1;
+    init.size_words = 2;
+    rec_u64(&r, init.raw);
+    rec_u64(&r, ticks_per_sec);
+    g_write_fn(r.data, r.pos, g_write_userdata);
+  }
 
-  // Write header directly — trace_enabled is still 0, so commit_record would
-  // drop it.
-  ftr_record_t r = {.pos = 0};
-  rec_u64(&r, FXT_MAGIC);
-  fxt_init_hdr init = {0};
-  init.type = 1;
-  init.size_words = 2;
-  rec_u64(&r, init.raw);
-  rec_u64(&r, ticks_per_sec);
-  g_write_fn(r.data, r.pos, g_write_userdata);
-
-  __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+  const char *sync_ms = getenv("FTR_SYNC_INTERVAL_MS");
+  uint64_t interval_ms = sync_ms ? strtoull(sync_ms, NULL, 10) : 1000;
+  g_sync_interval_ticks = interval_ms * (ticks_per_sec / 1000);
+
+  // Strings may be written from here on, so sites resolved while the session
+  // is being set up are valid in it. Invalidate every cached string index so
+  // it is replayed into this trace, then prepare all per-session state before
+  // anything can be recorded.
+  __atomic_store_n(&session_meta, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&ftr_generation, 1, __ATOMIC_RELEASE);
+  counter_session_start();
+  retain_session_start();
+  cpu_session_start();
+  int calibrate = getenv("FTR_CALIBRATE") != NULL;
+  if (calibrate)
+    probe_calibrate();
+  self_session_start();
+
+  __atomic_store_n(&trace_state, TRACE_OPEN | TRACE_CAPTURE, __ATOMIC_RELEASE);
+  jump_labels_sync(1);
+  counter_sampler_start();
   ftr_set_process_name(os_getprogname());
-  atexit(ftr_on_exit);
+  ftr_clock_sync();
+  if (calibrate)
+    write_probe_cost();
+  if (getenv("FTR_START_PAUSED"))
+    ftr_stop();
+}
+
+static int requested_format(void) {
+  if (g_format_requested >= 0)
+    return g_format_requested;
+  const char *v = getenv("FTR_FORMAT");
+  return v && strcmp(v, "perfetto") == 0 ? FTR_FORMAT_PERFETTO
+                                         : FTR_FORMAT_FXT;
 }
 
+void ftr_set_format(ftr_format_t format) { g_format_requested = (int)format; }
+
 void ftr_init(ftr_write_fn write_fn, void *userdata) {
-  if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+  if (session_open())
     return;
+  g_format = requested_format();
   g_write_fn = write_fn;
   g_write_userdata = userdata;
   ftr_do_init();
 }
 
 void ftr_init_file(const char *path) {
-  if (__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+  if (session_open())
     return;
-  if (!path)
+  if (!path || !*path)
     path = getenv("FTR_TRACE_PATH");
-  if (!path)
+  if (!path || !*path)
     path = "trace.fxt.gz";
 
   size_t len = strlen(path);
+  g_format = requested_format();
+  if (strstr(path, ".pftrace") || strstr(path, ".perfetto-trace"))
+    g_format = FTR_FORMAT_PERFETTO;
   if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
     char cmd[4096];
     snprintf(cmd, sizeof(cmd), "gzip > '%s'", path);
@@ -342,11 +1407,34 @@ void ftr_init_file(const char *path) {
     g_file_handle = fopen(path, "wb");
     g_file_is_pipe = 0;
   }
+  if (!g_file_handle) {
+    fprintf(stderr, "[ftr] cannot open %s\n", path);
+    return;
+  }
   g_write_fn = file_write_fn;
   g_write_userdata = g_file_handle;
   ftr_do_init();
 }
 
+void ftr_start(void) {
+  if (!session_open() || trace_enabled())
+    return;
+  __atomic_add_fetch(&counter_epoch, 1, __ATOMIC_RELEASE);
+  if (capture_set(1))
+    ftr_clock_sync();
+  jump_labels_sync(0);
+}
+
+void ftr_stop(void) {
+  // Coalesced counters and retained spans are written up to the pause.
+  if (trace_enabled()) {
+    counter_sample(1);
+    retain_flush_all();
+  }
+  capture_set(0);
+  jump_labels_sync(0);
+}
+
 __attribute__((constructor)) static void ftr_auto_init(void) {
   if (getenv("FTR_DISABLE"))
     return;
@@ -356,13 +1444,38 @@ __attribute__((constructor)) static void ftr_auto_init(void) {
   ftr_init_file(path);
 }
 
+#define FTR_MAX_CLOSE_HOOKS 8
+static void (*close_hooks[FTR_MAX_CLOSE_HOOKS])(void);
+static size_t close_hook_count = 0;
+
+void ftr_at_close(void (*fn)(void)) {
+  size_t i = __atomic_fetch_add(&close_hook_count, 1, __ATOMIC_ACQ_REL);
+  if (i < FTR_MAX_CLOSE_HOOKS)
+    __atomic_store_n(&close_hooks[i], fn, __ATOMIC_RELEASE);
+}
+
 void ftr_close(void) {
-  if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+  if (!session_open())
     return;
-  __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+  size_t nhooks = __atomic_load_n(&close_hook_count, __ATOMIC_ACQUIRE);
+  for (size_t i = 0; i < nhooks && i < FTR_MAX_CLOSE_HOOKS; i++) {
+    void (*fn)(void) = __atomic_load_n(&close_hooks[i], __ATOMIC_ACQUIRE);
+    if (fn)
+      fn();
+  }
+  counter_session_end();
+  retain_session_end();
+  g_cpu_mode = FTR_CPU_OFF;
+  self_session_end();
   buf_lock();
+  write_clock_sync_locked();
+  __atomic_store_n(&trace_state, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&session_meta, 0, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&ftr_generation, 1, __ATOMIC_RELEASE);
   flush_locked();
+  shared_buf_pos = 0; // the final flush's own span has nowhere to go
   buf_unlock();
+  jump_labels_sync(!g_exiting);
   if (g_file_handle) {
     if (g_file_is_pipe)
       pclose(g_file_handle);
@@ -395,126 +1508,1957 @@ ftr_timestamp_t ftr_now_ns(void) {
 #endif
 }
 
+ftr_timestamp_t ftr_now_cpu(uint32_t *cpu) {
+#if defined(__i386__) || defined(__x86_64__)
+  uint32_t aux;
+  ftr_timestamp_t now = rdtscp_aux(&aux);
+#if defined(__linux__)
+  *cpu = aux & 0xfff;
+#else
+  *cpu = FTR_CPU_UNKNOWN;
+#endif
+  return now;
+#else
+  *cpu = FTR_CPU_UNKNOWN;
+#if defined(__linux__)
+  if (g_cpu_mode != FTR_CPU_OFF) {
+    int c = sched_getcpu(); // served from rseq or the vDSO, not a syscall
+    if (c >= 0)
+      *cpu = (uint32_t)c;
+  }
+#endif
+  return ftr_now_ns();
+#endif
+}
+
 void ftr_write_span(uint64_t pid, uint64_t tid, const char *name,
                     ftr_timestamp_t start_ns, ftr_timestamp_t end_ns) {
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    size_t len = strlen(name);
+    pf_event_t evs[2] = {{.type = PF_SLICE_BEGIN,
+                          .ts = start_ns,
+                          .name = name,
+                          .name_len = len < FTR_NAME_MAXLEN ? len
+                                                            : FTR_NAME_MAXLEN,
+                          .cat = "app",
+                          .cat_len = 3,
+                          .foreign = 1,
+                          .tid = tid},
+                         {.type = PF_SLICE_END,
+                          .ts = end_ns,
+                          .foreign = 1,
+                          .tid = tid}};
+    (void)pid; // Perfetto tracks belong to the tracing process
+    pf_commit_events(evs, 2);
+    return;
+  }
+
+  const char *cat = "app";
+  size_t cat_len = 3;
+  size_t name_len = strlen(name);
+  size_t cat_words = (cat_len + 7) / 8;
+  size_t name_words = (name_len + 7) / 8;
+  size_t size_words = 1 + 3 + name_words + cat_words + 1;
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)size_words;
+  ev.event_type = 4;
+  ev.arg_count = 0;
+  ev.thread_ref = 0;
+  ev.name_ref = (uint16_t)(0x8000 | name_len);
+  ev.category_ref = (uint16_t)(0x8000 | cat_len);
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, ev.raw);
+  rec_u64(&r, start_ns);
+  rec_u64(&r, pid);
+  rec_u64(&r, tid);
+  rec_str_padded(&r, cat, cat_len);
+  rec_str_padded(&r, name, name_len);
+  rec_u64(&r, end_ns);
+
+  commit_record(&r);
+}
+
+// Bulk import works in chunks so names can be resolved (and any new string
+// records committed) before the shared lock is taken for the chunk's single
+// reservation. Imported spans mostly repeat a few names, so a small cache
+// keyed by name pointer keeps the content hash off the per-span path.
+#define FTR_IMPORT_CHUNK 1024
+#define FTR_IMPORT_MAX_ARGS 15
+#define FTR_IMPORT_NAME_CACHE 64
+
+static inline size_t import_record_words(const ftr_import_span_t *sp) {
+  size_t nargs = sp->arg_count;
+  if (nargs > FTR_IMPORT_MAX_ARGS)
+    nargs = FTR_IMPORT_MAX_ARGS;
+  // header + start + pid + tid + int64 args + end
+  return 1 + 3 + 2 * nargs + 1;
+}
+
+// Must be called outside the lock.
+static void pf_write_import_chunk(const ftr_import_span_t *chunk,
+                                  const ftr_str_t *refs, size_t n,
+                                  ftr_clock_t clock) {
+  buf_lock();
+  if (!trace_enabled()) {
+    buf_unlock();
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    const ftr_import_span_t *sp = &chunk[i];
+    ftr_timestamp_t start = sp->start, end = sp->end;
+    if (clock == FTR_CLOCK_MONOTONIC_NS) {
+      start = ftr_ns_to_ticks(start);
+      end = ftr_ns_to_ticks(end);
+    }
+    pf_event_t begin = {.type = PF_SLICE_BEGIN,
+                        .ts = start,
+                        .name_ref = refs[i],
+                        .foreign = 1,
+                        .tid = sp->tid,
+                        .args = sp->args,
+                        .arg_count = sp->arg_count < FTR_IMPORT_MAX_ARGS
+                                         ? sp->arg_count
+                                         : FTR_IMPORT_MAX_ARGS};
+    pf_event_t finish = {
+        .type = PF_SLICE_END, .ts = end, .foreign = 1, .tid = sp->tid};
+    pf_write_event_locked(&begin);
+    pf_write_event_locked(&finish);
+  }
+  clock_sync_poll_locked((uint32_t)n);
+  buf_unlock();
+}
+
+void ftr_write_spans(const ftr_import_span_t *spans, size_t count,
+                     ftr_clock_t clock) {
+  if (!trace_enabled())
+    return;
+
+  uint64_t pid = g_ftr_pid;
+  ftr_str_t refs[FTR_IMPORT_CHUNK];
+  struct {
+    const char *name;
+    ftr_str_t ref;
+  } names[FTR_IMPORT_NAME_CACHE] = {{0}};
+
+  for (size_t base = 0; base < count; base += FTR_IMPORT_CHUNK) {
+    size_t n = count - base;
+    if (n > FTR_IMPORT_CHUNK)
+      n = FTR_IMPORT_CHUNK;
+    const ftr_import_span_t *chunk = spans + base;
+
+    size_t total_words = 0;
+    for (size_t i = 0; i < n; i++) {
+      const char *name = chunk[i].name;
+      refs[i] = chunk[i].name_ref;
+      if (refs[i] == 0 && name) {
+        size_t slot = ((uintptr_t)name >> 3) % FTR_IMPORT_NAME_CACHE;
+        if (names[slot].name != name) {
+          names[slot].name = name;
+          names[slot].ref = ftr_intern_dynamic(name, strlen(name));
+        }
+        refs[i] = names[slot].ref;
+      }
+      total_words += import_record_words(&chunk[i]);
+    }
+    if (g_format == FTR_FORMAT_PERFETTO) {
+      pf_write_import_chunk(chunk, refs, n, clock);
+      continue;
+    }
+
+    buf_lock();
+    uint8_t *p = buf_reserve_locked(total_words * 8);
+    if (!p) {
+      buf_unlock();
+      return;
+    }
+    for (size_t i = 0; i < n; i++) {
+      const ftr_import_span_t *sp = &chunk[i];
+      size_t nargs = sp->arg_count;
+      if (nargs > FTR_IMPORT_MAX_ARGS)
+        nargs = FTR_IMPORT_MAX_ARGS;
+
+      ftr_timestamp_t start = sp->start, end = sp->end;
+      if (clock == FTR_CLOCK_MONOTONIC_NS) {
+        start = ftr_ns_to_ticks(start);
+        end = ftr_ns_to_ticks(end);
+      }
+
+      fxt_event_hdr ev = {0};
+      ev.type = 4;
+      ev.size_words = (uint64_t)import_record_words(sp);
+      ev.event_type = 4;
+      ev.arg_count = nargs;
+      ev.thread_ref = 0;
+      ev.name_ref = refs[i];
+      ev.category_ref = 0;
+
+      p = put_u64(p, ev.raw);
+      p = put_u64(p, start);
+      p = put_u64(p, pid);
+      p = put_u64(p, sp->tid);
+      for (size_t a = 0; a < nargs; a++) {
+        uint64_t arg_hdr = 0;
+        arg_hdr |= (uint64_t)3;                           // type: int64
+        arg_hdr |= (uint64_t)2 << 4;                      // size_words: 2
+        arg_hdr |= (uint64_t)sp->args[a].name_ref << 16; // arg name
+        p = put_u64(p, arg_hdr);
+        p = put_u64(p, (uint64_t)sp->args[a].value);
+      }
+      p = put_u64(p, end);
+    }
+    clock_sync_poll_locked((uint32_t)n);
+    buf_unlock();
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Self-overhead accounting
+//
+// With FTR_OVERHEAD set, every thread keeps tick totals of the time it spends
+// inside ftr, in four exclusive buckets:
+//   lock_wait — spinning for the buffer lock
+//   flush     — handing the buffer to the write callback
+//   commit    — the rest of its buffer lock sections (appending records)
+//   intern    — interning strings, minus the string records that commits
+// Encoding a record on the stack before the lock is taken is not counted;
+// FTR_CALIBRATE measures that part of the per-event cost. Every
+// FTR_OVERHEAD_INTERVAL_MS a thread writes the time it spent in each bucket
+// since its previous sample as counters "ftr.self.<bucket>_ns <block>", and
+// ftr_close() writes the session totals as an "ftr.overhead" instant on each
+// thread and prints them to stderr. A thread that exits first writes its
+// totals then, and its block goes to the next new thread.
+//
+// Lock order: registry -> intern -> buffer.
+// ---------------------------------------------------------------------------
+
+enum { SELF_COMMIT, SELF_LOCK_WAIT, SELF_INTERN, SELF_FLUSH, SELF_BUCKETS };
+
+static const char *const self_bucket_names[SELF_BUCKETS] = {
+    "commit_ns", "lock_wait_ns", "intern_ns", "flush_ns"};
+
+// Written only by the owning thread; ftr_close() reads the totals
+// concurrently.
+typedef struct self_block {
+  int owned;      // claimed by a live thread
+  uint32_t index; // names the block's counters
+  uint64_t tid;
+  uint64_t sections;  // buffer lock sections
+  uint64_t held;      // ticks from requesting the buffer lock to releasing it
+  uint64_t lock_wait; // ... of which spinning
+  uint64_t flush;     // ... of which in the write callback
+  uint64_t intern;
+  uint64_t os_tid; // for Perfetto's thread tracks
+  uint64_t last_sample; // ticks
+  uint64_t sampled[SELF_BUCKETS];
+  uint32_t refs_gen;
+  ftr_str_t refs[SELF_BUCKETS];
+  struct self_block *next;
+} self_stats_t;
+
+static uint64_t g_self_since = 0; // ticks at session start
+static uint64_t g_self_interval_ticks = 0;
+static __thread uint64_t tls_self_lock_start = 0;
+static __thread int tls_self_sampling = 0;
+
+static atomic_flag self_registry_lock = ATOMIC_FLAG_INIT;
+static self_stats_t *self_blocks = NULL;
+static uint32_t self_block_count = 0;
+static __thread self_stats_t *tls_self = NULL;
+static __thread int tls_self_exited = 0;
+static pthread_once_t self_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t self_key;
+
+// Held registry locks count as ftr locks: allocations made under them never
+// call back into ftr.
+static inline void self_registry_acquire(void) {
+  tls_locks_held++;
+  while (atomic_flag_test_and_set_explicit(&self_registry_lock,
+                                           memory_order_acquire)) {
+  }
+}
+
+static inline void self_registry_release(void) {
+  atomic_flag_clear_explicit(&self_registry_lock, memory_order_release);
+  tls_locks_held--;
+}
+
+// Zero the totals of `s` for a session that started at `since`.
+static void self_block_reset(self_stats_t *s, uint64_t since) {
+  s->sections = s->held = s->lock_wait = s->flush = s->intern = 0;
+  s->os_tid = 0;
+  s->last_sample = since;
+  memset(s->sampled, 0, sizeof(s->sampled));
+}
+
+static void self_thread_exit(void *arg);
+
+static void self_key_create(void) {
+  pthread_key_create(&self_key, self_thread_exit);
+}
+
+// Give the calling thread a block, reusing one left by an exited thread.
+// Must not be called with the buffer lock held.
+static self_stats_t *self_block_claim(void) {
+  if (tls_self_exited)
+    return NULL;
+  pthread_once(&self_key_once, self_key_create);
+  self_registry_acquire();
+  // Appended in claim order, so reports come out roughly by thread id.
+  self_stats_t **link = &self_blocks;
+  while (*link && (*link)->owned)
+    link = &(*link)->next;
+  self_stats_t *s = *link;
+  if (!s) {
+    s = calloc(1, sizeof(self_stats_t));
+    if (!s) {
+      self_registry_release();
+      return NULL;
+    }
+    s->index = self_block_count++;
+    *link = s;
+  }
+  self_block_reset(s, ftr_now_ns());
+  s->owned = 1;
+  s->tid = get_local_thread_id();
+  tls_self = s;
+  self_registry_release();
+  pthread_setspecific(self_key, s);
+  return s;
+}
+
+static inline self_stats_t *self_get(void) {
+  return tls_self ? tls_self : self_block_claim();
+}
+
+static inline void self_add(uint64_t *p, uint64_t v) {
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v,
+                   __ATOMIC_RELAXED);
+}
+
+static inline uint64_t self_ns(uint64_t ticks) {
+  return (uint64_t)(((unsigned __int128)ticks * g_ticks_to_ns_mult) >> 32);
+}
+
+static void self_totals(self_stats_t *s, uint64_t out[SELF_BUCKETS]) {
+  uint64_t held = __atomic_load_n(&s->held, __ATOMIC_RELAXED);
+  out[SELF_LOCK_WAIT] = __atomic_load_n(&s->lock_wait, __ATOMIC_RELAXED);
+  out[SELF_FLUSH] = __atomic_load_n(&s->flush, __ATOMIC_RELAXED);
+  out[SELF_INTERN] = __atomic_load_n(&s->intern, __ATOMIC_RELAXED);
+  // A section that is still open has its wait or flush counted already.
+  uint64_t inner = out[SELF_LOCK_WAIT] + out[SELF_FLUSH];
+  out[SELF_COMMIT] = held > inner ? held - inner : 0;
+}
+
+static void self_buf_lock(void) {
+  self_stats_t *s = self_get(); // claims take the registry lock first
+  uint64_t t0 = ftr_now_ns();
+  tls_self_lock_start = t0;
+  if (!atomic_flag_test_and_set_explicit(&shared_buf_lock,
+                                         memory_order_acquire))
+    return;
+  while (atomic_flag_test_and_set_explicit(&shared_buf_lock,
+                                           memory_order_acquire)) {
+  }
+  if (s)
+    self_add(&s->lock_wait, ftr_now_ns() - t0);
+}
+
+// Called with the buffer lock held, so never claims a block.
+static void self_add_flush(uint64_t ticks) {
+  self_stats_t *s = tls_self;
+  if (s)
+    self_add(&s->flush, ticks);
+}
+
+// Instant on thread `tid` (`os_tid` in Perfetto traces) with unsigned
+// arguments.
+static void write_stats_instant(const char *name, uint64_t tid,
+                                uint64_t os_tid, ftr_timestamp_t ts,
+                                const char *const *arg_names,
+                                const uint64_t *values, size_t n) {
+  size_t name_len = strlen(name);
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    ftr_arg_t args[8];
+    for (size_t i = 0; i < n; i++)
+      args[i] = (ftr_arg_t){ftr_intern_string(arg_names[i]),
+                            (int64_t)values[i]};
+    pf_event_t ev = {.type = PF_INSTANT,
+                     .ts = ts,
+                     .name = name,
+                     .name_len = name_len,
+                     .foreign = tid != get_local_thread_id(),
+                     .tid = os_tid,
+                     .args = args,
+                     .arg_count = n};
+    pf_commit_events(&ev, 1);
+    return;
+  }
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, 0); // header, patched below
+  rec_u64(&r, ts);
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, tid);
+  rec_str_padded(&r, name, name_len);
+  for (size_t i = 0; i < n; i++)
+    rec_arg_u64(&r, arg_names[i], values[i]);
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)(r.pos / 8);
+  ev.event_type = 0; // instant
+  ev.arg_count = n;
+  ev.thread_ref = 0;
+  ev.name_ref = (uint16_t)(0x8000 | name_len);
+  ev.category_ref = 0;
+  put_u64(r.data, ev.raw);
+
+  commit_record(&r);
+}
+
+// Write the time spent in each bucket since the previous sample. Called by
+// the owning thread with no ftr locks held.
+static void self_sample(self_stats_t *s, uint64_t now) {
+  tls_self_sampling = 1;
+  uint64_t tid = get_local_thread_id();
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  if (s->refs_gen != gen) {
+    for (int b = 0; b < SELF_BUCKETS; b++) {
+      char name[64];
+      int len = snprintf(name, sizeof(name), "ftr.self.%s %u",
+                         self_bucket_names[b], s->index);
+      s->refs[b] = ftr_intern_dynamic(name, (size_t)len);
+    }
+    s->refs_gen = gen;
+  }
+  uint64_t totals[SELF_BUCKETS];
+  self_totals(s, totals);
+  for (int b = 0; b < SELF_BUCKETS; b++) {
+    write_counter_at(s->refs[b], now, tid,
+                     (int64_t)self_ns(totals[b] - s->sampled[b]), NULL);
+    s->sampled[b] = totals[b];
+  }
+  s->last_sample = now;
+  tls_self_sampling = 0;
+}
+
+static void self_buf_unlocked(void) {
+  uint64_t start = tls_self_lock_start;
+  tls_self_lock_start = 0;
+  self_stats_t *s = self_get();
+  if (!s || start < g_self_since) // taken before accounting started
+    return;
+  uint64_t now = ftr_now_ns();
+  if (s->sections == 0)
+    __atomic_store_n(&s->os_tid, pf_os_tid(), __ATOMIC_RELAXED);
+  self_add(&s->held, now - start);
+  self_add(&s->sections, 1);
+  if (tls_locks_held == 0 && !tls_self_sampling &&
+      now - s->last_sample >= g_self_interval_ticks)
+    self_sample(s, now);
+}
+
+typedef struct {
+  uint64_t start, held;
+} self_mark_t;
+
+static inline self_mark_t self_intern_begin(void) {
+  self_mark_t m = {0, 0};
+  if (__builtin_expect(g_self_accounting, 0)) {
+    self_stats_t *s = self_get();
+    if (s) {
+      m.start = ftr_now_ns();
+      m.held = __atomic_load_n(&s->held, __ATOMIC_RELAXED);
+    }
+  }
+  return m;
+}
+
+static inline void self_intern_end(self_mark_t m) {
+  if (m.start == 0 || m.start < g_self_since)
+    return;
+  self_stats_t *s = tls_self;
+  uint64_t elapsed = ftr_now_ns() - m.start;
+  uint64_t nested = __atomic_load_n(&s->held, __ATOMIC_RELAXED) - m.held;
+  self_add(&s->intern, elapsed > nested ? elapsed - nested : 0);
+}
+
+static void self_session_start(void) {
+  const char *v = getenv("FTR_OVERHEAD");
+  if (!v || !*v || strcmp(v, "0") == 0)
+    return;
+  const char *ms = getenv("FTR_OVERHEAD_INTERVAL_MS");
+  uint64_t interval_ms = ms ? strtoull(ms, NULL, 10) : 100;
+  g_self_interval_ticks =
+      interval_ms ? interval_ms * (g_ticks_per_sec / 1000) : UINT64_MAX;
+  g_self_since = ftr_now_ns();
+  self_registry_acquire();
+  for (self_stats_t *s = self_blocks; s; s = s->next)
+    self_block_reset(s, g_self_since);
+  __atomic_store_n(&g_self_accounting, 1, __ATOMIC_RELEASE);
+  self_registry_release();
+}
+
+// Write the session totals of `s` and print them. Must be called with the
+// registry lock held, while the session can still take records.
+static void self_report_locked(self_stats_t *s, ftr_timestamp_t now) {
+  static const char *const arg_names[1 + SELF_BUCKETS] = {
+      "records", "commit_ns", "lock_wait_ns", "intern_ns", "flush_ns"};
+  double session_ms = (double)self_ns(now - g_self_since) / 1e6;
+  uint64_t values[1 + SELF_BUCKETS], totals[SELF_BUCKETS], sum = 0;
+  values[0] = __atomic_load_n(&s->sections, __ATOMIC_RELAXED);
+  self_totals(s, totals);
+  for (int b = 0; b < SELF_BUCKETS; b++)
+    sum += values[1 + b] = self_ns(totals[b]);
+  if (sum == 0)
+    return;
+  write_stats_instant("ftr.overhead", s->tid,
+                      __atomic_load_n(&s->os_tid, __ATOMIC_RELAXED), now,
+                      arg_names, values, 1 + SELF_BUCKETS);
+  fprintf(stderr,
+          "[ftr] thread %llu: %.3f ms in ftr (%.2f%% of %.0f ms): commit "
+          "%.3f, lock wait %.3f, intern %.3f, flush %.3f ms; %llu records\n",
+          (unsigned long long)s->tid, (double)sum / 1e6,
+          session_ms > 0 ? (double)sum / 1e4 / session_ms : 0.0, session_ms,
+          (double)values[1] / 1e6, (double)values[2] / 1e6,
+          (double)values[3] / 1e6, (double)values[4] / 1e6,
+          (unsigned long long)values[0]);
+}
+
+static void self_thread_exit(void *arg) {
+  self_stats_t *s = arg;
+  self_registry_acquire();
+  if (__atomic_load_n(&g_self_accounting, __ATOMIC_ACQUIRE))
+    self_report_locked(s, ftr_now_ns());
+  self_block_reset(s, 0);
+  s->owned = 0;
+  self_registry_release();
+  // Later TLS destructors may still take ftr locks; don't claim again.
+  tls_self = NULL;
+  tls_self_exited = 1;
+}
+
+// Must be called while the session can still take records.
+static void self_session_end(void) {
+  if (!g_self_accounting)
+    return;
+  self_registry_acquire();
+  __atomic_store_n(&g_self_accounting, 0, __ATOMIC_RELEASE);
+  ftr_timestamp_t now = ftr_now_ns();
+  for (self_stats_t *s = self_blocks; s; s = s->next)
+    if (s->owned)
+      self_report_locked(s, now);
+  self_registry_release();
+}
+
+// Cost of an empty scope, measured once per process with FTR_CALIBRATE:
+// the duration it records, and the time it adds to its enclosing scope.
+static int g_probe_calibrated = 0;
+static uint64_t g_probe_span_ticks = 0;
+static uint64_t g_probe_parent_ticks = 0;
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Times empty scopes through the real span path, in the session's CPU and
+// retention modes. Called while the session is being opened, after its
+// modes are set. Capture is on for this thread only and its records go to
+// a scratch buffer, so other threads and the trace are unaffected. Strings
+// it marked as written, and state staged for the session (retained spans),
+// are discarded by moving on to a new generation.
+static void probe_calibrate(void) {
+  enum { ROUNDS = 1001 };
+  static uint64_t clock_cost[ROUNDS], span[ROUNDS], parent[ROUNDS];
+  static const char name[] = "ftr.calibrate";
+  static uint8_t scratch[FTR_PROBE_BUF_SIZE];
+  if (g_probe_calibrated)
+    return;
+  tls_probe_buf = scratch;
+  tls_probe_pos = 0;
+  ftr_str_t ref = ftr_intern_string(name);
+  for (int i = 0; i < ROUNDS; i++) {
+    // The clock and write calls of ftr_begin_event/ftr_end_event.
+    uint32_t cpu, start_cpu, end_cpu;
+    ftr_timestamp_t t0 = ftr_now_cpu(&cpu);
+    ftr_timestamp_t t1 = ftr_now_cpu(&cpu);
+    clock_cost[i] = t1 - t0;
+
+    t0 = ftr_now_cpu(&cpu);
+    ftr_timestamp_t start = ftr_now_cpu(&start_cpu);
+    ftr_timestamp_t end = ftr_now_cpu(&end_cpu);
+    ftr_write_spani_cpu(ref, start, end, start_cpu, end_cpu);
+    t1 = ftr_now_cpu(&cpu);
+    span[i] = end - start;
+    parent[i] = t1 - t0;
+  }
+  tls_probe_buf = NULL;
+  __atomic_add_fetch(&ftr_generation, 1, __ATOMIC_RELEASE);
+
+  qsort(clock_cost, ROUNDS, sizeof(uint64_t), cmp_u64);
+  qsort(span, ROUNDS, sizeof(uint64_t), cmp_u64);
+  qsort(parent, ROUNDS, sizeof(uint64_t), cmp_u64);
+  uint64_t base = clock_cost[ROUNDS / 2], with_child = parent[ROUNDS / 2];
+  g_probe_span_ticks = span[ROUNDS / 2];
+  g_probe_parent_ticks = with_child > base ? with_child - base : 0;
+  g_probe_calibrated = 1;
+  printf("[ftr] Probe cost: %llu ns per empty scope, %llu ns added to the "
+         "enclosing scope\n",
+         (unsigned long long)self_ns(g_probe_span_ticks),
+         (unsigned long long)self_ns(g_probe_parent_ticks));
+}
+
+static void write_probe_cost(void) {
+  static const char *const arg_names[2] = {"span_ns", "parent_ns"};
+  uint64_t values[2] = {self_ns(g_probe_span_ticks),
+                        self_ns(g_probe_parent_ticks)};
+  write_stats_instant("ftr.calibration", get_local_thread_id(), pf_os_tid(),
+                      ftr_now_ns(), arg_names, values, 2);
+}
+
+// Emit the string record for `idx` unless the current session already has
+// it. Must be called with the intern lock held.
+static void intern_emit_locked(uint16_t idx) {
+  if (idx == 0 || !__atomic_load_n(&session_meta, __ATOMIC_ACQUIRE) ||
+      g_format == FTR_FORMAT_PERFETTO) // interned per sequence instead
+    return;
+  ftr_intern_entry_t *e = &intern_pool[idx - 1];
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+  if (e->gen == gen)
+    return;
+  e->gen = gen;
+
+  size_t len = e->len < FXT_STRING_MAXLEN ? e->len : FXT_STRING_MAXLEN;
+  size_t str_words = (len + 7) / 8;
+  fxt_string_hdr sh = {0};
+  sh.type = 2;
+  sh.size_words = 1 + str_words;
+  sh.str_index = idx;
+  sh.str_len = len;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, sh.raw);
+  rec_str_padded(&r, e->key, len);
+  commit_meta_record(&r);
+}
+
+// The table lives as long as the process, so running out is permanent; say
+// so once instead of silently dropping names. Intern lock held.
+static int intern_full_locked(void) {
+  static int warned = 0;
+  if (intern_count < FXT_MAX_STRINGS)
+    return 0;
+  if (!warned) {
+    warned = 1;
+    fprintf(stderr, "[ftr] string table full (%d entries), new names dropped\n",
+            FXT_MAX_STRINGS);
+  }
+  return 1;
+}
+
+// Assign the next string index to `key`. Returns 0 once the table is full.
+// Must be called with the intern lock held.
+static uint16_t intern_insert_locked(const char *key, size_t len) {
+  if (intern_full_locked())
+    return 0;
+  uint16_t idx = ++intern_count;
+  intern_pool[idx - 1] = (ftr_intern_entry_t){key, (uint16_t)len, 0};
+  return idx;
+}
+
+// Must be called with the intern lock held.
+static uint16_t intern_lookup_locked(const char *s) {
+  for (uint16_t i = 0; i < intern_count; i++)
+    if (intern_pool[i].key == s)
+      return i + 1;
+  size_t len = strlen(s);
+  if (len > FTR_NAME_MAXLEN)
+    len = FTR_NAME_MAXLEN;
+  return intern_insert_locked(s, len);
+}
+
+uint16_t ftr_intern_string(const char *s) {
+  self_mark_t m = self_intern_begin();
+  intern_lock_acquire();
+  uint16_t idx = intern_lookup_locked(s);
+  intern_emit_locked(idx);
+  intern_lock_release();
+  self_intern_end(m);
+  return idx;
+}
+
+ftr_str_t ftr_site_resolve(ftr_site_t *site, const char *name) {
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  uint16_t idx = (uint16_t)__atomic_load_n(&site->ref, __ATOMIC_RELAXED);
+  self_mark_t m = self_intern_begin();
+  intern_lock_acquire();
+  // A site that was resolved before only needs its string replayed.
+  if (idx == 0 || idx > intern_count || intern_pool[idx - 1].key != name)
+    idx = intern_lookup_locked(name);
+  intern_emit_locked(idx);
+  intern_lock_release();
+  self_intern_end(m);
+  __atomic_store_n(&site->ref, (uint64_t)gen << 16 | idx, __ATOMIC_RELAXED);
+  return idx;
+}
+
+// FNV-1a over the (truncated) string contents.
+static inline uint32_t dyn_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Copy `len` bytes of `s` into the chunk arena, NUL-terminated.
+// Must be called with the intern lock held.
+static const char *dyn_copy_locked(const char *s, size_t len) {
+  if (!dyn_chunks || dyn_chunks->pos + len + 1 > FTR_DYN_CHUNK_SIZE) {
+    ftr_dyn_chunk_t *c = malloc(sizeof(ftr_dyn_chunk_t));
+    if (!c)
+      return NULL;
+    c->next = dyn_chunks;
+    c->pos = 0;
+    dyn_chunks = c;
+  }
+  char *dst = dyn_chunks->data + dyn_chunks->pos;
+  memcpy(dst, s, len);
+  dst[len] = '\0';
+  dyn_chunks->pos += len + 1;
+  return dst;
+}
+
+uint16_t ftr_intern_dynamic(const char *s, size_t len) {
+  if (len > FTR_NAME_MAXLEN)
+    len = FTR_NAME_MAXLEN;
+
+  uint32_t slot = dyn_hash(s, len) & (FTR_DYN_TABLE_SIZE - 1);
+  self_mark_t m = self_intern_begin();
+  intern_lock_acquire();
+  for (;;) {
+    uint16_t idx = dyn_table[slot];
+    if (idx == 0)
+      break;
+    const char *key = intern_pool[idx - 1].key;
+    if (strncmp(key, s, len) == 0 && key[len] == '\0') {
+      intern_emit_locked(idx);
+      intern_lock_release();
+      self_intern_end(m);
+      return idx;
+    }
+    slot = (slot + 1) & (FTR_DYN_TABLE_SIZE - 1);
+  }
+
+  const char *key = intern_full_locked() ? NULL : dyn_copy_locked(s, len);
+  uint16_t idx = key ? intern_insert_locked(key, len) : 0;
+  dyn_table[slot] = idx;
+  intern_emit_locked(idx);
+  intern_lock_release();
+  self_intern_end(m);
+  return idx;
+}
+
+uint64_t ftr_ticks_per_second(void) { return g_ticks_per_sec; }
+
+ftr_timestamp_t ftr_ns_to_ticks(uint64_t monotonic_ns) {
+  int64_t delta = (int64_t)(monotonic_ns - g_clock_base_ns);
+  int64_t ticks = (int64_t)(((__int128)delta * g_ns_to_ticks_mult) >> 32);
+  return g_clock_base_ticks + (uint64_t)ticks;
+}
+
+void ftr_write_spani(uint16_t name_ref, ftr_timestamp_t start_ns,
+                     ftr_timestamp_t end_ns) {
+  if (__builtin_expect(g_retain_k != 0, 0) &&
+      retain_span(name_ref, start_ns, end_ns, FTR_CPU_UNKNOWN,
+                  FTR_CPU_UNKNOWN))
+    return;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (trace_enabled())
+      pf_write_slice(name_ref, start_ns, end_ns);
+    return;
+  }
+
+  uint64_t pid = g_ftr_pid;
+  uint64_t tid = get_local_thread_id();
+  size_t size_words = 1 + 3 + 1;
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)size_words;
+  ev.event_type = 4;
+  ev.arg_count = 0;
+  ev.thread_ref = 0;
+  ev.name_ref = name_ref;
+  ev.category_ref = 0;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, ev.raw);
+  rec_u64(&r, start_ns);
+  rec_u64(&r, pid);
+  rec_u64(&r, tid);
+  rec_u64(&r, end_ns);
+
+  commit_record(&r);
+}
+
+void ftr_write_span_named(const char *name, size_t len,
+                          ftr_timestamp_t start_ns, ftr_timestamp_t end_ns) {
+  if (len > FTR_NAME_MAXLEN)
+    len = FTR_NAME_MAXLEN;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    pf_event_t evs[2] = {
+        {.type = PF_SLICE_BEGIN, .ts = start_ns, .name = name, .name_len = len},
+        {.type = PF_SLICE_END, .ts = end_ns}};
+    pf_commit_events(evs, 2);
+    return;
+  }
+
+  if (len > 256)
+    len = 256; // keeps the record within an ftr_record_t
+  size_t name_words = (len + 7) / 8;
+  size_t size_words = 1 + 3 + name_words + 1;
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)size_words;
+  ev.event_type = 4;
+  ev.arg_count = 0;
+  ev.thread_ref = 0;
+  ev.name_ref = (uint16_t)(0x8000 | len);
+  ev.category_ref = 0;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, ev.raw);
+  rec_u64(&r, start_ns);
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, get_local_thread_id());
+  rec_str_padded(&r, name, len);
+  rec_u64(&r, end_ns);
+
+  commit_record(&r);
+}
+
+// ---------------------------------------------------------------------------
+// CPU annotation
+//
+// Scopes read the CPU along with both timestamps (ftr_now_cpu) and hand the
+// two readings to ftr_write_spani_cpu. FTR_CPU_ARGS gives each span a "cpu"
+// argument, and a "cpu_end" argument when the thread migrated while the
+// scope was open. FTR_CPU_TRACKS also writes a copy of each span, without
+// arguments, on a track per (CPU it started on, thread): in FXT a
+// pseudo-process "cpu N" holding the process's threads, in Perfetto a
+// "cpu N" track with one child track per thread. The copies nest like the
+// thread's own spans, so a long span and its children may sit on different
+// CPU tracks.
+// ---------------------------------------------------------------------------
+
+#define FTR_CPU_MAX 1024 // CPUs that get tracks; higher ones get arguments
+
+static int g_cpu_mode_requested = -1; // from ftr_set_cpu_mode, -1 = unset
+static uint32_t cpu_track_gen[FTR_CPU_MAX]; // guarded by the buffer lock
+
+// Perfetto child tracks the calling thread has described this session.
+static __thread struct {
+  uint32_t gen;
+  uint64_t described[FTR_CPU_MAX / 64];
+} pf_cpu_tls;
+
+void ftr_set_cpu_mode(ftr_cpu_mode_t mode) {
+  g_cpu_mode_requested = (int)mode;
+}
+
+static void cpu_session_start(void) {
+  int mode = g_cpu_mode_requested;
+  if (mode < 0) {
+    const char *v = getenv("FTR_CPU");
+    mode = !v                        ? FTR_CPU_OFF
+           : strcmp(v, "args") == 0   ? FTR_CPU_ARGS
+           : strcmp(v, "1") == 0      ? FTR_CPU_ARGS
+           : strcmp(v, "tracks") == 0 ? FTR_CPU_TRACKS
+                                      : FTR_CPU_OFF;
+  }
+  g_cpu_mode = mode;
+}
+
+// Object id of the FXT pseudo-process of `cpu`, out of the range of real
+// pids and distinct per traced process so that merged traces stay apart.
+static inline uint64_t cpu_koid(uint32_t cpu) {
+  return 1ULL << 62 | g_ftr_pid << 12 | cpu;
+}
+
+// One-word uint32 argument with an interned name.
+static inline uint64_t cpu_arg(ftr_str_t name_ref, uint32_t cpu) {
+  return 2 | 1 << 4 | (uint64_t)name_ref << 16 | (uint64_t)cpu << 32;
+}
+
+// Thread `tid`'s track under "cpu N". The calling thread's own tracks are
+// described on first use in the session; another thread's (`foreign`, when
+// retained spans are flushed) every time, since only the owner keeps track.
+// Must be called with the lock held.
+static uint64_t pf_cpu_track_locked(uint32_t cpu, uint64_t tid,
+                                    uint64_t os_tid, int foreign) {
+  uint64_t uuid = pf_uuid(PF_TRACK_CPU, (tid + 1) << 16 | cpu);
+  uint64_t parent = pf_uuid(PF_TRACK_CPU, cpu);
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+  if (!foreign) {
+    if (pf_cpu_tls.gen != gen) {
+      pf_cpu_tls.gen = gen;
+      memset(pf_cpu_tls.described, 0, sizeof(pf_cpu_tls.described));
+    }
+    uint64_t bit = 1ULL << (cpu & 63);
+    if (pf_cpu_tls.described[cpu >> 6] & bit)
+      return uuid;
+    pf_cpu_tls.described[cpu >> 6] |= bit;
+  }
+
+  char name[32];
+  size_t reserved = 192;
+  uint8_t *start = buf_reserve_locked(reserved), *p = start;
+  if (cpu_track_gen[cpu] != gen) {
+    cpu_track_gen[cpu] = gen;
+    int len = snprintf(name, sizeof(name), "cpu %u", cpu);
+    uint8_t *pkt = pf_global_packet(&p, 0);
+    uint8_t *td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+    p = pb_uint(td, PF_TD_UUID, parent);
+    p = pb_uint(p, PF_TD_PARENT_UUID, pf_uuid(PF_TRACK_PROCESS, 0));
+    p = pb_str(p, PF_TD_NAME, name, (size_t)len);
+    p = pb_close(td, p);
+    p = pb_close(pkt, p);
+  }
+  int len = snprintf(name, sizeof(name), "thread %llu",
+                     (unsigned long long)os_tid);
+  uint8_t *pkt = pf_global_packet(&p, 0);
+  uint8_t *td = pb_open(p, PF_PKT_TRACK_DESCRIPTOR);
+  p = pb_uint(td, PF_TD_UUID, uuid);
+  p = pb_uint(p, PF_TD_PARENT_UUID, parent);
+  p = pb_str(p, PF_TD_NAME, name, (size_t)len);
+  p = pb_close(td, p);
+  p = pb_close(pkt, p);
+  buf_trim_locked(start, reserved, p);
+  return uuid;
+}
+
+static void cpu_write_perfetto(uint16_t name_ref, ftr_timestamp_t start_ns,
+                               ftr_timestamp_t end_ns, const ftr_arg_t *args,
+                               size_t arg_count, uint32_t cpu, uint64_t tid,
+                               uint64_t os_tid, int foreign) {
+  pf_event_t evs[4] = {
+      {.type = PF_SLICE_BEGIN,
+       .ts = start_ns,
+       .name_ref = name_ref,
+       .args = args,
+       .arg_count = arg_count,
+       .foreign = foreign,
+       .tid = os_tid},
+      {.type = PF_SLICE_END, .ts = end_ns, .foreign = foreign, .tid = os_tid},
+      {.type = PF_SLICE_BEGIN, .ts = start_ns, .name_ref = name_ref},
+      {.type = PF_SLICE_END, .ts = end_ns},
+  };
+  buf_lock();
+  if (trace_enabled()) {
+    size_t n = 2;
+    if (g_cpu_mode == FTR_CPU_TRACKS && cpu < FTR_CPU_MAX) {
+      evs[2].track = evs[3].track =
+          pf_cpu_track_locked(cpu, tid, os_tid, foreign);
+      n = 4;
+    }
+    for (size_t i = 0; i < n; i++)
+      pf_write_event_locked(&evs[i]);
+    clock_sync_poll_locked((uint32_t)n);
+  }
+  buf_unlock();
+}
+
+// Write a span with its CPU readings for thread `tid` (`os_tid` in
+// Perfetto), which is not the calling thread when `foreign` is set.
+static void cpu_write_span(uint16_t name_ref, ftr_timestamp_t start_ns,
+                           ftr_timestamp_t end_ns, uint32_t start_cpu,
+                           uint32_t end_cpu, uint64_t tid, uint64_t os_tid,
+                           int foreign) {
+  if (!trace_enabled())
+    return;
+
+  // Unknown CPUs get no argument.
+  static ftr_site_t cpu_site, cpu_end_site;
+  ftr_arg_t args[2];
+  size_t arg_count = 0;
+  if (start_cpu != FTR_CPU_UNKNOWN)
+    args[arg_count++] =
+        (ftr_arg_t){ftr_site_ref(&cpu_site, "cpu"), start_cpu};
+  if (end_cpu != FTR_CPU_UNKNOWN && end_cpu != start_cpu)
+    args[arg_count++] =
+        (ftr_arg_t){ftr_site_ref(&cpu_end_site, "cpu_end"), end_cpu};
+
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    cpu_write_perfetto(name_ref, start_ns, end_ns, args, arg_count, start_cpu,
+                       tid, os_tid, foreign);
+    return;
+  }
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = 5 + arg_count;
+  ev.event_type = 4;
+  ev.arg_count = arg_count;
+  ev.name_ref = name_ref;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, ev.raw);
+  rec_u64(&r, start_ns);
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, tid);
+  for (size_t i = 0; i < arg_count; i++)
+    rec_u64(&r, cpu_arg(args[i].name_ref, (uint32_t)args[i].value));
+  rec_u64(&r, end_ns);
+  if (g_cpu_mode != FTR_CPU_TRACKS || start_cpu >= FTR_CPU_MAX) {
+    commit_record(&r);
+    return;
+  }
+
+  ev.size_words = 5;
+  ev.arg_count = 0;
+  ftr_record_t copy = {.pos = 0};
+  rec_u64(&copy, ev.raw);
+  rec_u64(&copy, start_ns);
+  rec_u64(&copy, cpu_koid(start_cpu));
+  rec_u64(&copy, tid);
+  rec_u64(&copy, end_ns);
+
+  buf_lock();
+  if (trace_enabled()) {
+    uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED);
+    if (cpu_track_gen[start_cpu] != gen) {
+      cpu_track_gen[start_cpu] = gen;
+      char name[32];
+      int len = snprintf(name, sizeof(name), "cpu %u", start_cpu);
+      ftr_record_t kobj = {.pos = 0};
+      rec_process(&kobj, cpu_koid(start_cpu), name, (size_t)len);
+      buf_append_locked(kobj.data, kobj.pos);
+    }
+    buf_append_locked(r.data, r.pos);
+    buf_append_locked(copy.data, copy.pos);
+    clock_sync_poll_locked(2);
+  }
+  buf_unlock();
+}
+
+void ftr_write_spani_cpu(uint16_t name_ref, ftr_timestamp_t start_ns,
+                         ftr_timestamp_t end_ns, uint32_t start_cpu,
+                         uint32_t end_cpu) {
+  if (__builtin_expect(g_cpu_mode == FTR_CPU_OFF, 1)) {
+    ftr_write_spani(name_ref, start_ns, end_ns);
+    return;
+  }
+  // Retained spans keep their CPUs and are written the same way when
+  // flushed.
+  if (g_retain_k &&
+      retain_span(name_ref, start_ns, end_ns, start_cpu, end_cpu))
+    return;
+  cpu_write_span(name_ref, start_ns, end_ns, start_cpu, end_cpu,
+                 get_local_thread_id(), 0, 0);
+}
+
+// Counter record at an explicit time, attributed to thread `tid`. With
+// `summary` (min, max, last) the record carries three arguments instead of
+// the single value.
+static void write_counter_at(uint16_t name_ref, ftr_timestamp_t ts,
+                             uint64_t tid, int64_t value,
+                             const int64_t *summary) {
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    // Summaries go on three separate tracks; see counter_emit_locked.
+    pf_event_t ev = {.type = PF_COUNTER,
+                     .ts = ts,
+                     .name_ref = name_ref,
+                     .counter_value = value};
+    pf_commit_events(&ev, 1);
+    return;
+  }
+  uint64_t pid = g_ftr_pid;
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.event_type = 1; // counter
+  ev.arg_count = summary ? 3 : 1;
+  ev.thread_ref = 0;
+  ev.name_ref = name_ref;
+  ev.category_ref = 0;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, 0); // header, patched below
+  rec_u64(&r, ts);
+  rec_u64(&r, pid);
+  rec_u64(&r, tid);
+  if (summary) {
+    rec_arg_word(&r, 3, "min", (uint64_t)summary[0]);
+    rec_arg_word(&r, 3, "max", (uint64_t)summary[1]);
+    rec_arg_word(&r, 3, "last", (uint64_t)summary[2]);
+  } else {
+    // Argument header: type=3 (int64), size=2 words, name_ref reuses name_ref
+    uint64_t arg_hdr = 0;
+    arg_hdr |= (uint64_t)3;              // type: int64
+    arg_hdr |= (uint64_t)2 << 4;         // size_words: 2
+    arg_hdr |= (uint64_t)name_ref << 16; // arg name
+    rec_u64(&r, arg_hdr);
+    rec_u64(&r, value);
+  }
+  rec_u64(&r, name_ref); // counter_id: use name_ref as stable id
+  ev.size_words = (uint64_t)(r.pos / 8);
+  put_u64(r.data, ev.raw);
+
+  commit_record(&r);
+}
+
+void ftr_write_counteri(uint16_t name_ref, int64_t value) {
+  write_counter_at(name_ref, ftr_now_ns(), get_local_thread_id(), value,
+                   NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Counter coalescing
+//
+// Outside FTR_COUNTER_ALL, FTR_COUNTER updates land in a per-thread table
+// keyed by counter name instead of going straight to the shared buffer. Each
+// slot remembers the last value written, and in the windowed modes the
+// pending value (and min/max) of the current window. A pending window is
+// written when the thread's next update falls into a later window, by the
+// sampler thread once the window has ended, when capture pauses, when the
+// thread exits and at close, so the value a trace shows at every window
+// boundary is the value the counter really had. The first update after a
+// session starts or resumes is always written.
+//
+// Atomic counters (ftr_atomic_counter_t) are shared by every thread and only
+// read by the sampler, which writes the ones that changed once per window.
+//
+// Lock order: registry -> block -> intern -> buffer.
+// ---------------------------------------------------------------------------
+
+#define FTR_COUNTER_SLOTS 256 // counters per thread; more are written raw
+
+typedef struct {
+  ftr_str_t name_ref; // 0 = empty
+  uint8_t pending;    // `last` not written yet
+  uint32_t epoch;     // counter_epoch that `written` belongs to
+  int64_t written;    // last value written to the trace
+  int64_t last, min, max;
+  ftr_timestamp_t last_ts; // time of `last`
+  uint64_t window;         // window of the pending values
+  ftr_str_t min_ref, max_ref; // Perfetto summary tracks
+} counter_slot_t;
+
+typedef struct counter_block {
+  atomic_flag lock;
+  int owned; // claimed by a live thread
+  uint64_t tid;
+  counter_slot_t slots[FTR_COUNTER_SLOTS];
+  struct counter_block *next;
+} counter_block_t;
+
+static int g_counter_mode = FTR_COUNTER_ALL; // mode of the open session
+static int g_counter_mode_requested = -1;    // from ftr_set_counter_mode
+static uint64_t g_counter_window_requested = 0; // ns, 0 = unset
+static uint64_t g_counter_window_ns = 10000000ULL;
+static uint64_t g_counter_window_ticks = 1;
+
+static atomic_flag counter_registry_lock = ATOMIC_FLAG_INIT;
+static counter_block_t *counter_blocks = NULL;
+static ftr_atomic_counter_t *atomic_counters = NULL;
+static __thread counter_block_t *tls_counters = NULL;
+static pthread_once_t counter_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t counter_key;
+
+static pthread_mutex_t sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sampler_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sampler_thread;
+static int sampler_running = 0;
+static int sampler_stop = 0;
+
+static inline void spin_acquire(atomic_flag *f) {
+  while (atomic_flag_test_and_set_explicit(f, memory_order_acquire)) {
+  }
+}
+
+static inline void spin_release(atomic_flag *f) {
+  atomic_flag_clear_explicit(f, memory_order_release);
+}
+
+// The registry lock counts as a held ftr lock: blocks are allocated under
+// it, and the allocation tracer registers its counters through it.
+static inline void counter_registry_acquire(void) {
+  tls_locks_held++;
+  spin_acquire(&counter_registry_lock);
+}
+
+static inline void counter_registry_release(void) {
+  spin_release(&counter_registry_lock);
+  tls_locks_held--;
+}
+
+void ftr_set_counter_mode(ftr_counter_mode_t mode, uint64_t window_ns) {
+  g_counter_mode_requested = (int)mode;
+  g_counter_window_requested = window_ns;
+}
+
+static inline uint64_t counter_window(ftr_timestamp_t ts) {
+  return (ts - g_clock_base_ticks) / g_counter_window_ticks;
+}
+
+// Write the pending window of `s`. Must be called with the block lock held.
+static void counter_emit_locked(counter_slot_t *s, uint64_t tid) {
+  s->pending = 0;
+  s->written = s->last;
+  if (g_counter_mode != FTR_COUNTER_SUMMARY) {
+    write_counter_at(s->name_ref, s->last_ts, tid, s->last, NULL);
+    return;
+  }
+  if (g_format == FTR_FORMAT_FXT) {
+    int64_t summary[3] = {s->min, s->max, s->last};
+    write_counter_at(s->name_ref, s->last_ts, tid, s->last, summary);
+    return;
+  }
+  if (!s->min_ref) {
+    const ftr_intern_entry_t *e = &intern_pool[s->name_ref - 1];
+    char name[FTR_NAME_MAXLEN + 8];
+    memcpy(name, e->key, e->len);
+    memcpy(name + e->len, ".min", 4);
+    s->min_ref = ftr_intern_dynamic(name, e->len + 4);
+    memcpy(name + e->len, ".max", 4);
+    s->max_ref = ftr_intern_dynamic(name, e->len + 4);
+  }
+  pf_event_t evs[3] = {
+      {.type = PF_COUNTER, .ts = s->last_ts, .name_ref = s->name_ref,
+       .counter_value = s->last},
+      {.type = PF_COUNTER, .ts = s->last_ts, .name_ref = s->min_ref,
+       .counter_value = s->min},
+      {.type = PF_COUNTER, .ts = s->last_ts, .name_ref = s->max_ref,
+       .counter_value = s->max},
+  };
+  pf_commit_events(evs, 3);
+}
+
+// Write every pending window of `b` that ended before `window` (all of
+// them when `window` is UINT64_MAX).
+static void counter_block_flush(counter_block_t *b, uint64_t window) {
+  spin_acquire(&b->lock);
+  for (size_t i = 0; i < FTR_COUNTER_SLOTS; i++) {
+    counter_slot_t *s = &b->slots[i];
+    if (s->pending && s->window < window)
+      counter_emit_locked(s, b->tid);
+  }
+  spin_release(&b->lock);
+}
+
+static void counter_thread_exit(void *arg) {
+  counter_block_t *b = arg;
+  counter_registry_acquire();
+  counter_block_flush(b, UINT64_MAX);
+  memset(b->slots, 0, sizeof(b->slots));
+  b->owned = 0;
+  counter_registry_release();
+  tls_counters = NULL;
+}
+
+static void counter_key_create(void) {
+  pthread_key_create(&counter_key, counter_thread_exit);
+}
+
+// Give the calling thread a block, reusing one left by an exited thread.
+static counter_block_t *counter_block_claim(void) {
+  pthread_once(&counter_key_once, counter_key_create);
+  counter_registry_acquire();
+  counter_block_t *b = counter_blocks;
+  while (b && b->owned)
+    b = b->next;
+  if (!b) {
+    b = calloc(1, sizeof(counter_block_t));
+    if (!b) {
+      counter_registry_release();
+      return NULL;
+    }
+    b->next = counter_blocks;
+    counter_blocks = b;
+  }
+  b->owned = 1;
+  b->tid = get_local_thread_id();
+  counter_registry_release();
+  pthread_setspecific(counter_key, b);
+  tls_counters = b;
+  return b;
+}
+
+static counter_slot_t *counter_slot_find(counter_block_t *b,
+                                         ftr_str_t name_ref) {
+  uint32_t h = (uint32_t)(name_ref * 0x9E3779B1u) >> 24;
+  for (uint32_t probe = 0; probe < FTR_COUNTER_SLOTS; probe++) {
+    counter_slot_t *s = &b->slots[(h + probe) & (FTR_COUNTER_SLOTS - 1)];
+    if (s->name_ref == name_ref)
+      return s;
+    if (s->name_ref == 0) {
+      s->name_ref = name_ref;
+      return s;
+    }
+  }
+  return NULL;
+}
+
+void ftr_counter_seti(uint16_t name_ref, int64_t value) {
+  int mode = g_counter_mode;
+  if (mode == FTR_COUNTER_ALL || name_ref == 0) {
+    ftr_write_counteri(name_ref, value);
+    return;
+  }
+  if (!trace_enabled())
+    return;
+  counter_block_t *b = tls_counters ? tls_counters : counter_block_claim();
+  if (!b) {
+    ftr_write_counteri(name_ref, value);
+    return;
+  }
+
+  ftr_timestamp_t now = ftr_now_ns();
+  uint32_t epoch = __atomic_load_n(&counter_epoch, __ATOMIC_RELAXED);
+  spin_acquire(&b->lock);
+  counter_slot_t *s = counter_slot_find(b, name_ref);
+  if (!s) {
+    spin_release(&b->lock);
+    ftr_write_counteri(name_ref, value);
+    return;
+  }
+  if (s->epoch != epoch) {
+    // First update since capture (re)started: write it as is.
+    s->epoch = epoch;
+    s->pending = 0;
+    s->written = value;
+    write_counter_at(name_ref, now, b->tid, value, NULL);
+  } else if (mode == FTR_COUNTER_ON_CHANGE) {
+    if (value != s->written) {
+      s->written = value;
+      write_counter_at(name_ref, now, b->tid, value, NULL);
+    }
+  } else {
+    uint64_t window = counter_window(now);
+    if (s->pending && s->window != window)
+      counter_emit_locked(s, b->tid);
+    if (s->pending) {
+      s->min = value < s->min ? value : s->min;
+      s->max = value > s->max ? value : s->max;
+      s->last = value;
+      s->last_ts = now;
+    } else if (mode == FTR_COUNTER_SUMMARY || value != s->written) {
+      s->pending = 1;
+      s->window = window;
+      s->min = s->max = s->last = value;
+      s->last_ts = now;
+    }
+  }
+  spin_release(&b->lock);
+}
+
+void ftr_atomic_counter_register(ftr_atomic_counter_t *c) {
+  counter_registry_acquire();
+  if (!__atomic_load_n(&c->registered, __ATOMIC_RELAXED)) {
+    c->next = atomic_counters;
+    atomic_counters = c;
+    __atomic_store_n(&c->registered, 1, __ATOMIC_RELEASE);
+  }
+  counter_registry_release();
+  counter_sampler_start();
+}
+
+// One sampler pass: write the windows that have ended (all of them when
+// `final`) and the atomic counters that changed. Serialized by the registry
+// lock, which also owns the atomic counters' sampled state.
+static void counter_sample(int final) {
+  counter_registry_acquire();
+  uint64_t window = final ? UINT64_MAX : counter_window(ftr_now_ns());
+  for (counter_block_t *b = counter_blocks; b; b = b->next)
+    if (b->owned)
+      counter_block_flush(b, window);
+
+  uint32_t epoch = __atomic_load_n(&counter_epoch, __ATOMIC_RELAXED);
+  for (ftr_atomic_counter_t *c = atomic_counters; c; c = c->next) {
+    int64_t v = __atomic_load_n(&c->value, __ATOMIC_RELAXED);
+    if (v == c->sampled && c->sampled_epoch == epoch)
+      continue;
+    ftr_str_t ref = ftr_site_ref(&c->site, c->name);
+    write_counter_at(ref, ftr_now_ns(), get_local_thread_id(), v, NULL);
+    c->sampled = v;
+    c->sampled_epoch = epoch;
+  }
+  counter_registry_release();
+}
+
+static void *counter_sampler_main(void *arg) {
+  (void)arg;
+  tls_internal_thread = 1;
+  pthread_mutex_lock(&sampler_mutex);
+  while (!sampler_stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t ns = (uint64_t)deadline.tv_nsec + g_counter_window_ns;
+    deadline.tv_sec += (time_t)(ns / 1000000000ULL);
+    deadline.tv_nsec = (long)(ns % 1000000000ULL);
+    pthread_cond_timedwait(&sampler_cond, &sampler_mutex, &deadline);
+    if (sampler_stop)
+      break;
+    pthread_mutex_unlock(&sampler_mutex);
+    if (trace_enabled())
+      counter_sample(0);
+    pthread_mutex_lock(&sampler_mutex);
+  }
+  pthread_mutex_unlock(&sampler_mutex);
+  return NULL;
+}
+
+// Start the sampler if the open session needs one: a windowed counter mode
+// or any atomic counter.
+static void counter_sampler_start(void) {
+  if (!session_open())
+    return;
+  if (g_counter_mode != FTR_COUNTER_INTERVAL &&
+      g_counter_mode != FTR_COUNTER_SUMMARY &&
+      !__atomic_load_n(&atomic_counters, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&sampler_mutex);
+  if (!sampler_running) {
+    sampler_stop = 0;
+    sampler_running =
+        pthread_create(&sampler_thread, NULL, counter_sampler_main, NULL) == 0;
+  }
+  pthread_mutex_unlock(&sampler_mutex);
+}
 
-  const char *cat = "app";
-  size_t cat_len = 3;
-  size_t name_len = strlen(name);
-  size_t cat_words = (cat_len + 7) / 8;
-  size_t name_words = (name_len + 7) / 8;
-  size_t size_words = 1 + 3 + name_words + cat_words + 1;
+static void counter_session_start(void) {
+  int mode = g_counter_mode_requested;
+  if (mode < 0) {
+    const char *v = getenv("FTR_COUNTER_MODE");
+    mode = !v                          ? FTR_COUNTER_ALL
+           : strcmp(v, "change") == 0   ? FTR_COUNTER_ON_CHANGE
+           : strcmp(v, "interval") == 0 ? FTR_COUNTER_INTERVAL
+           : strcmp(v, "summary") == 0  ? FTR_COUNTER_SUMMARY
+                                        : FTR_COUNTER_ALL;
+  }
+  uint64_t window_ns = g_counter_window_requested;
+  if (window_ns == 0) {
+    const char *v = getenv("FTR_COUNTER_WINDOW_MS");
+    window_ns = (v ? strtoull(v, NULL, 10) : 10) * 1000000ULL;
+    if (window_ns == 0)
+      window_ns = 10 * 1000000ULL;
+  }
+  g_counter_mode = mode;
+  g_counter_window_ns = window_ns;
+  g_counter_window_ticks =
+      (uint64_t)(((unsigned __int128)window_ns * g_ns_to_ticks_mult) >> 32);
+  if (g_counter_window_ticks == 0)
+    g_counter_window_ticks = 1;
+  __atomic_add_fetch(&counter_epoch, 1, __ATOMIC_RELEASE);
+}
+
+// Stop the sampler and write every pending value while the session can
+// still take them.
+static void counter_session_end(void) {
+  pthread_mutex_lock(&sampler_mutex);
+  int running = sampler_running;
+  sampler_stop = 1;
+  sampler_running = 0;
+  pthread_cond_signal(&sampler_cond);
+  pthread_mutex_unlock(&sampler_mutex);
+  if (running)
+    pthread_join(sampler_thread, NULL);
+  counter_sample(1);
+}
+
+// ---------------------------------------------------------------------------
+// Tail-based retention
+//
+// With a retention count K, spans written through ftr_write_spani (the
+// scope macros) and flow points are staged per thread instead of being
+// written. A completed span becomes a candidate for its name's min-heap of
+// the K longest spans in the current window. A candidate takes a copy of
+// everything the thread recorded since it began: its nested spans and flow
+// points, which sit at the end of the thread's log because a scope
+// completes after its children. When a span of the next window completes,
+// the thread writes its candidates, without duplicates, and a counter
+// "ftr.retain.dropped <block>" with the number of spans that did not make the
+// cut. Candidates are also written when capture pauses, when the thread
+// exits and at close. Written records are flagged in the log, so a span that
+// straddles a window boundary doesn't write its children a second time.
+//
+// The log keeps only the most recent FTR_RETAIN_LOG records. A span whose
+// subtree is larger than that keeps only the latest part.
+//
+// Lock order: registry -> block -> intern -> buffer.
+// ---------------------------------------------------------------------------
+
+#define FTR_RETAIN_MAX_K 16
+#define FTR_RETAIN_SITES 256  // names per thread; more are written raw
+#define FTR_RETAIN_LOG 4096   // recent records a parent can take along
+#define FTR_RETAIN_KEEP 16384 // records held by candidates
+
+typedef struct {
+  ftr_timestamp_t start; // a flow point's time
+  uint64_t end;          // a flow point's id
+  ftr_str_t name_ref;
+  uint8_t type;    // FXT event type: 4 = span, 8/9/10 = flow points
+  uint8_t written; // already in the trace
+  uint32_t seq;    // position in the block's log, consecutive
+  uint32_t cpu, cpu_end; // a span's CPU readings, or FTR_CPU_UNKNOWN
+} retain_rec_t;
+
+typedef struct {
+  uint64_t dur;
+  uint32_t off, len; // records in `keep`, the candidate itself last
+} retain_cand_t;
+
+typedef struct {
+  ftr_str_t name_ref; // 0 = empty
+  uint32_t count;
+  retain_cand_t heap[FTR_RETAIN_MAX_K]; // min-heap by duration
+} retain_site_t;
+
+typedef struct retain_block {
+  atomic_flag lock;
+  int owned;      // claimed by a live thread
+  uint32_t index; // names the block's dropped counter
+  uint64_t tid, os_tid;
+  uint32_t gen;    // session the contents belong to
+  uint64_t window; // window of the candidates
+  uint64_t dropped;
+  uint32_t dropped_gen;
+  ftr_str_t dropped_ref;
+  uint32_t log_seq; // seq of the next logged record
+  size_t log_len, keep_len;
+  retain_rec_t log[FTR_RETAIN_LOG];
+  retain_rec_t keep[FTR_RETAIN_KEEP];
+  retain_site_t sites[FTR_RETAIN_SITES];
+  retain_cand_t *live[FTR_RETAIN_SITES * FTR_RETAIN_MAX_K]; // compaction
+  struct retain_block *next;
+} retain_block_t;
+
+static unsigned g_retain_k_requested = 0;
+static uint64_t g_retain_window_requested = 0; // ns, 0 = unset
+static int g_retain_requested = 0;             // ftr_set_retention called
+static uint64_t g_retain_window_ticks = 1;
+
+static atomic_flag retain_registry_lock = ATOMIC_FLAG_INIT;
+static retain_block_t *retain_blocks = NULL;
+static uint32_t retain_block_count = 0;
+static __thread retain_block_t *tls_retain = NULL;
+static pthread_once_t retain_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t retain_key;
+
+// Retention locks count as held ftr locks, so that an allocation made while
+// holding one never calls back into ftr.
+static inline void retain_lock(atomic_flag *f) {
+  tls_locks_held++;
+  spin_acquire(f);
+}
+
+static inline void retain_unlock(atomic_flag *f) {
+  spin_release(f);
+  tls_locks_held--;
+}
+
+void ftr_set_retention(unsigned k, uint64_t window_ns) {
+  g_retain_k_requested = k;
+  g_retain_window_requested = window_ns;
+  g_retain_requested = 1;
+}
+
+// Completion order, the order the records would have been written in:
+// by end time (a flow point's time), nested spans before their parents.
+static int retain_rec_cmp(const void *a, const void *b) {
+  const retain_rec_t *x = a, *y = b;
+  uint64_t xe = x->type == 4 ? x->end : x->start;
+  uint64_t ye = y->type == 4 ? y->end : y->start;
+  if (xe != ye)
+    return xe < ye ? -1 : 1;
+  if (x->start != y->start)
+    return x->start > y->start ? -1 : 1;
+  if (x->type != y->type)
+    return x->type < y->type ? -1 : 1;
+  if (x->end != y->end)
+    return x->end < y->end ? -1 : 1;
+  if (x->name_ref != y->name_ref)
+    return x->name_ref < y->name_ref ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
+// Write one staged record on the block's thread. Must be called with the
+// block lock held.
+static void retain_write_locked(const retain_block_t *b,
+                                const retain_rec_t *r) {
+  if (r->type == 4 && g_cpu_mode != FTR_CPU_OFF &&
+      (r->cpu != FTR_CPU_UNKNOWN || r->cpu_end != FTR_CPU_UNKNOWN)) {
+    cpu_write_span(r->name_ref, r->start, r->end, r->cpu, r->cpu_end, b->tid,
+                   b->os_tid, b->tid != get_local_thread_id());
+    return;
+  }
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    int foreign = b->tid != get_local_thread_id();
+    if (r->type == 4) {
+      pf_event_t evs[2] = {{.type = PF_SLICE_BEGIN,
+                            .ts = r->start,
+                            .name_ref = r->name_ref,
+                            .foreign = foreign,
+                            .tid = b->os_tid},
+                           {.type = PF_SLICE_END,
+                            .ts = r->end,
+                            .foreign = foreign,
+                            .tid = b->os_tid}};
+      pf_commit_events(evs, 2);
+    } else {
+      pf_event_t ev = {.type = PF_INSTANT,
+                       .ts = r->start,
+                       .name_ref = r->name_ref,
+                       .foreign = foreign,
+                       .tid = b->os_tid,
+                       .flow_id = r->end,
+                       .flow_terminating = r->type == 10};
+      pf_commit_events(&ev, 1);
+    }
+    return;
+  }
+
+  // Spans and flow points share a layout: the end time or the flow id
+  // follows the thread.
   fxt_event_hdr ev = {0};
   ev.type = 4;
-  ev.size_words = (uint64_t)size_words;
-  ev.event_type = 4;
+  ev.size_words = 1 + 3 + 1;
+  ev.event_type = r->type;
   ev.arg_count = 0;
   ev.thread_ref = 0;
-  ev.name_ref = (uint16_t)(0x8000 | name_len);
-  ev.category_ref = (uint16_t)(0x8000 | cat_len);
+  ev.name_ref = r->name_ref;
+  ev.category_ref = 0;
 
-  ftr_record_t r = {.pos = 0};
-  rec_u64(&r, ev.raw);
-  rec_u64(&r, start_ns);
-  rec_u64(&r, pid);
-  rec_u64(&r, tid);
-  rec_str_padded(&r, cat, cat_len);
-  rec_str_padded(&r, name, name_len);
-  rec_u64(&r, end_ns);
+  ftr_record_t rec = {.pos = 0};
+  rec_u64(&rec, ev.raw);
+  rec_u64(&rec, r->start);
+  rec_u64(&rec, g_ftr_pid);
+  rec_u64(&rec, b->tid);
+  rec_u64(&rec, r->end);
+  commit_record(&rec);
+}
 
-  commit_record(&r);
+static int cmp_cand_off(const void *a, const void *b) {
+  const retain_cand_t *x = *(retain_cand_t *const *)a;
+  const retain_cand_t *y = *(retain_cand_t *const *)b;
+  return x->off < y->off ? -1 : x->off > y->off;
 }
 
-uint16_t ftr_intern_string(const char *s) {
-  if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
-    return 0;
-  for (uint16_t i = 0; i < intern_count; i++) {
-    if (intern_pool[i].key == s)
-      return i + 1;
+// Move the records of live candidates to the front of `keep`. Must be
+// called with the block lock held.
+static void retain_compact_locked(retain_block_t *b) {
+  size_t n = 0;
+  for (size_t i = 0; i < FTR_RETAIN_SITES; i++) {
+    retain_site_t *s = &b->sites[i];
+    for (uint32_t j = 0; j < s->count; j++)
+      b->live[n++] = &s->heap[j];
+  }
+  qsort(b->live, n, sizeof(retain_cand_t *), cmp_cand_off);
+  size_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    retain_cand_t *c = b->live[i];
+    memmove(&b->keep[pos], &b->keep[c->off], c->len * sizeof(retain_rec_t));
+    c->off = (uint32_t)pos;
+    pos += c->len;
   }
+  b->keep_len = pos;
+}
 
-  assert(intern_count < FXT_MAX_STRINGS && "intern table full");
+// Write the window's candidates and drop count, then start an empty
+// window. Must be called with the block lock held.
+static void retain_flush_locked(retain_block_t *b) {
+  if (b->keep_len == 0 && b->dropped == 0)
+    return;
+  retain_compact_locked(b);
+  qsort(b->keep, b->keep_len, sizeof(retain_rec_t), retain_rec_cmp);
+  uint32_t first_seq = b->log_len ? b->log[0].seq : 0;
+  for (size_t i = 0; i < b->keep_len; i++) {
+    const retain_rec_t *r = &b->keep[i];
+    if (r->written || (i > 0 && b->keep[i - 1].seq == r->seq))
+      continue;
+    retain_write_locked(b, r);
+    // Later candidates copy the flag along with the record.
+    uint32_t at = r->seq - first_seq;
+    if (at < b->log_len)
+      b->log[at].written = 1;
+  }
 
-  size_t len = strlen(s);
-  if (len > FXT_STRING_MAXLEN)
-    len = FXT_STRING_MAXLEN;
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  if (b->dropped_gen != gen) {
+    char name[64];
+    int len = snprintf(name, sizeof(name), "ftr.retain.dropped %u", b->index);
+    b->dropped_ref = ftr_intern_dynamic(name, (size_t)len);
+    b->dropped_gen = gen;
+  }
+  write_counter_at(b->dropped_ref, ftr_now_ns(), b->tid, (int64_t)b->dropped,
+                   NULL);
 
-  uint16_t idx = ++intern_count;
-  intern_pool[idx - 1].key = s;
+  for (size_t i = 0; i < FTR_RETAIN_SITES; i++)
+    b->sites[i].count = 0;
+  b->keep_len = 0;
+  b->dropped = 0;
+}
 
-  size_t str_words = (len + 7) / 8;
-  fxt_string_hdr sh = {0};
-  sh.type = 2;
-  sh.size_words = 1 + str_words;
-  sh.str_index = idx;
-  sh.str_len = (uint64_t)len;
+// Bring the block to the current session and to the window of `ts`. Must be
+// called with the block lock held.
+static void retain_enter_locked(retain_block_t *b, ftr_timestamp_t ts) {
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  if (b->gen != gen) {
+    memset(b->sites, 0, sizeof(b->sites));
+    b->log_len = b->keep_len = 0;
+    b->dropped = 0;
+    b->gen = gen;
+    b->window = 0;
+  }
+  uint64_t window = (ts - g_clock_base_ticks) / g_retain_window_ticks;
+  if (window > b->window) {
+    retain_flush_locked(b);
+    b->window = window;
+  }
+}
 
-  ftr_record_t r = {.pos = 0};
-  rec_u64(&r, sh.raw);
-  rec_str_padded(&r, s, len);
-  commit_record(&r);
+static void retain_log_locked(retain_block_t *b, const retain_rec_t *r) {
+  if (b->log_len == FTR_RETAIN_LOG) {
+    memmove(b->log, b->log + FTR_RETAIN_LOG / 2,
+            FTR_RETAIN_LOG / 2 * sizeof(retain_rec_t));
+    b->log_len = FTR_RETAIN_LOG / 2;
+  }
+  b->log[b->log_len++] = *r;
+  b->log_seq = r->seq + 1;
+}
 
-  return idx;
+static void retain_thread_exit(void *arg) {
+  retain_block_t *b = arg;
+  retain_lock(&retain_registry_lock);
+  retain_lock(&b->lock);
+  if (b->gen == __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE))
+    retain_flush_locked(b);
+  b->gen = 0;
+  b->owned = 0;
+  retain_unlock(&b->lock);
+  retain_unlock(&retain_registry_lock);
+  tls_retain = NULL;
 }
 
-void ftr_write_spani(uint16_t name_ref, ftr_timestamp_t start_ns,
-                     ftr_timestamp_t end_ns) {
+static void retain_key_create(void) {
+  pthread_key_create(&retain_key, retain_thread_exit);
+}
 
-  uint64_t pid = g_ftr_pid;
-  uint64_t tid = get_local_thread_id();
-  size_t size_words = 1 + 3 + 1;
+// Give the calling thread a block, reusing one left by an exited thread.
+static retain_block_t *retain_block_claim(void) {
+  pthread_once(&retain_key_once, retain_key_create);
+  retain_lock(&retain_registry_lock);
+  retain_block_t *b = retain_blocks;
+  while (b && b->owned)
+    b = b->next;
+  if (!b) {
+    b = calloc(1, sizeof(retain_block_t));
+    if (!b) {
+      retain_unlock(&retain_registry_lock);
+      return NULL;
+    }
+    b->index = retain_block_count++;
+    b->next = retain_blocks;
+    retain_blocks = b;
+  }
+  b->owned = 1;
+  b->tid = get_local_thread_id();
+  b->os_tid = pf_os_tid();
+  b->dropped_gen = 0; // intern the counter name again before its first use
+  retain_unlock(&retain_registry_lock);
+  pthread_setspecific(retain_key, b);
+  tls_retain = b;
+  return b;
+}
 
-  fxt_event_hdr ev = {0};
-  ev.type = 4;
-  ev.size_words = (uint64_t)size_words;
-  ev.event_type = 4;
-  ev.arg_count = 0;
-  ev.thread_ref = 0;
-  ev.name_ref = name_ref;
-  ev.category_ref = 0;
+static retain_site_t *retain_site_find(retain_block_t *b,
+                                       ftr_str_t name_ref) {
+  uint32_t h = (uint32_t)(name_ref * 0x9E3779B1u) >> 24;
+  for (uint32_t probe = 0; probe < FTR_RETAIN_SITES; probe++) {
+    retain_site_t *s = &b->sites[(h + probe) & (FTR_RETAIN_SITES - 1)];
+    if (s->name_ref == name_ref)
+      return s;
+    if (s->name_ref == 0) {
+      s->name_ref = name_ref;
+      return s;
+    }
+  }
+  return NULL;
+}
 
-  ftr_record_t r = {.pos = 0};
-  rec_u64(&r, ev.raw);
-  rec_u64(&r, start_ns);
-  rec_u64(&r, pid);
-  rec_u64(&r, tid);
-  rec_u64(&r, end_ns);
+static void retain_heap_down(retain_cand_t *h, uint32_t n, uint32_t i) {
+  for (;;) {
+    uint32_t l = 2 * i + 1, m = i;
+    if (l < n && h[l].dur < h[m].dur)
+      m = l;
+    if (l + 1 < n && h[l + 1].dur < h[m].dur)
+      m = l + 1;
+    if (m == i)
+      return;
+    retain_cand_t t = h[i];
+    h[i] = h[m];
+    h[m] = t;
+    i = m;
+  }
+}
 
-  commit_record(&r);
+static void retain_heap_up(retain_cand_t *h, uint32_t i) {
+  while (i > 0 && h[(i - 1) / 2].dur > h[i].dur) {
+    retain_cand_t t = h[i];
+    h[i] = h[(i - 1) / 2];
+    h[(i - 1) / 2] = t;
+    i = (i - 1) / 2;
+  }
 }
 
-void ftr_write_counteri(uint16_t name_ref, int64_t value) {
-  uint64_t pid = g_ftr_pid;
-  uint64_t tid = get_local_thread_id();
-  // header + timestamp + pid + tid + counter_id + arg_header + arg_value
-  size_t size_words = 1 + 3 + 1 + 2;
+// Stage a completed span. Returns 0 when it should be written directly.
+static int retain_span(ftr_str_t name_ref, ftr_timestamp_t start,
+                       ftr_timestamp_t end, uint32_t start_cpu,
+                       uint32_t end_cpu) {
+  if (!trace_enabled())
+    return 1;
+  retain_block_t *b = tls_retain ? tls_retain : retain_block_claim();
+  if (!b)
+    return 0;
+  retain_lock(&b->lock);
+  // Read under the block lock: retain_session_end clears it before its
+  // final flush, so a span is either flushed there or written directly.
+  uint32_t k = __atomic_load_n(&g_retain_k, __ATOMIC_RELAXED);
+  if (!k) {
+    retain_unlock(&b->lock);
+    return 0;
+  }
+  retain_enter_locked(b, end);
+  retain_site_t *s = retain_site_find(b, name_ref);
+  if (!s) {
+    retain_unlock(&b->lock);
+    return 0;
+  }
 
-  fxt_event_hdr ev = {0};
-  ev.type = 4;
-  ev.size_words = (uint64_t)size_words;
-  ev.event_type = 1; // counter
-  ev.arg_count = 1;
-  ev.thread_ref = 0;
-  ev.name_ref = name_ref;
-  ev.category_ref = 0;
+  retain_rec_t rec = {start, end, name_ref, 4, 0, b->log_seq, start_cpu,
+                      end_cpu};
+  uint64_t dur = end - start;
+  if (s->count < k || dur > s->heap[0].dur) {
+    if (s->count == k) { // evict the shortest
+      s->heap[0] = s->heap[--s->count];
+      retain_heap_down(s->heap, s->count, 0);
+      b->dropped++;
+    }
+    // Everything logged since the span began is nested inside it.
+    size_t first = b->log_len;
+    while (first > 0 && b->log[first - 1].start >= start)
+      first--;
+    size_t len = b->log_len - first + 1;
+    if (b->keep_len + len > FTR_RETAIN_KEEP)
+      retain_compact_locked(b);
+    if (b->keep_len + len > FTR_RETAIN_KEEP) {
+      len = FTR_RETAIN_KEEP - b->keep_len; // keep the latest children
+      first = b->log_len - (len - 1);
+    }
+    if (len == 0) {
+      b->dropped++;
+      retain_log_locked(b, &rec);
+      retain_unlock(&b->lock);
+      return 1;
+    }
+    retain_cand_t *c = &s->heap[s->count];
+    c->dur = dur;
+    c->off = (uint32_t)b->keep_len;
+    c->len = (uint32_t)len;
+    memcpy(&b->keep[b->keep_len], &b->log[first],
+           (len - 1) * sizeof(retain_rec_t));
+    b->keep[b->keep_len + len - 1] = rec;
+    b->keep_len += len;
+    retain_heap_up(s->heap, s->count++);
+  } else {
+    b->dropped++;
+  }
+  retain_log_locked(b, &rec);
+  retain_unlock(&b->lock);
+  return 1;
+}
 
-  // Argument header: type=3 (int64), size=2 words, name_ref reuses name_ref
-  uint64_t arg_hdr = 0;
-  arg_hdr |= (uint64_t)3;              // type: int64
-  arg_hdr |= (uint64_t)2 << 4;         // size_words: 2
-  arg_hdr |= (uint64_t)name_ref << 16; // arg name
+// Stage a flow point; it is written with any candidate span containing it.
+// Returns 0 when it should be written directly.
+static int retain_flow(ftr_str_t name_ref, uint64_t flow_id, int event_type,
+                       ftr_timestamp_t ts) {
+  if (!trace_enabled())
+    return 1;
+  retain_block_t *b = tls_retain ? tls_retain : retain_block_claim();
+  if (!b)
+    return 0;
+  retain_lock(&b->lock);
+  if (!__atomic_load_n(&g_retain_k, __ATOMIC_RELAXED)) {
+    retain_unlock(&b->lock);
+    return 0;
+  }
+  retain_enter_locked(b, ts);
+  retain_rec_t rec = {ts, flow_id, name_ref, (uint8_t)event_type, 0,
+                      b->log_seq};
+  retain_log_locked(b, &rec);
+  retain_unlock(&b->lock);
+  return 1;
+}
 
-  ftr_record_t r = {.pos = 0};
-  rec_u64(&r, ev.raw);
-  rec_u64(&r, ftr_now_ns());
-  rec_u64(&r, pid);
-  rec_u64(&r, tid);
-  rec_u64(&r, name_ref); // counter_id: use name_ref as stable id
-  rec_u64(&r, value);
-  rec_u64(&r, arg_hdr);
+static void retain_flush_blocks(void) {
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  retain_lock(&retain_registry_lock);
+  for (retain_block_t *b = retain_blocks; b; b = b->next) {
+    retain_lock(&b->lock);
+    if (b->owned && b->gen == gen)
+      retain_flush_locked(b);
+    retain_unlock(&b->lock);
+  }
+  retain_unlock(&retain_registry_lock);
+}
 
-  commit_record(&r);
+// Write every thread's candidates while the session can still take them.
+static void retain_flush_all(void) {
+  if (g_retain_k)
+    retain_flush_blocks();
+}
+
+// Stop staging, then write what was staged. A thread that is staging
+// holds its block lock, so it either finishes before that block is
+// flushed or sees retention off and writes its span directly.
+static void retain_session_end(void) {
+  if (!g_retain_k)
+    return;
+  __atomic_store_n(&g_retain_k, 0, __ATOMIC_SEQ_CST);
+  retain_flush_blocks();
+}
+
+static void retain_session_start(void) {
+  unsigned k = g_retain_k_requested;
+  uint64_t window_ns = g_retain_window_requested;
+  if (!g_retain_requested) {
+    const char *v = getenv("FTR_RETAIN_SLOWEST");
+    k = v ? (unsigned)strtoul(v, NULL, 10) : 0;
+  }
+  if (window_ns == 0) {
+    const char *v = getenv("FTR_RETAIN_WINDOW_MS");
+    window_ns = (v ? strtoull(v, NULL, 10) : 1000) * 1000000ULL;
+    if (window_ns == 0)
+      window_ns = 1000 * 1000000ULL;
+  }
+  g_retain_window_ticks =
+      (uint64_t)(((unsigned __int128)window_ns * g_ns_to_ticks_mult) >> 32);
+  if (g_retain_window_ticks == 0)
+    g_retain_window_ticks = 1;
+  g_retain_k = k < FTR_RETAIN_MAX_K ? k : FTR_RETAIN_MAX_K;
 }
 
 static _Atomic uint64_t next_flow_id = 1;
@@ -523,6 +3467,22 @@ uint64_t ftr_new_flow_id(void) { return atomic_fetch_add(&next_flow_id, 1); }
 
 static void ftr_write_flow_event(uint16_t name_ref, uint64_t flow_id,
                                  int event_type) {
+  ftr_timestamp_t ts = ftr_now_ns();
+  if (g_retain_k && retain_flow(name_ref, flow_id, event_type, ts))
+    return;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    // Perfetto attaches flows to slices; the flow point becomes an instant
+    // inside the enclosing scope.
+    if (!trace_enabled())
+      return;
+    pf_event_t ev = {.type = PF_INSTANT,
+                     .ts = ts,
+                     .name_ref = name_ref,
+                     .flow_id = flow_id,
+                     .flow_terminating = event_type == 10};
+    pf_commit_events(&ev, 1);
+    return;
+  }
   uint64_t pid = g_ftr_pid;
   uint64_t tid = get_local_thread_id();
   // header + timestamp + pid + tid + flow_correlation_id
@@ -539,7 +3499,7 @@ static void ftr_write_flow_event(uint16_t name_ref, uint64_t flow_id,
 
   ftr_record_t r = {.pos = 0};
   rec_u64(&r, ev.raw);
-  rec_u64(&r, ftr_now_ns());
+  rec_u64(&r, ts);
   rec_u64(&r, pid);
   rec_u64(&r, tid);
   rec_u64(&r, flow_id);
@@ -560,6 +3520,14 @@ void ftr_write_flow_endi(uint16_t name_ref, uint64_t flow_id) {
 }
 
 void ftr_write_marki(uint16_t name_ref) {
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    pf_event_t ev = {
+        .type = PF_INSTANT, .ts = ftr_now_ns(), .name_ref = name_ref};
+    pf_commit_events(&ev, 1);
+    return;
+  }
   uint64_t pid = g_ftr_pid;
   uint64_t tid = get_local_thread_id();
   size_t size_words = 1 + 3;
@@ -582,6 +3550,46 @@ void ftr_write_marki(uint16_t name_ref) {
   commit_record(&r);
 }
 
+void ftr_write_marki_args(uint16_t name_ref, const ftr_arg_t *args,
+                          size_t arg_count) {
+  if (arg_count > FTR_IMPORT_MAX_ARGS)
+    arg_count = FTR_IMPORT_MAX_ARGS;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    pf_event_t ev = {.type = PF_INSTANT,
+                     .ts = ftr_now_ns(),
+                     .name_ref = name_ref,
+                     .args = args,
+                     .arg_count = arg_count};
+    pf_commit_events(&ev, 1);
+    return;
+  }
+
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = 1 + 3 + 2 * arg_count;
+  ev.event_type = 0; // instant
+  ev.arg_count = arg_count;
+  ev.name_ref = name_ref;
+
+  ftr_record_t r = {.pos = 0};
+  rec_u64(&r, ev.raw);
+  rec_u64(&r, ftr_now_ns());
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, get_local_thread_id());
+  for (size_t a = 0; a < arg_count; a++) {
+    uint64_t arg_hdr = 0;
+    arg_hdr |= (uint64_t)3;                       // type: int64
+    arg_hdr |= (uint64_t)2 << 4;                  // size_words: 2
+    arg_hdr |= (uint64_t)args[a].name_ref << 16; // arg name
+    rec_u64(&r, arg_hdr);
+    rec_u64(&r, (uint64_t)args[a].value);
+  }
+
+  commit_record(&r);
+}
+
 void ftr_logf(const char *fmt, ...) {
   char msg[256];
   va_list args;
@@ -594,6 +3602,17 @@ void ftr_logf(const char *fmt, ...) {
   if (len > 255)
     len = 255;
 
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    pf_event_t ev = {.type = PF_INSTANT,
+                     .ts = ftr_now_ns(),
+                     .name = msg,
+                     .name_len = (size_t)len};
+    pf_commit_events(&ev, 1);
+    return;
+  }
+
   uint64_t pid = g_ftr_pid;
   uint64_t tid = get_local_thread_id();
 
@@ -621,6 +3640,20 @@ void ftr_logf(const char *fmt, ...) {
 
 static inline void write_begin_end(int event_type, const char *cat,
                                    const char *msg) {
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    if (!trace_enabled())
+      return;
+    size_t msg_len = strlen(msg), cat_len = strlen(cat);
+    pf_event_t ev = {
+        .type = event_type == 2 ? PF_SLICE_BEGIN : PF_SLICE_END,
+        .ts = ftr_now_ns(),
+        .name = msg,
+        .name_len = msg_len < FTR_NAME_MAXLEN ? msg_len : FTR_NAME_MAXLEN,
+        .cat = cat,
+        .cat_len = cat_len < FTR_NAME_MAXLEN ? cat_len : FTR_NAME_MAXLEN};
+    pf_commit_events(&ev, 1);
+    return;
+  }
   uint64_t pid = g_ftr_pid;
   uint64_t tid = get_local_thread_id();
 
@@ -662,19 +3695,303 @@ void ftr_set_process_name(const char *name) {
   size_t name_len = strlen(name);
   if (name_len > 255)
     name_len = 255;
-  size_t name_words = (name_len + 7) / 8;
-  size_t size_words = 2 + name_words;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    buf_lock();
+    if (session_open())
+      pf_process_locked(name, name_len);
+    buf_unlock();
+    return;
+  }
+  ftr_record_t r = {.pos = 0};
+  rec_process(&r, g_ftr_pid, name, name_len);
+  commit_meta_record(&r);
+}
 
-  uint64_t hdr = 0;
-  hdr |= (uint64_t)7; // Record Type: Kernel Object
-  hdr |= (uint64_t)size_words << 4;
-  hdr |= (uint64_t)1 << 16;                   // Object Type: 1 (Process)
-  hdr |= (uint64_t)(0x8000 | name_len) << 24; // Name string ref (inline)
+void ftr_write_module(const char *path, uint64_t load_bias, uint64_t start,
+                      uint64_t size) {
+  static const char name[] = "ftr.module";
+  size_t name_len = sizeof(name) - 1;
+  size_t path_len = strlen(path);
+  if (path_len > 255)
+    path_len = 255;
+  if (g_format == FTR_FORMAT_PERFETTO) {
+    buf_lock();
+    if (session_open())
+      pf_module_locked(path, path_len, load_bias, start, size);
+    buf_unlock();
+    return;
+  }
 
   ftr_record_t r = {.pos = 0};
-  rec_u64(&r, hdr);
-  rec_u64(&r, g_ftr_pid); // Word 1: Object ID
+  rec_u64(&r, 0); // header, patched below
+  rec_u64(&r, ftr_now_ns());
+  rec_u64(&r, g_ftr_pid);
+  rec_u64(&r, get_local_thread_id());
   rec_str_padded(&r, name, name_len);
+  rec_arg_str(&r, "path", path, path_len);
+  rec_arg_word(&r, 7, "load_bias", load_bias);
+  rec_arg_word(&r, 7, "start", start);
+  rec_arg_u64(&r, "size", size);
 
-  commit_record(&r);
-}
\ No newline at end of file
+  fxt_event_hdr ev = {0};
+  ev.type = 4;
+  ev.size_words = (uint64_t)(r.pos / 8);
+  ev.event_type = 0; // instant
+  ev.arg_count = 4;
+  ev.thread_ref = 0;
+  ev.name_ref = (uint16_t)(0x8000 | name_len);
+  ev.category_ref = 0;
+  put_u64(r.data, ev.raw);
+
+  commit_meta_record(&r);
+}
+
+int ftr_is_enabled(void) {
+  return trace_enabled();
+}
+
+// ---------------------------------------------------------------------------
+// Patchable call sites (FTR_STATIC_KEYS)
+//
+// Every guarded site starts as a 5-byte `jmp` into its tracing code, so a
+// binary whose sites can't be patched still traces. Each module registers its
+// ftr_jump_table section from a constructor; while capture is off the jumps
+// are rewritten to 5-byte NOPs. Sites are 8-byte aligned, and other threads
+// may be running through them, so a site is rewritten the way the kernel
+// rewrites live text: an int3 goes on its first byte, then the rest of the
+// new instruction is written behind it, then the int3 is replaced by the new
+// first byte, with every core serialized (membarrier SYNC_CORE) between the
+// steps. A thread that reaches the int3 meanwhile is sent on by jump_trap.
+// Without SYNC_CORE the sites are only rewritten by ftr_init*() and
+// ftr_close(), whose callers then guarantee that no other thread runs
+// through a site, and never by the exit-time close.
+// ---------------------------------------------------------------------------
+
+#define FTR_MAX_JUMP_TABLES 256
+
+static struct {
+  const ftr_jump_entry_t *start, *stop;
+} jump_tables[FTR_MAX_JUMP_TABLES];
+static size_t jump_table_count = 0;
+static int jump_labels_on = 0; // sites jump into tracing code (capturing)
+static int jump_labels_broken = 0;
+static pthread_mutex_t jump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(__x86_64__) && defined(__linux__)
+static const uint8_t nop5[5] = {0x0f, 0x1f, 0x44, 0x00, 0x00};
+static int jump_patch_on = 0;        // instruction being written, see jump_trap
+static int jump_sync_core = -1;      // SYNC_CORE registered: 1, unavailable: 0
+static int jump_trap_installed = 0;
+static struct sigaction jump_old_trap;
+
+// Whether every core can be serialized, so that sites may be rewritten while
+// other threads run. Must be called with jump_mutex held.
+static int jump_live_patching_locked(void) {
+  if (jump_sync_core < 0)
+    jump_sync_core =
+        syscall(__NR_membarrier,
+                MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0) == 0;
+  return jump_sync_core;
+}
+
+static void jump_sync_cores(void) {
+  if (jump_sync_core == 1)
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0, 0);
+}
+
+// SIGTRAP from an int3 that is rewriting a site: carry on as the new
+// instruction would. Traps that aren't ours go to the previous handler.
+static void jump_trap(int sig, siginfo_t *si, void *ctx) {
+  ucontext_t *uc = ctx;
+  greg_t *rip = &uc->uc_mcontext.gregs[16]; // REG_RIP, a _GNU_SOURCE name
+  uint8_t *ip = (uint8_t *)*rip - 1;
+  for (size_t i = 0; i < jump_table_count; i++) {
+    for (const ftr_jump_entry_t *e = jump_tables[i].start;
+         e < jump_tables[i].stop; e++) {
+      uint8_t *code = (uint8_t *)&e->code + e->code;
+      if (code != ip)
+        continue;
+      if (__atomic_load_n(code, __ATOMIC_ACQUIRE) != 0xcc)
+        *rip = (greg_t)code; // finished meanwhile, run the new instruction
+      else if (__atomic_load_n(&jump_patch_on, __ATOMIC_ACQUIRE))
+        *rip = (greg_t)((uint8_t *)&e->target + e->target);
+      else
+        *rip = (greg_t)(code + 5);
+      return;
+    }
+  }
+  if (jump_old_trap.sa_flags & SA_SIGINFO) {
+    jump_old_trap.sa_sigaction(sig, si, ctx);
+  } else if (jump_old_trap.sa_handler != SIG_DFL &&
+             jump_old_trap.sa_handler != SIG_IGN) {
+    jump_old_trap.sa_handler(sig);
+  } else {
+    sigaction(SIGTRAP, &jump_old_trap, NULL);
+    raise(SIGTRAP); // delivered with the old disposition on return
+  }
+}
+
+static void jump_trap_install_locked(void) {
+  if (jump_trap_installed)
+    return;
+  struct sigaction sa = {0};
+  sa.sa_sigaction = jump_trap;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGTRAP, &sa, &jump_old_trap);
+  jump_trap_installed = 1;
+}
+
+static void jump_write(uint8_t *code, const uint8_t *bytes, size_t off,
+                       size_t len) {
+  uint64_t word = __atomic_load_n((uint64_t *)code, __ATOMIC_RELAXED);
+  memcpy((uint8_t *)&word + off, bytes + off, len);
+  __atomic_store_n((uint64_t *)code, word, __ATOMIC_RELEASE);
+}
+
+// Take one site through `step` of the rewrite:
+//   0: if it isn't the wanted instruction yet, put an int3 on its first byte
+//   1: write the rest of the wanted instruction behind the int3
+//   2: replace the int3 with the wanted first byte
+// Returns 0 on success.
+static int jump_patch(const ftr_jump_entry_t *e, int on, int step,
+                      uintptr_t *page, size_t page_size) {
+  static const uint8_t int3 = 0xcc;
+  uint8_t *code = (uint8_t *)&e->code + e->code;
+  uint8_t *target = (uint8_t *)&e->target + e->target;
+  uint8_t insn[5];
+  int32_t rel = (int32_t)(target - (code + 5));
+  insn[0] = 0xe9;
+  memcpy(insn + 1, &rel, 4);
+  if (step == 0) {
+    if (((uintptr_t)code & 7) != 0 ||
+        (memcmp(code, insn, 5) != 0 && memcmp(code, nop5, 5) != 0))
+      return -1; // not a site we emitted
+    if (!on)
+      memcpy(insn, nop5, 5);
+    if (memcmp(code, insn, 5) == 0)
+      return 0;
+  } else {
+    if (code[0] != int3)
+      return 0; // left alone by step 0
+    if (!on)
+      memcpy(insn, nop5, 5);
+  }
+
+  uintptr_t p = (uintptr_t)code & ~(uintptr_t)(page_size - 1);
+  if (p != *page) {
+    if (*page)
+      mprotect((void *)*page, page_size, PROT_READ | PROT_EXEC);
+    *page = 0;
+    if (mprotect((void *)p, page_size, PROT_READ | PROT_WRITE | PROT_EXEC))
+      return -1;
+    *page = p;
+  }
+  if (step == 0)
+    jump_write(code, &int3, 0, 1);
+  else if (step == 1)
+    jump_write(code, insn, 1, 4);
+  else
+    jump_write(code, insn, 0, 1);
+  return 0;
+}
+
+// Take a module's sites through one step. Returns 0 on success. Must be
+// called with jump_mutex held.
+static int jump_table_patch_locked(const ftr_jump_entry_t *start,
+                                   const ftr_jump_entry_t *stop, int on,
+                                   int step) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  uintptr_t page = 0;
+  int rc = 0;
+  for (const ftr_jump_entry_t *e = start; e < stop && rc == 0; e++)
+    rc = jump_patch(e, on, step, &page, page_size);
+  if (page)
+    mprotect((void *)page, page_size, PROT_READ | PROT_EXEC);
+  return rc;
+}
+
+// Rewrite every registered site to `on`. Returns 0 on success; if a site
+// can't be rewritten, those already holding an int3 are finished as jumps.
+// Must be called with jump_mutex held.
+static int jump_patch_all_locked(int on) {
+  int rc = 0;
+  if (jump_table_count == 0)
+    return 0;
+  jump_trap_install_locked();
+  for (int step = 0; step < 3; step++) {
+    __atomic_store_n(&jump_patch_on, on, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < jump_table_count; i++)
+      if (jump_table_patch_locked(jump_tables[i].start, jump_tables[i].stop,
+                                  on, step))
+        rc = -1;
+    if (rc)
+      on = 1;
+    jump_sync_cores();
+  }
+  return rc;
+}
+#else
+static int jump_live_patching_locked(void) { return 0; }
+
+static int jump_patch_all_locked(int on) {
+  (void)on;
+  return jump_table_count ? -1 : 0;
+}
+#endif
+
+// Bring every registered site to `jump_labels_on`. If any site can't be
+// patched (e.g. W^X policy), all of them go back to their compiled-in jumps
+// for good: tracing then costs what it does without FTR_STATIC_KEYS.
+// Must be called with jump_mutex held.
+static void jump_labels_apply_locked(void) {
+  if (jump_labels_broken || jump_patch_all_locked(jump_labels_on) == 0)
+    return;
+  jump_labels_broken = 1;
+  jump_patch_all_locked(1);
+#if defined(__x86_64__) && defined(__linux__)
+  fprintf(stderr, "[ftr] cannot patch call sites, they stay enabled\n");
+#endif
+}
+
+void ftr_register_jump_table(const ftr_jump_entry_t *start,
+                             const ftr_jump_entry_t *stop) {
+  if (!start || start == stop)
+    return;
+  pthread_mutex_lock(&jump_mutex);
+  size_t i;
+  for (i = 0; i < jump_table_count; i++)
+    if (jump_tables[i].start == start)
+      break;
+  if (i == jump_table_count && i < FTR_MAX_JUMP_TABLES) {
+    jump_tables[jump_table_count].start = start;
+    jump_tables[jump_table_count].stop = stop;
+    jump_table_count++;
+    jump_labels_apply_locked();
+  }
+  pthread_mutex_unlock(&jump_mutex);
+}
+
+void ftr_unregister_jump_table(const ftr_jump_entry_t *start) {
+  pthread_mutex_lock(&jump_mutex);
+  for (size_t i = 0; i < jump_table_count; i++)
+    if (jump_tables[i].start == start) {
+      jump_tables[i] = jump_tables[--jump_table_count];
+      break;
+    }
+  pthread_mutex_unlock(&jump_mutex);
+}
+
+// Bring the sites in line with capture. `quiescent` callers guarantee that
+// no other thread runs through a site; anyone else only patches when cores
+// can be serialized, and otherwise leaves the sites as they are.
+static void jump_labels_sync(int quiescent) {
+  pthread_mutex_lock(&jump_mutex);
+  int on = (__atomic_load_n(&trace_state, __ATOMIC_ACQUIRE) & TRACE_CAPTURE) !=
+           0;
+  if (on != jump_labels_on && (jump_live_patching_locked() || quiescent)) {
+    jump_labels_on = on;
+    jump_labels_apply_locked();
+  }
+  pthread_mutex_unlock(&jump_mutex);
+}
@@ -20,14 +20,40 @@ extern "C" {
 // Environment variables:
 //   FTR_TRACE_PATH  — if set, auto-initializes to that file on startup
 //   FTR_DISABLE     — set to any value to disable tracing entirely
+//   FTR_SYNC_INTERVAL_MS — interval between clock sync points (default 1000)
+//   FTR_START_PAUSED — open the session with capture paused (see ftr_start)
+//   FTR_TOGGLE_SIGNAL — signal (e.g. USR2) that pauses/resumes capture
+//   FTR_FORMAT      — "fxt" (default) or "perfetto"
+//   FTR_COUNTER_MODE — "all" (default), "change", "interval" or "summary"
+//   FTR_COUNTER_WINDOW_MS — counter window of the windowed modes (default 10)
+//   FTR_OVERHEAD    — account for time spent inside ftr, per thread
+//   FTR_OVERHEAD_INTERVAL_MS — interval of the ftr.self.* counters (default 100)
+//   FTR_CALIBRATE   — record the cost of an empty scope as ftr.calibration
+//   FTR_RETAIN_SLOWEST — keep the N longest spans of each name per window
+//   FTR_RETAIN_WINDOW_MS — retention window (default 1000)
+//   FTR_CPU         — "args" or "tracks": annotate scopes with their CPU
 #define FTR_MIN_SCOPE_DURATION_NS 0
 
 // Called with raw FXT bytes whenever the internal buffer flushes.
 // Always invoked under the shared buffer lock.
 typedef void (*ftr_write_fn)(const void *data, size_t len, void *userdata);
 
+// Output encodings. FXT is the default; Perfetto writes the protobuf
+// TracePacket format that ui.perfetto.dev loads natively, with names
+// up to 1024 bytes instead of FXT's 63.
+typedef enum {
+  FTR_FORMAT_FXT = 0,
+  FTR_FORMAT_PERFETTO = 1,
+} ftr_format_t;
+
+// Select the format of sessions started afterwards. Without a call, FTR_FORMAT
+// ("fxt" or "perfetto") decides; ftr_init_file() also picks Perfetto for
+// paths containing ".pftrace" or ".perfetto-trace".
+extern void ftr_set_format(ftr_format_t format);
+
 // Initialize with a custom output callback. The caller owns `userdata` and
-// must release it after calling ftr_close().
+// must release it after calling ftr_close(). A closed session can be followed
+// by a new one; each trace is self-contained.
 // No-op if tracing is already active.
 extern void ftr_init(ftr_write_fn write_fn, void *userdata);
 
@@ -38,6 +64,11 @@ extern void ftr_init(ftr_write_fn write_fn, void *userdata);
 extern void ftr_init_file(const char *path);
 
 extern void ftr_close(void);
+
+// Pause and resume capture within an open session. Both are cheap: nothing is
+// flushed or re-initialized, and events are simply dropped while paused.
+extern void ftr_start(void);
+extern void ftr_stop(void);
 extern void ftr_debug_dump(void);
 
 // An FXT trace atom.
@@ -50,14 +81,88 @@ extern void ftr_write_span(uint64_t pid, uint64_t tid, const char *name,
                            ftr_timestamp_t start_ns, ftr_timestamp_t end_ns);
 extern void ftr_write_spani(uint16_t name_ref, ftr_timestamp_t start_ns,
                             ftr_timestamp_t end_ns);
+// A span on the calling thread whose name is written inline in the record
+// instead of taking a string index: for open-ended name sets, such as one
+// name per function address. Not held back by retention.
+extern void ftr_write_span_named(const char *name, size_t len,
+                                 ftr_timestamp_t start_ns,
+                                 ftr_timestamp_t end_ns);
 extern void ftr_write_marki(uint16_t name_ref);
 extern void ftr_write_counteri(uint16_t name_ref, int64_t value);
 extern void ftr_write_flow_begini(uint16_t name_ref, uint64_t flow_id);
 extern void ftr_write_flow_stepi(uint16_t name_ref, uint64_t flow_id);
 extern void ftr_write_flow_endi(uint16_t name_ref, uint64_t flow_id);
 extern uint64_t ftr_new_flow_id(void);
+
+// Intern a string by pointer. Indexes stay valid for the life of the process,
+// but each trace session needs the string re-emitted: call again in every
+// session, or cache through an ftr_site_t.
 extern uint16_t ftr_intern_string(const char *s);
 
+// Intern a string by content rather than by pointer. The first `len` bytes of
+// `s` are copied, so the caller may reuse or free `s` afterwards. Repeated
+// calls with equal contents return the same index (and re-emit the string
+// into a new session, like ftr_intern_string).
+extern uint16_t ftr_intern_dynamic(const char *s, size_t len);
+
+// Bulk import of spans that were timed outside of ftr (ring buffers, device
+// logs, ...).
+typedef struct {
+  ftr_str_t name_ref; // arg name, from ftr_intern_string/ftr_intern_dynamic
+  int64_t value;
+} ftr_arg_t;
+
+typedef struct {
+  const char *name;   // interned by content when name_ref is 0
+  ftr_str_t name_ref; // pre-interned name, or 0
+  uint8_t arg_count;  // entries in `args`, at most 15
+  uint64_t tid;
+  ftr_timestamp_t start;
+  ftr_timestamp_t end;
+  const ftr_arg_t *args;
+} ftr_import_span_t;
+
+// Clock domain of imported timestamps.
+typedef enum {
+  FTR_CLOCK_TICKS = 0,        // same units as ftr_now_ns()
+  FTR_CLOCK_MONOTONIC_NS = 1, // CLOCK_MONOTONIC nanoseconds
+} ftr_clock_t;
+
+// Encode `count` spans under a single lock acquisition and buffer reservation
+// per chunk of events. Timestamps in FTR_CLOCK_MONOTONIC_NS are converted to
+// the trace's tick domain.
+extern void ftr_write_spans(const ftr_import_span_t *spans, size_t count,
+                            ftr_clock_t clock);
+
+// Instant event with up to 15 int64 arguments.
+extern void ftr_write_marki_args(uint16_t name_ref, const ftr_arg_t *args,
+                                 size_t arg_count);
+
+// Convert a CLOCK_MONOTONIC nanosecond reading to trace ticks.
+extern ftr_timestamp_t ftr_ns_to_ticks(uint64_t monotonic_ns);
+
+// Tick rate of the current trace (valid once tracing has been initialized).
+extern uint64_t ftr_ticks_per_second(void);
+
+// Non-zero while a trace is being recorded.
+extern int ftr_is_enabled(void);
+
+// Record an "ftr.module" instant describing a loaded module: its path, the
+// load bias to subtract from runtime addresses to get ELF addresses, and the
+// runtime address range [start, start + size) of its code. Used to symbolize
+// address-named spans offline (see ftr-symbolize).
+extern void ftr_write_module(const char *path, uint64_t load_bias,
+                             uint64_t start, uint64_t size);
+
+// Non-zero while the calling thread holds one of ftr's internal locks, and
+// on ftr's own background threads. Code that can be re-entered from inside
+// ftr (e.g. an interposed malloc) must not emit events while this is set.
+extern int ftr_thread_busy(void);
+
+// Call `fn` at the start of every ftr_close(), while the session still takes
+// records, e.g. to write totals. At most 8 functions; later ones are ignored.
+extern void ftr_at_close(void (*fn)(void));
+
 // Like printf, but emits to a mark point in the trace location.  This is useful
 // for debugging and adding ad-hoc events to the trace.  The overhead is pretty
 // high (~100ns on my mac). As such, FTR_NO_TRACE disables codegen entirely.
@@ -66,27 +171,214 @@ extern void ftr_logf(const char *fmt, ...)
 
 extern void ftr_set_process_name(const char *name);
 
+// Emit a clock synchronization point pairing the current tick count with
+// CLOCK_MONOTONIC and CLOCK_REALTIME (see ftr-merge). Sync points are also
+// written automatically at init, after each flush, every
+// FTR_SYNC_INTERVAL_MS (default 1000, 0 = off) and at close.
+extern void ftr_clock_sync(void);
+
 extern void ftr_begin(const char *cat, const char *msg);
 extern void ftr_end(const char *cat, const char *msg);
 
 // Nanosecond timestamp from a monotonic clock.
 extern ftr_timestamp_t ftr_now_ns(void);
 
+// ftr_now_ns() plus the CPU the caller was running on: on x86 Linux the
+// TSC_AUX value that rdtscp returns anyway, elsewhere sched_getcpu() while CPU
+// annotation is on. `*cpu` is FTR_CPU_UNKNOWN when unknown.
+#define FTR_CPU_UNKNOWN UINT32_MAX
+extern ftr_timestamp_t ftr_now_cpu(uint32_t *cpu);
+
+// Per-call-site string cache used by the FTR_* macros: the string index
+// tagged with the session generation it was last validated in. When a session
+// opens or closes the generation changes and the next use replays the string
+// into the new trace in O(1), without searching the table again.
+typedef struct {
+  uint64_t ref; // generation << 16 | string index
+} ftr_site_t;
+
+extern uint32_t ftr_generation;
+extern ftr_str_t ftr_site_resolve(ftr_site_t *site, const char *name);
+
+static inline __attribute__((no_instrument_function)) ftr_str_t
+ftr_site_ref(ftr_site_t *site, const char *name) {
+  uint64_t v = __atomic_load_n(&site->ref, __ATOMIC_RELAXED);
+  if (__builtin_expect((uint32_t)(v >> 16) ==
+                           __atomic_load_n(&ftr_generation, __ATOMIC_RELAXED),
+                       1))
+    return (ftr_str_t)v;
+  return ftr_site_resolve(site, name);
+}
+
+// How FTR_COUNTER updates become counter records. Coalescing is per thread:
+// a counter updated from several threads should be an ftr_atomic_counter_t.
+typedef enum {
+  FTR_COUNTER_ALL = 0,       // one record per update (default)
+  FTR_COUNTER_ON_CHANGE = 1, // only updates that change the value
+  FTR_COUNTER_INTERVAL = 2,  // the last value of each window, if it changed
+  FTR_COUNTER_SUMMARY = 3,   // min, max and last of each window
+} ftr_counter_mode_t;
+
+// Select the counter mode and window of sessions started afterwards. Without
+// a call, FTR_COUNTER_MODE ("all", "change", "interval", "summary") and
+// FTR_COUNTER_WINDOW_MS (default 10) decide. `window_ns` 0 keeps the default.
+extern void ftr_set_counter_mode(ftr_counter_mode_t mode, uint64_t window_ns);
+
+// Tail-based retention for sessions started afterwards: of the spans written
+// by ftr_write_spani (the scope macros), each thread keeps only the `k`
+// longest of each name per window, together with the spans and flow points
+// nested inside them, and counts the rest. Without a call,
+// FTR_RETAIN_SLOWEST (k, default 0 = off) and FTR_RETAIN_WINDOW_MS (default
+// 1000) decide. `k` is at most 16; `window_ns` 0 keeps the default.
+extern void ftr_set_retention(unsigned k, uint64_t window_ns);
+
+// CPU annotation of scopes (FTR_SCOPE and friends) for sessions started
+// afterwards. Without a call, FTR_CPU ("args" or "tracks") decides.
+typedef enum {
+  FTR_CPU_OFF = 0,
+  FTR_CPU_ARGS = 1,   // "cpu" argument, plus "cpu_end" if the scope migrated
+  FTR_CPU_TRACKS = 2, // arguments, and a copy of each span on a per-CPU track
+} ftr_cpu_mode_t;
+
+extern void ftr_set_cpu_mode(ftr_cpu_mode_t mode);
+
+// ftr_write_spani with the CPUs read at the span's begin and end, either of
+// which may be FTR_CPU_UNKNOWN. Falls back to ftr_write_spani while CPU
+// annotation is off.
+extern void ftr_write_spani_cpu(uint16_t name_ref, ftr_timestamp_t start_ns,
+                                ftr_timestamp_t end_ns, uint32_t start_cpu,
+                                uint32_t end_cpu);
+
+// Counter update that goes through the session's counter mode (FTR_COUNTER).
+// ftr_write_counteri always writes a record.
+extern void ftr_counter_seti(uint16_t name_ref, int64_t value);
+
+// A process-wide counter updated with atomic adds and written by a sampler
+// thread once per counter window when its value changed, and at close:
+//   static ftr_atomic_counter_t queued = FTR_ATOMIC_COUNTER_INIT("queued");
+//   ftr_atomic_counter_add(&queued, 1);
+typedef struct ftr_atomic_counter {
+  const char *name;
+  int64_t value;
+  int registered;
+  ftr_site_t site;
+  int64_t sampled; // last value written, owned by the sampler
+  uint32_t sampled_epoch;
+  struct ftr_atomic_counter *next;
+} ftr_atomic_counter_t;
+
+#define FTR_ATOMIC_COUNTER_INIT(name) {(name), 0, 0, {0}, 0, 0, NULL}
+
+extern void ftr_atomic_counter_register(ftr_atomic_counter_t *c);
+
+static inline __attribute__((no_instrument_function)) void
+ftr_atomic_counter_add(ftr_atomic_counter_t *c, int64_t delta) {
+  __atomic_add_fetch(&c->value, delta, __ATOMIC_RELAXED);
+  if (__builtin_expect(!__atomic_load_n(&c->registered, __ATOMIC_ACQUIRE), 0))
+    ftr_atomic_counter_register(c);
+}
+
+static inline __attribute__((no_instrument_function)) void
+ftr_atomic_counter_set(ftr_atomic_counter_t *c, int64_t value) {
+  __atomic_store_n(&c->value, value, __ATOMIC_RELAXED);
+  if (__builtin_expect(!__atomic_load_n(&c->registered, __ATOMIC_ACQUIRE), 0))
+    ftr_atomic_counter_register(c);
+}
+
+// Patchable call sites. With FTR_STATIC_KEYS defined (x86-64 ELF, GCC or
+// Clang), every FTR_* site is guarded by an `asm goto` jump that ftr rewrites
+// to a NOP while nothing is captured (no session, or a paused one), so a
+// disabled site costs a 5-byte NOP instead of two clock reads and a call.
+// Each module lists its sites in the ftr_jump_table section and registers it
+// from a constructor. Sites are rewritten with a breakpoint protocol that is
+// safe while other threads run. On kernels without membarrier SYNC_CORE only
+// ftr_init*() and ftr_close() rewrite them, and those must then be called
+// while no other thread can run through a site.
+typedef struct {
+  int32_t code;   // site address, relative to this field
+  int32_t target; // tracing code, relative to this field
+} ftr_jump_entry_t;
+
+extern void ftr_register_jump_table(const ftr_jump_entry_t *start,
+                                    const ftr_jump_entry_t *stop);
+extern void ftr_unregister_jump_table(const ftr_jump_entry_t *start);
+
+#if defined(FTR_STATIC_KEYS) && !defined(FTR_NO_TRACE) &&                     \
+    defined(__x86_64__) && defined(__GNUC__) && defined(__ELF__)
+#define FTR_HAVE_STATIC_KEYS 1
+
+extern const ftr_jump_entry_t __start_ftr_jump_table[]
+    __attribute__((weak, visibility("hidden")));
+extern const ftr_jump_entry_t __stop_ftr_jump_table[]
+    __attribute__((weak, visibility("hidden")));
+
+__attribute__((constructor, unused, no_instrument_function)) static void
+ftr_jump_table_register_(void) {
+  ftr_register_jump_table(__start_ftr_jump_table, __stop_ftr_jump_table);
+}
+
+__attribute__((destructor, unused, no_instrument_function)) static void
+ftr_jump_table_unregister_(void) {
+  ftr_unregister_jump_table(__start_ftr_jump_table);
+}
+
+// Compiled as a `jmp` to the tracing path; patched to a NOP when disabled.
+static inline __attribute__((always_inline, no_instrument_function)) int
+ftr_site_on(void) {
+  __asm__ goto(".balign 8\n"
+               "1: .byte 0xe9\n"
+               ".long %l[on] - (1b + 5)\n"
+               ".pushsection ftr_jump_table, \"a\"\n"
+               ".balign 4\n"
+               ".long 1b - ., %l[on] - .\n"
+               ".popsection\n"
+               :
+               :
+               :
+               : on);
+  return 0;
+on:
+  return 1;
+}
+#define FTR_ON() ftr_site_on()
+#else
+#define FTR_ON() 1
+#endif
+
 struct ftr_event_t {
   ftr_str_t name_ref;
+  uint32_t cpu; // at begin, see ftr_now_cpu
   ftr_timestamp_t start_ns;
 };
 
-///
-static inline struct ftr_event_t ftr_begin_event(ftr_str_t name_ref_cache) {
-  return (struct ftr_event_t){name_ref_cache, ftr_now_ns()};
+// The inline helpers are excluded from -finstrument-functions so that an
+// instrumented build doesn't report ftr's own probes as function calls.
+static inline __attribute__((no_instrument_function)) struct ftr_event_t
+ftr_begin_event(ftr_str_t name_ref_cache) {
+  struct ftr_event_t e;
+  e.name_ref = name_ref_cache;
+  e.start_ns = ftr_now_cpu(&e.cpu);
+  return e;
+}
+
+// Event of a site that was disabled when its scope opened.
+static inline __attribute__((no_instrument_function)) struct ftr_event_t
+ftr_no_event(void) {
+  struct ftr_event_t e = {0, 0, 0};
+  return e;
 }
 
-static inline void ftr_end_event(struct ftr_event_t *e) {
-  ftr_timestamp_t end = ftr_now_ns();
+static inline __attribute__((no_instrument_function)) void
+ftr_end_event(struct ftr_event_t *e) {
+#ifdef FTR_HAVE_STATIC_KEYS
+  if (!ftr_site_on() || e->start_ns == 0)
+    return;
+#endif
+  uint32_t cpu;
+  ftr_timestamp_t end = ftr_now_cpu(&cpu);
   if (end - e->start_ns < FTR_MIN_SCOPE_DURATION_NS)
     return;
-  ftr_write_spani(e->name_ref, e->start_ns, end);
+  ftr_write_spani_cpu(e->name_ref, e->start_ns, end, e->cpu, cpu);
 }
 
 #ifdef FTR_NO_TRACE
@@ -102,12 +394,13 @@ static inline void ftr_end_event(struct ftr_event_t *e) {
 #else
 #define FTR_CONCAT_(a, b) a##b
 #define FTR_CONCAT(a, b) FTR_CONCAT_(a, b)
+#define FTR_SITE(name)                                                         \
+  ftr_site_ref(&FTR_CONCAT(__site_, __LINE__), name)
 #define FTR_SCOPE(name)                                                        \
-  static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                           \
-  if (FTR_CONCAT(__idx_, __LINE__) == 0)                                       \
-    FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                    \
+  static ftr_site_t FTR_CONCAT(__site_, __LINE__);                             \
   __attribute__((cleanup(ftr_end_event))) struct ftr_event_t FTR_CONCAT(       \
-      __event_, __LINE__) = ftr_begin_event(FTR_CONCAT(__idx_, __LINE__))
+      __event_, __LINE__) =                                                    \
+      FTR_ON() ? ftr_begin_event(FTR_SITE(name)) : ftr_no_event()
 
 // __func__ has a stable per-function pointer in practice (it's a static local
 // array), so we can use the same static-cache trick as FTR_SCOPE.
@@ -118,11 +411,9 @@ static inline void ftr_end_event(struct ftr_event_t *e) {
 // universally supported by the compilers this library targets.
 #define FTR_EXPR(name, expr)                                                   \
   __extension__({                                                              \
-    static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                        \
-    if (FTR_CONCAT(__idx_, __LINE__) == 0)                                     \
-      FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                 \
+    static ftr_site_t FTR_CONCAT(__site_, __LINE__);                           \
     struct ftr_event_t FTR_CONCAT(__event_, __LINE__) =                       \
-        ftr_begin_event(FTR_CONCAT(__idx_, __LINE__));                         \
+        FTR_ON() ? ftr_begin_event(FTR_SITE(name)) : ftr_no_event();           \
     __auto_type FTR_CONCAT(__result_, __LINE__) = (expr);                     \
     ftr_end_event(&FTR_CONCAT(__event_, __LINE__));                            \
     FTR_CONCAT(__result_, __LINE__);                                           \
@@ -130,46 +421,35 @@ static inline void ftr_end_event(struct ftr_event_t *e) {
 
 #define FTR_MARK(name)                                                         \
   do {                                                                         \
-    static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                         \
-    if (FTR_CONCAT(__idx_, __LINE__) == 0)                                     \
-      FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                  \
-    ftr_write_marki(FTR_CONCAT(__idx_, __LINE__));                             \
+    static ftr_site_t FTR_CONCAT(__site_, __LINE__);                           \
+    if (FTR_ON())                                                              \
+      ftr_write_marki(FTR_SITE(name));                                         \
   } while (0)
 
 #define FTR_COUNTER(name, value)                                               \
   do {                                                                         \
-    static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                         \
-    if (FTR_CONCAT(__idx_, __LINE__) == 0)                                     \
-      FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                  \
-    ftr_write_counteri(FTR_CONCAT(__idx_, __LINE__), (int64_t)(value));        \
+    static ftr_site_t FTR_CONCAT(__site_, __LINE__);                           \
+    if (FTR_ON())                                                              \
+      ftr_counter_seti(FTR_SITE(name), (int64_t)(value));                      \
   } while (0)
 
 #define FTR_SCOPE_FLOW_BEGIN(name, flow_id)                                    \
-  static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                           \
-  if (FTR_CONCAT(__idx_, __LINE__) == 0)                                       \
-    FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                    \
-  __attribute__((cleanup(ftr_end_event))) struct ftr_event_t FTR_CONCAT(       \
-      __event_, __LINE__) = ftr_begin_event(FTR_CONCAT(__idx_, __LINE__));     \
-  ftr_write_flow_begini(FTR_CONCAT(__idx_, __LINE__),                          \
-                        (uint64_t)(uintptr_t)(flow_id))
+  FTR_SCOPE(name);                                                             \
+  if (FTR_ON())                                                                \
+    ftr_write_flow_begini(FTR_CONCAT(__event_, __LINE__).name_ref,             \
+                          (uint64_t)(uintptr_t)(flow_id))
 
 #define FTR_SCOPE_FLOW_STEP(name, flow_id)                                     \
-  static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                           \
-  if (FTR_CONCAT(__idx_, __LINE__) == 0)                                       \
-    FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                    \
-  __attribute__((cleanup(ftr_end_event))) struct ftr_event_t FTR_CONCAT(       \
-      __event_, __LINE__) = ftr_begin_event(FTR_CONCAT(__idx_, __LINE__));     \
-  ftr_write_flow_stepi(FTR_CONCAT(__idx_, __LINE__),                           \
-                       (uint64_t)(uintptr_t)(flow_id))
+  FTR_SCOPE(name);                                                             \
+  if (FTR_ON())                                                                \
+    ftr_write_flow_stepi(FTR_CONCAT(__event_, __LINE__).name_ref,              \
+                         (uint64_t)(uintptr_t)(flow_id))
 
 #define FTR_SCOPE_FLOW_END(name, flow_id)                                      \
-  static ftr_str_t FTR_CONCAT(__idx_, __LINE__) = 0;                           \
-  if (FTR_CONCAT(__idx_, __LINE__) == 0)                                       \
-    FTR_CONCAT(__idx_, __LINE__) = ftr_intern_string(name);                    \
-  __attribute__((cleanup(ftr_end_event))) struct ftr_event_t FTR_CONCAT(       \
-      __event_, __LINE__) = ftr_begin_event(FTR_CONCAT(__idx_, __LINE__));     \
-  ftr_write_flow_endi(FTR_CONCAT(__idx_, __LINE__),                            \
-                      (uint64_t)(uintptr_t)(flow_id))
+  FTR_SCOPE(name);                                                             \
+  if (FTR_ON())                                                                \
+    ftr_write_flow_endi(FTR_CONCAT(__event_, __LINE__).name_ref,               \
+                        (uint64_t)(uintptr_t)(flow_id))
 
 #endif
 #ifdef __cplusplus
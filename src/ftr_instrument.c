@@ -0,0 +1,312 @@
+// ftr_instrument — span hooks for code built with -finstrument-functions.
+//
+// Link this library (together with ftr or ftr_static) into a program compiled
+// with -finstrument-functions and every function call becomes a span. Spans
+// are named by function address ("@0x55d0c2a81139"), written inline in each
+// record so that any number of functions fits without using up the string
+// table; the address ranges of loaded modules are written into the trace as
+// "ftr.module" records so that ftr-symbolize can replace those names with
+// symbols offline.
+//
+// Each thread keeps a shadow stack of entry timestamps and a direct-mapped
+// address -> function cache, so the common path never takes a lock.
+// Environment variables:
+//   FTR_INSTRUMENT_MIN_NS   — drop calls shorter than this (default 0)
+//   FTR_INSTRUMENT_INCLUDE  — comma-separated substrings; only functions whose
+//                             module path or (exported) symbol name contains
+//                             one of them are recorded
+//   FTR_INSTRUMENT_EXCLUDE  — comma-separated substrings to leave out
+
+#define _GNU_SOURCE
+#include "ftr.h"
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <link.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FTR_NO_INSTRUMENT __attribute__((no_instrument_function))
+
+#define FTR_INSTR_MAX_DEPTH 256
+#define FTR_INSTR_CACHE_SIZE 1024 // per thread, direct mapped
+#define FTR_INSTR_TABLE_SIZE 0x10000
+#define FTR_INSTR_MAX_MODULES 512
+#define FTR_INSTR_MAX_PATTERNS 32
+
+// `gen` is the session generation whose trace already has the function's
+// module record; a new session replays the module on the function's next
+// call.
+typedef struct {
+  uintptr_t fn; // 0 = empty slot
+  _Atomic uint32_t gen;
+  uint8_t excluded;
+  uint8_t name_len;
+  char name[24]; // "@0x<hex>"
+} fn_entry_t;
+
+typedef struct {
+  uintptr_t start, end, bias;
+  uint32_t emitted_gen; // 0 = not yet written to any session
+  char path[256];
+} module_t;
+
+typedef struct {
+  uintptr_t fn;
+  ftr_timestamp_t start; // 0 when tracing was off at entry
+} frame_t;
+
+typedef struct {
+  uint32_t depth; // may exceed FTR_INSTR_MAX_DEPTH; deeper frames are untimed
+  int in_hook;
+  frame_t stack[FTR_INSTR_MAX_DEPTH];
+  struct {
+    uintptr_t fn;
+    fn_entry_t *entry;
+  } cache[FTR_INSTR_CACHE_SIZE];
+} thread_state_t;
+
+static __thread thread_state_t tls;
+
+// Global state, guarded by `table_lock` (slow path only).
+static atomic_flag table_lock = ATOMIC_FLAG_INIT;
+static fn_entry_t fn_table[FTR_INSTR_TABLE_SIZE];
+static module_t modules[FTR_INSTR_MAX_MODULES];
+static size_t module_count = 0;
+
+static int config_loaded = 0;
+static uint64_t min_ns = 0;
+static uint64_t min_ticks = 0;
+static char include_patterns[FTR_INSTR_MAX_PATTERNS][128];
+static char exclude_patterns[FTR_INSTR_MAX_PATTERNS][128];
+static size_t include_count = 0, exclude_count = 0;
+
+static FTR_NO_INSTRUMENT void table_lock_acquire(void) {
+  while (atomic_flag_test_and_set_explicit(&table_lock, memory_order_acquire)) {
+  }
+}
+
+static FTR_NO_INSTRUMENT void table_lock_release(void) {
+  atomic_flag_clear_explicit(&table_lock, memory_order_release);
+}
+
+static FTR_NO_INSTRUMENT size_t parse_patterns(const char *list,
+                                               char out[][128]) {
+  size_t n = 0;
+  while (list && *list && n < FTR_INSTR_MAX_PATTERNS) {
+    const char *comma = strchr(list, ',');
+    size_t len = comma ? (size_t)(comma - list) : strlen(list);
+    if (len > 0 && len < 128) {
+      memcpy(out[n], list, len);
+      out[n][len] = '\0';
+      n++;
+    }
+    list = comma ? comma + 1 : NULL;
+  }
+  return n;
+}
+
+// Must be called with the table lock held.
+static FTR_NO_INSTRUMENT void load_config_locked(void) {
+  if (config_loaded)
+    return;
+  const char *v = getenv("FTR_INSTRUMENT_MIN_NS");
+  if (v)
+    min_ns = strtoull(v, NULL, 10);
+  min_ticks = min_ns * ftr_ticks_per_second() / 1000000000ULL;
+  include_count =
+      parse_patterns(getenv("FTR_INSTRUMENT_INCLUDE"), include_patterns);
+  exclude_count =
+      parse_patterns(getenv("FTR_INSTRUMENT_EXCLUDE"), exclude_patterns);
+  __atomic_store_n(&config_loaded, 1, __ATOMIC_RELEASE);
+}
+
+static FTR_NO_INSTRUMENT void load_config(void) {
+  table_lock_acquire();
+  load_config_locked();
+  table_lock_release();
+}
+
+static FTR_NO_INSTRUMENT int matches_any(const Dl_info *info,
+                                         char patterns[][128], size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (info->dli_fname && strstr(info->dli_fname, patterns[i]))
+      return 1;
+    if (info->dli_sname && strstr(info->dli_sname, patterns[i]))
+      return 1;
+  }
+  return 0;
+}
+
+static FTR_NO_INSTRUMENT int is_excluded(uintptr_t fn) {
+  if (include_count == 0 && exclude_count == 0)
+    return 0;
+  Dl_info info = {0};
+  dladdr((void *)fn, &info);
+  if (include_count && !matches_any(&info, include_patterns, include_count))
+    return 1;
+  return matches_any(&info, exclude_patterns, exclude_count);
+}
+
+// ---------------------------------------------------------------------------
+// Module map
+// ---------------------------------------------------------------------------
+
+static FTR_NO_INSTRUMENT int add_module_cb(struct dl_phdr_info *info,
+                                           size_t size, void *data) {
+  (void)size;
+  (void)data;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_X))
+      continue;
+    uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+    size_t k;
+    for (k = 0; k < module_count; k++)
+      if (modules[k].start == start)
+        break;
+    if (k < module_count || module_count == FTR_INSTR_MAX_MODULES)
+      continue;
+
+    module_t *m = &modules[module_count++];
+    m->start = start;
+    m->end = start + ph->p_memsz;
+    m->bias = info->dlpi_addr;
+    m->emitted_gen = 0;
+    if (info->dlpi_name && info->dlpi_name[0]) {
+      snprintf(m->path, sizeof(m->path), "%s", info->dlpi_name);
+    } else {
+      // The main executable is reported without a name.
+      ssize_t n = readlink("/proc/self/exe", m->path, sizeof(m->path) - 1);
+      m->path[n > 0 ? n : 0] = '\0';
+    }
+  }
+  return 0;
+}
+
+// Find the module containing `fn`, rescanning loaded modules once if it
+// isn't known yet (e.g. after a dlopen). Must be called with the table lock
+// held.
+static FTR_NO_INSTRUMENT module_t *find_module_locked(uintptr_t fn) {
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; i < module_count; i++)
+      if (fn >= modules[i].start && fn < modules[i].end)
+        return &modules[i];
+    if (pass == 0)
+      dl_iterate_phdr(add_module_cb, NULL);
+  }
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Function table
+// ---------------------------------------------------------------------------
+
+static FTR_NO_INSTRUMENT fn_entry_t *table_lookup(uintptr_t fn) {
+  uint32_t slot = (uint32_t)((fn >> 4) * 0x9E3779B97F4A7C15ULL >> 48);
+  table_lock_acquire();
+  load_config_locked();
+  for (uint32_t probe = 0; probe < FTR_INSTR_TABLE_SIZE; probe++) {
+    fn_entry_t *e = &fn_table[(slot + probe) & (FTR_INSTR_TABLE_SIZE - 1)];
+    if (e->fn == fn) {
+      table_lock_release();
+      return e;
+    }
+    if (e->fn == 0) {
+      e->excluded = (uint8_t)is_excluded(fn);
+      e->name_len = (uint8_t)snprintf(e->name, sizeof(e->name),
+                                      "@0x%" PRIxPTR, fn);
+      e->fn = fn;
+      table_lock_release();
+      return e;
+    }
+  }
+  table_lock_release();
+  return NULL; // table full
+}
+
+// Write the module record covering a function into the current trace before
+// its first span, so the symbolizer always sees the module before any name
+// that needs it.
+static FTR_NO_INSTRUMENT void emit_module(fn_entry_t *e, uint32_t gen) {
+  table_lock_acquire();
+  module_t *m = find_module_locked(e->fn);
+  if (m && m->emitted_gen != gen) {
+    ftr_write_module(m->path, m->bias, m->start, m->end - m->start);
+    m->emitted_gen = gen;
+  }
+  table_lock_release();
+  atomic_store_explicit(&e->gen, gen, memory_order_relaxed);
+}
+
+static inline FTR_NO_INSTRUMENT fn_entry_t *lookup(thread_state_t *t,
+                                                   uintptr_t fn) {
+  size_t slot = (fn >> 4) & (FTR_INSTR_CACHE_SIZE - 1);
+  if (__builtin_expect(t->cache[slot].fn == fn, 1))
+    return t->cache[slot].entry;
+  fn_entry_t *e = table_lookup(fn);
+  t->cache[slot].fn = fn;
+  t->cache[slot].entry = e;
+  return e;
+}
+
+// ---------------------------------------------------------------------------
+// Hooks
+// ---------------------------------------------------------------------------
+
+FTR_NO_INSTRUMENT void __cyg_profile_func_enter(void *this_fn,
+                                                void *call_site) {
+  (void)call_site;
+  thread_state_t *t = &tls;
+  if (t->in_hook)
+    return;
+  uint32_t d = t->depth++;
+  if (d >= FTR_INSTR_MAX_DEPTH)
+    return;
+  t->stack[d].fn = (uintptr_t)this_fn;
+  t->stack[d].start = ftr_is_enabled() ? ftr_now_ns() : 0;
+}
+
+FTR_NO_INSTRUMENT void __cyg_profile_func_exit(void *this_fn,
+                                               void *call_site) {
+  (void)call_site;
+  thread_state_t *t = &tls;
+  if (t->in_hook || t->depth == 0)
+    return;
+  uint32_t d = --t->depth;
+  if (d >= FTR_INSTR_MAX_DEPTH)
+    return;
+
+  uintptr_t fn = (uintptr_t)this_fn;
+  if (t->stack[d].fn != fn) {
+    // Frames were skipped (longjmp); resynchronize on the matching entry.
+    uint32_t k = d;
+    while (k > 0 && t->stack[k].fn != fn)
+      k--;
+    if (t->stack[k].fn != fn) {
+      t->depth = d + 1;
+      return;
+    }
+    d = t->depth = k;
+  }
+
+  ftr_timestamp_t start = t->stack[d].start;
+  if (start == 0)
+    return;
+  ftr_timestamp_t end = ftr_now_ns();
+  if (__builtin_expect(!__atomic_load_n(&config_loaded, __ATOMIC_ACQUIRE), 0))
+    load_config();
+  if (end - start < min_ticks)
+    return;
+
+  t->in_hook = 1;
+  fn_entry_t *e = lookup(t, fn);
+  if (e && !e->excluded && !ftr_thread_busy()) {
+    uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+    if (atomic_load_explicit(&e->gen, memory_order_relaxed) != gen)
+      emit_module(e, gen);
+    ftr_write_span_named(e->name, e->name_len, start, end);
+  }
+  t->in_hook = 0;
+}
@@ -0,0 +1,468 @@
+// libftr_lock — lock contention tracer for LD_PRELOAD.
+//
+//   LD_PRELOAD=libftr_lock.so FTR_TRACE_PATH=trace.fxt ./app
+//
+// Interposes pthread_mutex_lock/timedlock/unlock/destroy and
+// pthread_cond_wait/timedwait/signal/broadcast/destroy, which covers
+// std::mutex and std::condition_variable too. A mutex acquire first tries
+// pthread_mutex_trylock and returns if that succeeds, so an uncontended lock
+// costs one trylock. A blocked acquire or condition wait of at least
+// FTR_LOCK_MIN_NS (default 10000) becomes a "mutex wait" or "cond wait" span.
+//
+// Hand-offs are drawn as flows. A thread that unlocks a mutex, or signals a
+// condition variable, while its oldest waiter has been blocked past the
+// threshold records a short "mutex unlock" / "cond signal" span that starts
+// a flow, and the next waiter to get through ends the flow inside its wait
+// span (even below the threshold). One flow is pending per lock at a time;
+// a broadcast draws a single arrow, to the first thread that wakes.
+//
+// Locks are found by address in a fixed table, on the contended path only.
+// The unlock and signal fast paths read one waiter count shared by every
+// lock that hashes to the same slot. Destroying a lock frees its entry, so a
+// later lock at the same address starts from zero; std::mutex never calls
+// pthread_mutex_destroy, though, so its entries last until the process
+// exits. At ftr_close() each contended mutex gets an "ftr.lock_contention"
+// instant with its totals (a mutex destroyed before then gets it when it is
+// destroyed), and the ones with the longest waits are printed to stderr.
+// Waits on locks that found no free entry are counted and reported too.
+// Nothing is traced while ftr holds a lock on the calling thread, or on
+// ftr's own sampler thread.
+
+#define _GNU_SOURCE
+#include "ftr.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FTR_LOCK_TABLE_SIZE 4096
+#define FTR_LOCK_MAX_PROBES 64
+#define FTR_LOCK_FILTER_SIZE 1024 // waiter counts shared by hash slot
+#define FTR_LOCK_REPORT_TOP 10    // locks listed on stderr at close
+
+enum { KIND_MUTEX = 1, KIND_COND };
+
+// Per-lock state. Statistics cover mutexes only; a condition wait is not
+// contention.
+#define ADDR_FREED 1 // the lock was destroyed; probes continue past the slot
+
+typedef struct {
+  uintptr_t addr; // 0 = empty slot
+  uint32_t kind;
+  uint32_t waiters;
+  uint64_t wait_since; // ticks, start of the oldest wait
+  uint64_t flow_id;    // hand-off not yet claimed by a waiter, or 0
+  uint64_t contended;
+  uint64_t wait_ticks;
+  uint64_t max_ticks;
+} lock_entry_t;
+
+static lock_entry_t table[FTR_LOCK_TABLE_SIZE];
+static uint32_t waiting[FTR_LOCK_FILTER_SIZE];
+static uint64_t untracked; // waits that found no free entry
+
+static __thread int in_hook __attribute__((tls_model("initial-exec")));
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static int (*real_mutex_trylock)(pthread_mutex_t *);
+static int (*real_mutex_timedlock)(pthread_mutex_t *,
+                                   const struct timespec *);
+static int (*real_mutex_unlock)(pthread_mutex_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *,
+                                  const struct timespec *);
+static int (*real_cond_signal)(pthread_cond_t *);
+static int (*real_cond_broadcast)(pthread_cond_t *);
+static int (*real_mutex_destroy)(pthread_mutex_t *);
+static int (*real_cond_destroy)(pthread_cond_t *);
+
+static uint64_t min_ns = 10000;
+
+// glibc keeps the pre-2.3.2 condition variables for old binaries, and plain
+// dlsym can return those; ask for the current version first.
+static void *next_cond_fn(const char *name) {
+  void *fn = NULL;
+#ifdef __GLIBC__
+  fn = dlvsym(RTLD_NEXT, name, "GLIBC_2.3.2");
+#endif
+  return fn ? fn : dlsym(RTLD_NEXT, name);
+}
+
+static void resolve(void) {
+  real_mutex_trylock = dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+  real_mutex_timedlock = dlsym(RTLD_NEXT, "pthread_mutex_timedlock");
+  real_mutex_unlock = dlsym(RTLD_NEXT, "pthread_mutex_unlock");
+  real_cond_wait = next_cond_fn("pthread_cond_wait");
+  real_cond_timedwait = next_cond_fn("pthread_cond_timedwait");
+  real_cond_signal = next_cond_fn("pthread_cond_signal");
+  real_cond_broadcast = next_cond_fn("pthread_cond_broadcast");
+  real_mutex_destroy = dlsym(RTLD_NEXT, "pthread_mutex_destroy");
+  real_cond_destroy = next_cond_fn("pthread_cond_destroy");
+  const char *v = getenv("FTR_LOCK_MIN_NS");
+  if (v)
+    min_ns = strtoull(v, NULL, 10);
+  __atomic_store_n(&real_mutex_lock, dlsym(RTLD_NEXT, "pthread_mutex_lock"),
+                   __ATOMIC_RELEASE);
+}
+
+#define ENSURE_RESOLVED()                                                      \
+  do {                                                                         \
+    if (__builtin_expect(                                                      \
+            !__atomic_load_n(&real_mutex_lock, __ATOMIC_ACQUIRE), 0))          \
+      resolve();                                                               \
+  } while (0)
+
+static inline uint32_t lock_hash(const void *p) {
+  return (uint32_t)(((uintptr_t)p >> 3) * 0x9E3779B97F4A7C15ULL >> 40);
+}
+
+static inline uint32_t *waiting_slot(const void *p) {
+  return &waiting[lock_hash(p) & (FTR_LOCK_FILTER_SIZE - 1)];
+}
+
+static inline int can_trace(void) {
+  return !in_hook && ftr_is_enabled() && !ftr_thread_busy();
+}
+
+static inline uint64_t min_ticks(void) {
+  return min_ns * ftr_ticks_per_second() / 1000000000ULL;
+}
+
+// Find the entry of the lock at `p`, claiming a slot for it when `kind` is
+// non-zero: the first freed slot on its probe sequence, or else the empty
+// slot that ends it. Returns NULL when it isn't found within a few probes.
+static lock_entry_t *lookup(const void *p, uint32_t kind) {
+  uintptr_t addr = (uintptr_t)p;
+  uint32_t slot = lock_hash(p);
+  for (;;) {
+    lock_entry_t *claim = NULL;
+    uintptr_t expected = 0;
+    for (uint32_t probe = 0; probe < FTR_LOCK_MAX_PROBES; probe++) {
+      lock_entry_t *e = &table[(slot + probe) & (FTR_LOCK_TABLE_SIZE - 1)];
+      uintptr_t cur = __atomic_load_n(&e->addr, __ATOMIC_ACQUIRE);
+      if (cur == addr)
+        return e;
+      if (cur == ADDR_FREED && !claim) {
+        claim = e;
+        expected = cur;
+      }
+      if (cur != 0)
+        continue;
+      if (!claim)
+        claim = e;
+      break;
+    }
+    if (!kind)
+      return NULL;
+    if (!claim) {
+      __atomic_add_fetch(&untracked, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+    uintptr_t cur = expected;
+    if (__atomic_compare_exchange_n(&claim->addr, &cur, addr, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_store_n(&claim->kind, kind, __ATOMIC_RELEASE);
+      return claim;
+    }
+    if (cur == addr)
+      return claim;
+    // Another lock took the slot first; look again.
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Emission (slow path, with in_hook set)
+// ---------------------------------------------------------------------------
+
+enum { N_MUTEX_WAIT, N_MUTEX_UNLOCK, N_COND_WAIT, N_COND_SIGNAL, N_COUNT };
+
+static ftr_str_t span_name(int name) {
+  static const char *const names[N_COUNT] = {"mutex wait", "mutex unlock",
+                                             "cond wait", "cond signal"};
+  static ftr_site_t sites[N_COUNT];
+  return ftr_site_ref(&sites[name], names[name]);
+}
+
+typedef struct {
+  ftr_timestamp_t start;
+  lock_entry_t *e;
+  uint32_t *waiting;
+} wait_t;
+
+static void wait_begin(wait_t *w, const void *p, uint32_t kind) {
+  w->start = ftr_now_ns();
+  w->waiting = waiting_slot(p);
+  __atomic_add_fetch(w->waiting, 1, __ATOMIC_RELAXED);
+  w->e = lookup(p, kind);
+  if (w->e && __atomic_fetch_add(&w->e->waiters, 1, __ATOMIC_ACQ_REL) == 0)
+    __atomic_store_n(&w->e->wait_since, w->start, __ATOMIC_RELAXED);
+}
+
+// `rc` is the result of the real call. A wait that failed (a timeout, an
+// error) is still drawn, but it neither took the hand-off nor acquired the
+// lock, so it leaves the flow to the next waiter and isn't counted.
+static void wait_end(wait_t *w, int name, int rc) {
+  ftr_timestamp_t end = ftr_now_ns();
+  uint64_t ticks = end - w->start;
+  uint64_t flow = 0;
+  __atomic_sub_fetch(w->waiting, 1, __ATOMIC_RELAXED);
+  lock_entry_t *e = w->e;
+  if (e)
+    __atomic_sub_fetch(&e->waiters, 1, __ATOMIC_ACQ_REL);
+  if (e && rc == 0) {
+    if (__atomic_load_n(&e->flow_id, __ATOMIC_RELAXED))
+      flow = __atomic_exchange_n(&e->flow_id, 0, __ATOMIC_ACQ_REL);
+    if (name == N_MUTEX_WAIT) {
+      __atomic_add_fetch(&e->contended, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&e->wait_ticks, ticks, __ATOMIC_RELAXED);
+      uint64_t max = __atomic_load_n(&e->max_ticks, __ATOMIC_RELAXED);
+      while (ticks > max &&
+             !__atomic_compare_exchange_n(&e->max_ticks, &max, ticks, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      }
+    }
+  }
+  if (!flow && ticks < min_ticks())
+    return;
+  in_hook = 1;
+  ftr_str_t ref = span_name(name);
+  if (flow)
+    ftr_write_flow_endi(ref, flow);
+  ftr_write_spani(ref, w->start, ftr_now_ns());
+  in_hook = 0;
+}
+
+// Start a hand-off flow if the lock at `p` has a waiter blocked past the
+// threshold. Returns the start of the releasing span, or 0.
+static ftr_timestamp_t handoff_begin(const void *p, int name) {
+  lock_entry_t *e = lookup(p, 0);
+  if (!e || !__atomic_load_n(&e->waiters, __ATOMIC_ACQUIRE) ||
+      __atomic_load_n(&e->flow_id, __ATOMIC_RELAXED))
+    return 0;
+  ftr_timestamp_t start = ftr_now_ns();
+  if (start - __atomic_load_n(&e->wait_since, __ATOMIC_RELAXED) < min_ticks())
+    return 0;
+  uint64_t expected = 0, id = ftr_new_flow_id();
+  if (!__atomic_compare_exchange_n(&e->flow_id, &expected, id, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return 0;
+  in_hook = 1;
+  ftr_write_flow_begini(span_name(name), id);
+  in_hook = 0;
+  return start;
+}
+
+static void handoff_end(ftr_timestamp_t start, int name) {
+  if (!start)
+    return;
+  in_hook = 1;
+  ftr_write_spani(span_name(name), start, ftr_now_ns());
+  in_hook = 0;
+}
+
+// Write a mutex's totals as an "ftr.lock_contention" instant and reset them.
+// Returns the waits it had; the durations are stored in ns.
+static uint64_t write_totals(lock_entry_t *e, double *wait, double *max) {
+  static ftr_site_t name_site, lock_site, contended_site, wait_site, max_site;
+  double ns_per_tick = 1e9 / (double)ftr_ticks_per_second();
+  uint64_t contended = __atomic_exchange_n(&e->contended, 0, __ATOMIC_RELAXED);
+  *wait = (double)__atomic_exchange_n(&e->wait_ticks, 0, __ATOMIC_RELAXED) *
+          ns_per_tick;
+  *max = (double)__atomic_exchange_n(&e->max_ticks, 0, __ATOMIC_RELAXED) *
+         ns_per_tick;
+  ftr_arg_t args[4] = {
+      {ftr_site_ref(&lock_site, "lock"), (int64_t)e->addr},
+      {ftr_site_ref(&contended_site, "contended"), (int64_t)contended},
+      {ftr_site_ref(&wait_site, "wait_ns"), (int64_t)*wait},
+      {ftr_site_ref(&max_site, "max_wait_ns"), (int64_t)*max},
+  };
+  ftr_write_marki_args(ftr_site_ref(&name_site, "ftr.lock_contention"), args,
+                       4);
+  return contended;
+}
+
+// Write each contended mutex's totals and reset them for the next session.
+// Hand-offs still pending belong to the closing trace, so they are dropped.
+static void report(void) {
+  static lock_entry_t *sorted[FTR_LOCK_TABLE_SIZE];
+  static ftr_site_t untracked_name_site, waits_site;
+  if (in_hook)
+    return;
+  in_hook = 1;
+  size_t n = 0;
+  for (size_t i = 0; i < FTR_LOCK_TABLE_SIZE; i++) {
+    __atomic_store_n(&table[i].flow_id, 0, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&table[i].kind, __ATOMIC_ACQUIRE) == KIND_MUTEX &&
+        __atomic_load_n(&table[i].contended, __ATOMIC_RELAXED))
+      sorted[n++] = &table[i];
+  }
+  // Insertion sort by total wait, longest first; n is small in practice.
+  for (size_t i = 1; i < n; i++) {
+    lock_entry_t *e = sorted[i];
+    size_t j = i;
+    for (; j > 0 && sorted[j - 1]->wait_ticks < e->wait_ticks; j--)
+      sorted[j] = sorted[j - 1];
+    sorted[j] = e;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    lock_entry_t *e = sorted[i];
+    double wait, max;
+    uint64_t contended = write_totals(e, &wait, &max);
+    if (i >= FTR_LOCK_REPORT_TOP)
+      continue;
+    // Static mutexes have a name when the module exports them.
+    Dl_info info = {0};
+    int named = dladdr((void *)e->addr, &info) && info.dli_sname &&
+                (uintptr_t)info.dli_saddr == e->addr;
+    fprintf(stderr,
+            "[ftr] lock %#" PRIxPTR "%s%s: %llu contended, %.3f ms waiting, "
+            "max %.1f us\n",
+            e->addr, named ? " " : "", named ? info.dli_sname : "",
+            (unsigned long long)contended, wait / 1e6, max / 1e3);
+  }
+  if (n > FTR_LOCK_REPORT_TOP)
+    fprintf(stderr, "[ftr] ... and %zu more contended locks\n",
+            n - FTR_LOCK_REPORT_TOP);
+
+  uint64_t lost = __atomic_exchange_n(&untracked, 0, __ATOMIC_RELAXED);
+  if (lost) {
+    ftr_arg_t args[1] = {{ftr_site_ref(&waits_site, "waits"), (int64_t)lost}};
+    ftr_write_marki_args(
+        ftr_site_ref(&untracked_name_site, "ftr.lock_untracked"), args, 1);
+    fprintf(stderr,
+            "[ftr] %llu waits on locks beyond the %d-entry table were not "
+            "counted\n",
+            (unsigned long long)lost, FTR_LOCK_TABLE_SIZE);
+  }
+  in_hook = 0;
+}
+
+// Free the entry of a lock that is being destroyed, writing its totals
+// first if it is a contended mutex.
+static void release(const void *p) {
+  lock_entry_t *e = lookup(p, 0);
+  if (!e)
+    return;
+  if (__atomic_load_n(&e->kind, __ATOMIC_ACQUIRE) == KIND_MUTEX &&
+      __atomic_load_n(&e->contended, __ATOMIC_RELAXED) && can_trace()) {
+    in_hook = 1;
+    double wait, max;
+    write_totals(e, &wait, &max);
+    in_hook = 0;
+  }
+  __atomic_store_n(&e->kind, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->waiters, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->flow_id, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->contended, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->wait_ticks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->max_ticks, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->addr, ADDR_FREED, __ATOMIC_RELEASE);
+}
+
+__attribute__((constructor)) static void ftr_lock_init(void) {
+  ENSURE_RESOLVED();
+  ftr_at_close(report);
+}
+
+// ---------------------------------------------------------------------------
+// Interposed entry points
+// ---------------------------------------------------------------------------
+
+int pthread_mutex_lock(pthread_mutex_t *m) {
+  ENSURE_RESOLVED();
+  int rc = real_mutex_trylock(m);
+  if (__builtin_expect(rc != EBUSY, 1))
+    return rc;
+  if (!can_trace())
+    return real_mutex_lock(m);
+  wait_t w;
+  wait_begin(&w, m, KIND_MUTEX);
+  rc = real_mutex_lock(m);
+  wait_end(&w, N_MUTEX_WAIT, rc);
+  return rc;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *m, const struct timespec *t) {
+  ENSURE_RESOLVED();
+  int rc = real_mutex_trylock(m);
+  if (__builtin_expect(rc != EBUSY, 1))
+    return rc;
+  if (!can_trace())
+    return real_mutex_timedlock(m, t);
+  wait_t w;
+  wait_begin(&w, m, KIND_MUTEX);
+  rc = real_mutex_timedlock(m, t);
+  wait_end(&w, N_MUTEX_WAIT, rc);
+  return rc;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *m) {
+  ENSURE_RESOLVED();
+  if (__builtin_expect(!__atomic_load_n(waiting_slot(m), __ATOMIC_RELAXED),
+                       1) ||
+      !can_trace())
+    return real_mutex_unlock(m);
+  ftr_timestamp_t start = handoff_begin(m, N_MUTEX_UNLOCK);
+  int rc = real_mutex_unlock(m);
+  handoff_end(start, N_MUTEX_UNLOCK);
+  return rc;
+}
+
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m) {
+  ENSURE_RESOLVED();
+  if (!can_trace())
+    return real_cond_wait(c, m);
+  wait_t w;
+  wait_begin(&w, c, KIND_COND);
+  int rc = real_cond_wait(c, m);
+  wait_end(&w, N_COND_WAIT, rc);
+  return rc;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *c, pthread_mutex_t *m,
+                           const struct timespec *t) {
+  ENSURE_RESOLVED();
+  if (!can_trace())
+    return real_cond_timedwait(c, m, t);
+  wait_t w;
+  wait_begin(&w, c, KIND_COND);
+  int rc = real_cond_timedwait(c, m, t);
+  wait_end(&w, N_COND_WAIT, rc);
+  return rc;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *m) {
+  ENSURE_RESOLVED();
+  release(m);
+  return real_mutex_destroy(m);
+}
+
+static int signal_common(pthread_cond_t *c, int (*fn)(pthread_cond_t *)) {
+  if (__builtin_expect(!__atomic_load_n(waiting_slot(c), __ATOMIC_RELAXED),
+                       1) ||
+      !can_trace())
+    return fn(c);
+  ftr_timestamp_t start = handoff_begin(c, N_COND_SIGNAL);
+  int rc = fn(c);
+  handoff_end(start, N_COND_SIGNAL);
+  return rc;
+}
+
+int pthread_cond_signal(pthread_cond_t *c) {
+  ENSURE_RESOLVED();
+  return signal_common(c, real_cond_signal);
+}
+
+int pthread_cond_broadcast(pthread_cond_t *c) {
+  ENSURE_RESOLVED();
+  return signal_common(c, real_cond_broadcast);
+}
+
+int pthread_cond_destroy(pthread_cond_t *c) {
+  ENSURE_RESOLVED();
+  release(c);
+  return real_cond_destroy(c);
+}
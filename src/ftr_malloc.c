@@ -0,0 +1,489 @@
+// libftr_malloc — allocation tracer for LD_PRELOAD.
+//
+//   LD_PRELOAD=libftr_malloc.so FTR_TRACE_PATH=trace.fxt ./app
+//
+// Interposes malloc/calloc/realloc/free, the aligned allocators and the
+// global operator new/delete. Each thread keeps its live bytes (bytes it
+// allocated minus bytes it freed, by usable size) and an allocation count in
+// initial-exec TLS. The live bytes are mirrored into an ftr_atomic_counter_t,
+// which ftr's counter sampler writes once per counter window when it changed
+// and at close, so an idle thread's last value is still exact. The
+// allocation rate is written through ftr_write_counteri() every
+// FTR_MALLOC_INTERVAL_MS of allocating. Allocations of at least
+// FTR_MALLOC_MIN_SIZE bytes, or taking at least FTR_MALLOC_MIN_NS, are
+// recorded as spans.
+//
+// The bookkeeping never allocates. Calls made while this tracer is emitting go
+// straight to the real allocator, and nothing is emitted while ftr itself
+// holds a lock on the calling thread (flushing to a FILE, copying an
+// interned string), so ftr's buffering is never re-entered. Setting
+// FTR_MALLOC_MIN_NS times every allocation, which costs two extra tick reads
+// per call; leave it unset to keep the fast path to a usable-size lookup and
+// a few TLS updates.
+//
+// Counter names carry a slot number rather than the thread id: a thread
+// takes the lowest free slot on its first emission and gives it back when it
+// exits, so programs that churn through threads reuse a bounded set of
+// interned names.
+
+#define _GNU_SOURCE
+#include "ftr.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FTR_MALLOC_CHECK_EVERY 1024 // allocations between clock checks
+#define FTR_MALLOC_BOOTSTRAP_SIZE 8192
+#define FTR_MALLOC_MAX_SLOTS 1024 // threads with counters at the same time
+
+typedef struct {
+  int64_t live_bytes;
+  ftr_atomic_counter_t *live; // the slot's counter, NULL until claimed
+  uint64_t allocs;            // since the last emission
+  uint64_t next_check;        // value of `allocs` at which to read the clock
+  uint64_t last_emit;         // ticks
+  ftr_str_t rate_ref;
+  uint32_t names_gen; // session generation the refs were last emitted in
+  uint32_t slot;      // 1-based counter name slot, 0 = none yet
+  int claim_tried;    // publish_live has tried to claim a slot
+  int exited;         // slot released by the thread's key destructor
+  int in_hook;
+} ftr_malloc_tls_t;
+
+static __thread ftr_malloc_tls_t tls __attribute__((tls_model("initial-exec")));
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+static void *(*real_new)(size_t);
+static void *(*real_new_array)(size_t);
+
+// dlsym() may allocate before the real allocator is known; serve those
+// requests, aligned ones included, from a static arena that is never freed.
+static char bootstrap_buf[FTR_MALLOC_BOOTSTRAP_SIZE]
+    __attribute__((aligned(16)));
+static size_t bootstrap_pos = 0;
+static int resolving = 0;
+
+static size_t min_span_size = 1 << 20;
+static uint64_t min_span_ns = 0;
+static uint64_t min_span_ticks = 0;
+static uint32_t min_span_gen = 0; // session min_span_ticks was computed for
+static uint64_t interval_ms = 10;
+
+static uint8_t slot_used[FTR_MALLOC_MAX_SLOTS];
+static ftr_atomic_counter_t slot_live[FTR_MALLOC_MAX_SLOTS];
+static char slot_live_name[FTR_MALLOC_MAX_SLOTS][32];
+static pthread_once_t slot_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+static void *bootstrap_alloc_aligned(size_t align, size_t n) {
+  if (align < 16)
+    align = 16;
+  if (align & (align - 1))
+    return NULL;
+  size_t pos = (bootstrap_pos + align - 1) & ~(align - 1);
+  if (pos > sizeof(bootstrap_buf) || n > sizeof(bootstrap_buf) - pos)
+    return NULL;
+  bootstrap_pos = pos + n;
+  return bootstrap_buf + pos;
+}
+
+static void *bootstrap_alloc(size_t n) {
+  return bootstrap_alloc_aligned(16, n);
+}
+
+static inline int is_bootstrap(const void *p) {
+  return (const char *)p >= bootstrap_buf &&
+         (const char *)p < bootstrap_buf + sizeof(bootstrap_buf);
+}
+
+static void resolve(void) {
+  if (resolving)
+    return;
+  resolving = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  real_memalign = dlsym(RTLD_NEXT, "memalign");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+  real_new = dlsym(RTLD_NEXT, "_Znwm");
+  real_new_array = dlsym(RTLD_NEXT, "_Znam");
+
+  const char *v;
+  if ((v = getenv("FTR_MALLOC_MIN_SIZE")))
+    min_span_size = strtoull(v, NULL, 10);
+  if ((v = getenv("FTR_MALLOC_MIN_NS")))
+    min_span_ns = strtoull(v, NULL, 10);
+  if ((v = getenv("FTR_MALLOC_INTERVAL_MS")))
+    interval_ms = strtoull(v, NULL, 10);
+  resolving = 0;
+}
+
+#define ENSURE_RESOLVED()                                                      \
+  do {                                                                         \
+    if (__builtin_expect(real_free == NULL, 0))                                \
+      resolve();                                                               \
+  } while (0)
+
+// ---------------------------------------------------------------------------
+// Emission (slow path, with in_hook set)
+// ---------------------------------------------------------------------------
+
+static void slot_release(void *arg) {
+  __atomic_store_n(&slot_used[(uintptr_t)arg - 1], 0, __ATOMIC_RELEASE);
+  // Later TLS destructors may still allocate; don't claim a slot again.
+  // The counter keeps the thread's final value until the slot is reused.
+  tls.live = NULL;
+  tls.slot = 0;
+  tls.exited = 1;
+}
+
+static void slot_key_create(void) {
+  pthread_key_create(&slot_key, slot_release);
+}
+
+static uint32_t slot_claim(ftr_malloc_tls_t *t) {
+  if (t->slot || t->exited)
+    return t->slot;
+  pthread_once(&slot_key_once, slot_key_create);
+  for (uint32_t i = 0; i < FTR_MALLOC_MAX_SLOTS; i++) {
+    if (__atomic_load_n(&slot_used[i], __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&slot_used[i], 1, __ATOMIC_ACQUIRE))
+      continue;
+    t->slot = i + 1;
+    pthread_setspecific(slot_key, (void *)(uintptr_t)t->slot);
+    ftr_atomic_counter_t *c = &slot_live[i];
+    if (!c->name) {
+      snprintf(slot_live_name[i], sizeof(slot_live_name[i]),
+               "malloc.live_bytes %u", i);
+      c->name = slot_live_name[i];
+    }
+    ftr_atomic_counter_set(c, t->live_bytes); // registers it the first time
+    t->live = c;
+    break;
+  }
+  return t->slot;
+}
+
+static void intern_thread_names(ftr_malloc_tls_t *t) {
+  char name[64];
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  if (t->names_gen == gen && t->rate_ref)
+    return;
+  uint32_t slot = slot_claim(t);
+  if (!slot) {
+    t->rate_ref = 0;
+    return;
+  }
+  // Re-interning an existing name replays it into a new session.
+  int n = snprintf(name, sizeof(name), "malloc.allocs_per_sec %u", slot - 1);
+  t->rate_ref = ftr_intern_dynamic(name, (size_t)n);
+  t->names_gen = gen;
+}
+
+static void emit_counters(ftr_malloc_tls_t *t) {
+  t->next_check = t->allocs + FTR_MALLOC_CHECK_EVERY;
+  uint64_t now = ftr_now_ns();
+  uint64_t tps = ftr_ticks_per_second();
+  uint64_t interval = interval_ms * (tps / 1000);
+  if (now - t->last_emit < interval)
+    return;
+
+  intern_thread_names(t);
+  if (t->rate_ref && t->last_emit)
+    ftr_write_counteri(t->rate_ref,
+                       (int64_t)(t->allocs * tps / (now - t->last_emit)));
+  t->allocs = 0;
+  t->next_check = FTR_MALLOC_CHECK_EVERY;
+  t->last_emit = now;
+}
+
+enum { K_MALLOC, K_CALLOC, K_REALLOC, K_MEMALIGN, K_NEW, K_COUNT };
+
+static ftr_str_t span_name(int kind) {
+  static const char *const names[K_COUNT] = {"malloc", "calloc", "realloc",
+                                             "memalign", "operator new"};
+  static ftr_site_t sites[K_COUNT];
+  return ftr_site_ref(&sites[kind], names[kind]);
+}
+
+static void emit_span(int kind, ftr_timestamp_t start, ftr_timestamp_t end) {
+  ftr_str_t ref = span_name(kind);
+  if (ref)
+    ftr_write_spani(ref, start, end);
+}
+
+// ---------------------------------------------------------------------------
+// Accounting
+// ---------------------------------------------------------------------------
+
+static inline int passthrough(ftr_malloc_tls_t *t) { return t->in_hook; }
+
+// Emitting is only safe when ftr doesn't hold a lock on this thread; the
+// allocation being accounted may come from inside ftr itself. Checked on
+// the slow path only, accounting alone never calls into ftr.
+static inline int can_emit(void) { return !ftr_thread_busy(); }
+
+// Mirror the thread's live bytes into its counter for the sampler. A
+// thread that frees before it allocates claims its slot here.
+static inline void publish_live(ftr_malloc_tls_t *t) {
+  if (__builtin_expect(t->live != NULL, 1)) {
+    __atomic_store_n(&t->live->value, t->live_bytes, __ATOMIC_RELAXED);
+  } else if (!t->claim_tried && can_emit()) {
+    t->claim_tried = 1;
+    t->in_hook = 1;
+    slot_claim(t);
+    t->in_hook = 0;
+  }
+}
+
+static inline void account_alloc(ftr_malloc_tls_t *t, void *p) {
+  t->live_bytes += (int64_t)malloc_usable_size(p);
+  publish_live(t);
+  if (__builtin_expect(++t->allocs >= t->next_check, 0) && can_emit()) {
+    t->in_hook = 1;
+    emit_counters(t);
+    t->in_hook = 0;
+  }
+}
+
+static inline void account_free(ftr_malloc_tls_t *t, void *p) {
+  t->live_bytes -= (int64_t)malloc_usable_size(p);
+  publish_live(t);
+}
+
+static inline int want_timing(size_t n) {
+  return n >= min_span_size || min_span_ns != 0;
+}
+
+// FTR_MALLOC_MIN_NS in ticks of the open session. The tick rate is set when
+// a session starts, before its generation is published.
+static uint64_t span_ticks(void) {
+  uint32_t gen = __atomic_load_n(&ftr_generation, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&min_span_gen, __ATOMIC_ACQUIRE) != gen) {
+    __atomic_store_n(&min_span_ticks,
+                     min_span_ns * ftr_ticks_per_second() / 1000000000ULL,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&min_span_gen, gen, __ATOMIC_RELEASE);
+  }
+  return __atomic_load_n(&min_span_ticks, __ATOMIC_RELAXED);
+}
+
+// Finish an allocation that was timed: account for it and record a span if
+// it crossed either threshold.
+static void finish_timed(ftr_malloc_tls_t *t, int kind, size_t n, void *p,
+                         ftr_timestamp_t start) {
+  ftr_timestamp_t end = ftr_now_ns();
+  if ((n >= min_span_size ||
+       (min_span_ns && end - start >= span_ticks())) &&
+      can_emit()) {
+    t->in_hook = 1;
+    emit_span(kind, start, end);
+    t->in_hook = 0;
+  }
+  if (p)
+    account_alloc(t, p);
+}
+
+// ---------------------------------------------------------------------------
+// Interposed entry points
+// ---------------------------------------------------------------------------
+
+void *malloc(size_t n) {
+  ENSURE_RESOLVED();
+  if (__builtin_expect(!real_malloc, 0))
+    return bootstrap_alloc(n);
+  ftr_malloc_tls_t *t = &tls;
+  if (passthrough(t))
+    return real_malloc(n);
+  if (__builtin_expect(want_timing(n), 0)) {
+    ftr_timestamp_t start = ftr_now_ns();
+    void *p = real_malloc(n);
+    finish_timed(t, K_MALLOC, n, p, start);
+    return p;
+  }
+  void *p = real_malloc(n);
+  if (p)
+    account_alloc(t, p);
+  return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  ENSURE_RESOLVED();
+  if (__builtin_expect(!real_calloc, 0)) {
+    // Zeroed already: the bootstrap arena is static and never reused.
+    if (size && nmemb > SIZE_MAX / size)
+      return NULL;
+    return bootstrap_alloc(nmemb * size);
+  }
+  ftr_malloc_tls_t *t = &tls;
+  if (passthrough(t))
+    return real_calloc(nmemb, size);
+  size_t n = nmemb * size;
+  if (__builtin_expect(want_timing(n), 0)) {
+    ftr_timestamp_t start = ftr_now_ns();
+    void *p = real_calloc(nmemb, size);
+    finish_timed(t, K_CALLOC, n, p, start);
+    return p;
+  }
+  void *p = real_calloc(nmemb, size);
+  if (p)
+    account_alloc(t, p);
+  return p;
+}
+
+void *realloc(void *old, size_t n) {
+  ENSURE_RESOLVED();
+  if (is_bootstrap(old) || __builtin_expect(!real_realloc, 0)) {
+    void *p = malloc(n);
+    if (p && old) {
+      size_t avail = (size_t)(bootstrap_buf + sizeof(bootstrap_buf) -
+                              (const char *)old);
+      memcpy(p, old, n < avail ? n : avail);
+    }
+    return p;
+  }
+  ftr_malloc_tls_t *t = &tls;
+  if (passthrough(t))
+    return real_realloc(old, n);
+  if (old)
+    account_free(t, old);
+  void *p;
+  if (__builtin_expect(want_timing(n), 0)) {
+    ftr_timestamp_t start = ftr_now_ns();
+    p = real_realloc(old, n);
+    finish_timed(t, K_REALLOC, n, p, start);
+  } else {
+    p = real_realloc(old, n);
+    if (p)
+      account_alloc(t, p);
+  }
+  // A failed realloc leaves the old block in place.
+  if (!p && old && n) {
+    t->live_bytes += (int64_t)malloc_usable_size(old);
+    publish_live(t);
+  }
+  return p;
+}
+
+void free(void *p) {
+  if (!p || is_bootstrap(p))
+    return;
+  ENSURE_RESOLVED();
+  ftr_malloc_tls_t *t = &tls;
+  if (!passthrough(t))
+    account_free(t, p);
+  real_free(p);
+}
+
+static void *aligned_common(size_t align, size_t n,
+                            void *(*fn)(size_t, size_t)) {
+  if (__builtin_expect(!fn, 0))
+    return bootstrap_alloc_aligned(align, n);
+  ftr_malloc_tls_t *t = &tls;
+  if (passthrough(t))
+    return fn(align, n);
+  if (__builtin_expect(want_timing(n), 0)) {
+    ftr_timestamp_t start = ftr_now_ns();
+    void *p = fn(align, n);
+    finish_timed(t, K_MEMALIGN, n, p, start);
+    return p;
+  }
+  void *p = fn(align, n);
+  if (p)
+    account_alloc(t, p);
+  return p;
+}
+
+void *memalign(size_t align, size_t n) {
+  ENSURE_RESOLVED();
+  return aligned_common(align, n, real_memalign);
+}
+
+void *aligned_alloc(size_t align, size_t n) {
+  ENSURE_RESOLVED();
+  return aligned_common(align, n, real_aligned_alloc);
+}
+
+int posix_memalign(void **out, size_t align, size_t n) {
+  ENSURE_RESOLVED();
+  if (__builtin_expect(!real_posix_memalign, 0)) {
+    if (align % sizeof(void *) || (align & (align - 1)))
+      return EINVAL;
+    void *p = bootstrap_alloc_aligned(align, n);
+    if (!p)
+      return ENOMEM;
+    *out = p;
+    return 0;
+  }
+  ftr_malloc_tls_t *t = &tls;
+  if (passthrough(t))
+    return real_posix_memalign(out, align, n);
+  ftr_timestamp_t start = want_timing(n) ? ftr_now_ns() : 0;
+  int rc = real_posix_memalign(out, align, n);
+  void *p = rc == 0 ? *out : NULL;
+  if (start)
+    finish_timed(t, K_MEMALIGN, n, p, start);
+  else if (p)
+    account_alloc(t, p);
+  return rc;
+}
+
+// Global operator new/delete, by their Itanium ABI names. On failure the
+// request is handed to the next definition, which runs the new-handler and
+// throws std::bad_alloc as the language requires.
+static void *new_common(size_t n, void *(*next)(size_t)) {
+  ENSURE_RESOLVED();
+  if (__builtin_expect(!real_malloc, 0))
+    return bootstrap_alloc(n ? n : 1);
+  ftr_malloc_tls_t *t = &tls;
+  void *p;
+  if (passthrough(t)) {
+    p = real_malloc(n ? n : 1);
+  } else if (__builtin_expect(want_timing(n), 0)) {
+    ftr_timestamp_t start = ftr_now_ns();
+    p = real_malloc(n ? n : 1);
+    finish_timed(t, K_NEW, n, p, start);
+  } else {
+    p = real_malloc(n ? n : 1);
+    if (p)
+      account_alloc(t, p);
+  }
+  if (p || !next)
+    return p;
+  return next(n);
+}
+
+void *_Znwm(size_t n) { return new_common(n, real_new); }
+void *_Znam(size_t n) { return new_common(n, real_new_array); }
+
+void *_ZnwmRKSt9nothrow_t(size_t n, const void *tag) {
+  (void)tag;
+  return malloc(n ? n : 1);
+}
+
+void *_ZnamRKSt9nothrow_t(size_t n, const void *tag) {
+  (void)tag;
+  return malloc(n ? n : 1);
+}
+
+void _ZdlPv(void *p) { free(p); }
+void _ZdaPv(void *p) { free(p); }
+void _ZdlPvm(void *p, size_t n) {
+  (void)n;
+  free(p);
+}
+void _ZdaPvm(void *p, size_t n) {
+  (void)n;
+  free(p);
+}
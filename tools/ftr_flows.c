@@ -0,0 +1,677 @@
+// ftr-flows — end-to-end latency and critical paths of flow events.
+//
+//   ftr-flows [-n N] trace.fxt[.gz]
+//
+// Streams the trace once and rebuilds every flow chain (begin, steps, end) by
+// correlation id. Each flow point is matched to the innermost span that
+// contains it on the same thread; that span is the stage's execution.
+// FTR_SCOPE_FLOW_* write the flow point when the scope opens and the span
+// when it closes, so a point waits in a short per-thread list until the
+// first span around it arrives. Along a chain, a stage's queue wait is the
+// gap between the end of the previous stage and the start of its own span.
+// Overlap with the previous stage is charged to that stage, so waits and
+// executions add up to the flow's total latency (first span start to last
+// span end).
+//
+// Flow points are written in causal order, so by the time a flow's end
+// point arrives, every earlier point of the flow has been read. A flow is
+// complete once its end point and all earlier points have their spans. Only
+// flows in flight are held in memory, plus fixed-size histograms per stage
+// name and the N slowest flows. Correlation ids may be reused once a flow
+// has ended (e.g. object addresses).
+
+#include "fxt.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *const fxt_tool = "ftr-flows";
+
+#define MAX_STRINGS 0x7FFF
+#define MAX_THREADS 0xFF
+#define MAX_PENDING 4096 // unmatched points kept per thread
+#define HIST_BUCKETS 1024
+
+// Log-linear histogram: 16 sub-buckets per power of two, so a reported
+// percentile is within ~6% of the true value.
+typedef struct {
+  uint64_t count, sum, min, max;
+  uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+static unsigned hist_bucket(uint64_t v) {
+  if (v < 16)
+    return (unsigned)v;
+  unsigned k = 63 - (unsigned)__builtin_clzll(v);
+  return (k - 3) * 16 + (unsigned)((v >> (k - 4)) & 15);
+}
+
+static uint64_t hist_bucket_mid(unsigned b) {
+  if (b < 16)
+    return b;
+  unsigned k = b / 16 + 3;
+  uint64_t lo = (uint64_t)(16 + b % 16) << (k - 4);
+  return lo + ((1ULL << (k - 4)) >> 1);
+}
+
+static void hist_add(hist_t *h, uint64_t v) {
+  if (h->count == 0 || v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+  h->count++;
+  h->sum += v;
+  h->buckets[hist_bucket(v)]++;
+}
+
+static uint64_t hist_quantile(const hist_t *h, double q) {
+  if (h->count == 0)
+    return 0;
+  uint64_t rank = (uint64_t)(q * (double)(h->count - 1)) + 1;
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= rank) {
+      uint64_t v = hist_bucket_mid(b);
+      return v < h->min ? h->min : v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+// Stages are flow point names, deduplicated by content.
+typedef struct {
+  char *name;
+  size_t len;
+  hist_t wait, exec;
+} stage_t;
+
+static stage_t *stages = NULL;
+static uint32_t stage_count = 0, stage_cap = 0;
+static uint32_t *stage_hash = NULL; // index + 1, 0 = empty
+static uint32_t stage_hash_size = 0;
+
+static uint32_t str_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t stage_lookup(const char *s, size_t len) {
+  if (stage_count * 2 >= stage_hash_size) {
+    uint32_t size = stage_hash_size ? stage_hash_size * 2 : 256;
+    uint32_t *table = fxt_calloc(size, sizeof(uint32_t));
+    for (uint32_t i = 0; i < stage_count; i++) {
+      uint32_t slot = str_hash(stages[i].name, stages[i].len) & (size - 1);
+      while (table[slot])
+        slot = (slot + 1) & (size - 1);
+      table[slot] = i + 1;
+    }
+    free(stage_hash);
+    stage_hash = table;
+    stage_hash_size = size;
+  }
+  uint32_t slot = str_hash(s, len) & (stage_hash_size - 1);
+  for (;;) {
+    uint32_t i = stage_hash[slot];
+    if (i == 0)
+      break;
+    if (stages[i - 1].len == len && memcmp(stages[i - 1].name, s, len) == 0)
+      return i - 1;
+    slot = (slot + 1) & (stage_hash_size - 1);
+  }
+  if (stage_count == stage_cap) {
+    stage_cap = stage_cap ? stage_cap * 2 : 64;
+    stages = fxt_realloc(stages, stage_cap * sizeof(stage_t));
+  }
+  stage_t *st = &stages[stage_count];
+  memset(st, 0, sizeof(*st));
+  st->name = fxt_malloc(len + 1);
+  memcpy(st->name, s, len);
+  st->name[len] = '\0';
+  st->len = len;
+  stage_hash[slot] = stage_count + 1;
+  return stage_count++;
+}
+
+// Input string and thread tables.
+static struct {
+  char *s;
+  size_t len;
+} in_strings[MAX_STRINGS + 1];
+static struct {
+  uint64_t pid, tid;
+} in_threads[MAX_THREADS + 1];
+
+static void define_string(const uint64_t *rec, size_t words) {
+  unsigned idx = fxt_bits(rec[0], 16, 15);
+  size_t len = fxt_bits(rec[0], 32, 15);
+  if (idx == 0 || (len + 7) / 8 + 1 > words)
+    return;
+  free(in_strings[idx].s);
+  in_strings[idx].s = fxt_malloc(len + 1);
+  memcpy(in_strings[idx].s, rec + 1, len);
+  in_strings[idx].len = len;
+}
+
+static uint32_t stage_of(const uint64_t *rec, const fxt_event_t *ev) {
+  uint16_t ref = ev->name_ref;
+  if (fxt_ref_inline(ref))
+    return stage_lookup((const char *)(rec + ev->name_at), ref & 0x7FFF);
+  if (ref && in_strings[ref].s)
+    return stage_lookup(in_strings[ref].s, in_strings[ref].len);
+  return stage_lookup("unnamed", 7);
+}
+
+// ---------------------------------------------------------------------------
+// Flows in flight
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint64_t ts;
+  uint64_t start, end; // enclosing span, [ts, ts] when there is none
+  uint64_t tid;
+  uint32_t stage;
+  uint8_t kind; // FXT_EV_FLOW_*
+  uint8_t resolved;
+} point_t;
+
+typedef struct flow {
+  uint64_t id;
+  point_t *points;
+  uint32_t npoints, cap;
+  uint32_t unresolved;
+  uint8_t ended;     // end point seen
+  uint8_t abandoned; // id reused before the flow ended
+  struct flow *next; // hash chain, while the id maps to this flow
+} flow_t;
+
+static flow_t **flow_table = NULL;
+static size_t flow_table_size = 0, live_flows = 0;
+
+static uint64_t id_hash(uint64_t id) { return id * 0x9E3779B97F4A7C15ULL; }
+
+static void flow_table_grow(void) {
+  size_t size = flow_table_size ? flow_table_size * 2 : 4096;
+  flow_t **table = fxt_calloc(size, sizeof(flow_t *));
+  for (size_t i = 0; i < flow_table_size; i++)
+    for (flow_t *f = flow_table[i], *next; f; f = next) {
+      next = f->next;
+      size_t slot = id_hash(f->id) >> 32 & (size - 1);
+      f->next = table[slot];
+      table[slot] = f;
+    }
+  free(flow_table);
+  flow_table = table;
+  flow_table_size = size;
+}
+
+static flow_t **flow_slot(uint64_t id) {
+  flow_t **p = &flow_table[id_hash(id) >> 32 & (flow_table_size - 1)];
+  while (*p && (*p)->id != id)
+    p = &(*p)->next;
+  return p;
+}
+
+static void flow_unlink(flow_t *f) {
+  flow_t **p = flow_slot(f->id);
+  if (*p == f) {
+    *p = f->next;
+    live_flows--;
+  }
+}
+
+// Per-thread points still looking for their span.
+typedef struct {
+  flow_t *flow;
+  uint32_t point;
+} pending_t;
+
+typedef struct {
+  uint64_t pid, tid;
+  pending_t *pending;
+  uint32_t npending, cap;
+} thread_t;
+
+static thread_t *threads = NULL;
+static size_t thread_count = 0, thread_cap = 0;
+static uint32_t *thread_hash = NULL; // index + 1, 0 = empty
+static size_t thread_hash_size = 0;
+
+static size_t thread_slot(uint64_t pid, uint64_t tid) {
+  return id_hash(pid * 31 + tid) >> 32 & (thread_hash_size - 1);
+}
+
+static thread_t *thread_of(uint64_t pid, uint64_t tid) {
+  if (thread_count * 2 >= thread_hash_size) {
+    free(thread_hash);
+    thread_hash_size = thread_hash_size ? thread_hash_size * 2 : 256;
+    thread_hash = fxt_calloc(thread_hash_size, sizeof(uint32_t));
+    for (size_t i = 0; i < thread_count; i++) {
+      size_t slot = thread_slot(threads[i].pid, threads[i].tid);
+      while (thread_hash[slot])
+        slot = (slot + 1) & (thread_hash_size - 1);
+      thread_hash[slot] = (uint32_t)i + 1;
+    }
+  }
+  size_t slot = thread_slot(pid, tid);
+  for (;;) {
+    uint32_t i = thread_hash[slot];
+    if (i == 0)
+      break;
+    if (threads[i - 1].tid == tid && threads[i - 1].pid == pid)
+      return &threads[i - 1];
+    slot = (slot + 1) & (thread_hash_size - 1);
+  }
+  if (thread_count == thread_cap) {
+    thread_cap = thread_cap ? thread_cap * 2 : 64;
+    threads = fxt_realloc(threads, thread_cap * sizeof(thread_t));
+  }
+  thread_t *t = &threads[thread_count];
+  memset(t, 0, sizeof(*t));
+  t->pid = pid;
+  t->tid = tid;
+  thread_hash[slot] = (uint32_t)++thread_count;
+  return t;
+}
+
+// ---------------------------------------------------------------------------
+// Completed flows
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint32_t stage;
+  uint64_t tid, start, wait, exec;
+} step_t;
+
+typedef struct {
+  uint64_t id, total, wait, exec;
+  step_t *steps;
+  uint32_t nsteps;
+} slow_flow_t;
+
+static hist_t total_hist;
+static slow_flow_t *slowest = NULL; // min-heap on total
+static size_t slowest_count = 0, slowest_max = 5;
+static step_t *scratch = NULL;
+static size_t scratch_cap = 0;
+static uint64_t completed = 0, abandoned = 0, unmatched_points = 0,
+                total_points = 0;
+
+static void heap_sift_down(size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < slowest_count && slowest[l].total < slowest[m].total)
+      m = l;
+    if (r < slowest_count && slowest[r].total < slowest[m].total)
+      m = r;
+    if (m == i)
+      return;
+    slow_flow_t tmp = slowest[i];
+    slowest[i] = slowest[m];
+    slowest[m] = tmp;
+    i = m;
+  }
+}
+
+static void heap_sift_up(size_t i) {
+  while (i > 0 && slowest[(i - 1) / 2].total > slowest[i].total) {
+    slow_flow_t tmp = slowest[i];
+    slowest[i] = slowest[(i - 1) / 2];
+    slowest[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static void keep_if_slow(const flow_t *f, uint64_t total, uint64_t wait,
+                         uint64_t exec, uint32_t nsteps) {
+  if (slowest_max == 0)
+    return;
+  if (slowest_count == slowest_max && total <= slowest[0].total)
+    return;
+  slow_flow_t s = {f->id, total, wait, exec,
+                   fxt_malloc(nsteps * sizeof(step_t)), nsteps};
+  memcpy(s.steps, scratch, nsteps * sizeof(step_t));
+  if (slowest_count < slowest_max) {
+    slowest[slowest_count++] = s;
+    heap_sift_up(slowest_count - 1);
+  } else {
+    free(slowest[0].steps);
+    slowest[0] = s;
+    heap_sift_down(0);
+  }
+}
+
+static void flow_free(flow_t *f) {
+  free(f->points);
+  free(f);
+}
+
+static int cmp_point(const void *a, const void *b) {
+  const point_t *x = a, *y = b;
+  return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+static void flow_complete(flow_t *f) {
+  qsort(f->points, f->npoints, sizeof(point_t), cmp_point);
+  if (scratch_cap < f->npoints) {
+    scratch_cap = f->npoints * 2;
+    scratch = fxt_realloc(scratch, scratch_cap * sizeof(step_t));
+  }
+  uint64_t first = f->points[0].start, frontier = first;
+  uint64_t wait_sum = 0, exec_sum = 0;
+  for (uint32_t i = 0; i < f->npoints; i++) {
+    const point_t *p = &f->points[i];
+    uint64_t wait = p->start > frontier ? p->start - frontier : 0;
+    uint64_t from = p->start > frontier ? p->start : frontier;
+    uint64_t exec = p->end > from ? p->end - from : 0;
+    if (p->end > frontier)
+      frontier = p->end;
+    scratch[i] = (step_t){p->stage, p->tid, p->start, wait, exec};
+    if (i > 0)
+      hist_add(&stages[p->stage].wait, wait);
+    hist_add(&stages[p->stage].exec, exec);
+    wait_sum += wait;
+    exec_sum += exec;
+  }
+  uint64_t total = frontier - first;
+  hist_add(&total_hist, total);
+  completed++;
+  keep_if_slow(f, total, wait_sum, exec_sum, f->npoints);
+  flow_free(f);
+}
+
+static void point_resolved(flow_t *f) {
+  if (--f->unresolved > 0)
+    return;
+  if (f->ended)
+    flow_complete(f);
+  else if (f->abandoned)
+    flow_free(f);
+}
+
+static void add_point(thread_t *t, const fxt_event_t *ev, uint32_t stage,
+                      uint64_t id) {
+  total_points++;
+  if (live_flows >= flow_table_size)
+    flow_table_grow();
+  flow_t **slot = flow_slot(id);
+  flow_t *f = *slot;
+  if (f && ev->event_type == FXT_EV_FLOW_BEGIN) {
+    // The id was reused without the previous flow ending.
+    abandoned++;
+    f->abandoned = 1;
+    *slot = f->next;
+    live_flows--;
+    if (f->unresolved == 0)
+      flow_free(f);
+    f = NULL;
+  }
+  if (!f) {
+    f = fxt_calloc(1, sizeof(flow_t));
+    f->id = id;
+    f->next = *slot;
+    *slot = f;
+    live_flows++;
+  }
+  if (f->npoints == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 4;
+    f->points = fxt_realloc(f->points, f->cap * sizeof(point_t));
+  }
+  f->points[f->npoints] = (point_t){ev->ts,  ev->ts, ev->ts, t->tid, stage,
+                                    (uint8_t)ev->event_type, 0};
+  f->unresolved++;
+  if (ev->event_type == FXT_EV_FLOW_END) {
+    f->ended = 1;
+    flow_unlink(f); // a later point with this id starts a new flow
+  }
+
+  if (t->npending == MAX_PENDING) {
+    // Too many points without a span: give up on the older half.
+    uint32_t drop = MAX_PENDING / 2;
+    for (uint32_t i = 0; i < drop; i++) {
+      pending_t old = t->pending[i];
+      unmatched_points++;
+      old.flow->points[old.point].resolved = 1;
+      point_resolved(old.flow);
+    }
+    memmove(t->pending, t->pending + drop,
+            (MAX_PENDING - drop) * sizeof(pending_t));
+    t->npending -= drop;
+  }
+  if (t->npending == t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 16;
+    t->pending = fxt_realloc(t->pending, t->cap * sizeof(pending_t));
+  }
+  t->pending[t->npending++] = (pending_t){f, f->npoints++};
+}
+
+// A span closed on `t`: it is the innermost span around every pending point
+// it contains, since spans are written as they close.
+static void add_span(thread_t *t, uint64_t start, uint64_t end) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < t->npending; i++) {
+    pending_t pd = t->pending[i];
+    point_t *p = &pd.flow->points[pd.point];
+    if (p->ts < start || p->ts > end) {
+      t->pending[kept++] = pd;
+      continue;
+    }
+    p->start = start;
+    p->end = end;
+    p->resolved = 1;
+    point_resolved(pd.flow);
+  }
+  t->npending = kept;
+}
+
+static void finish_pending(void) {
+  for (size_t i = 0; i < thread_count; i++) {
+    thread_t *t = &threads[i];
+    for (uint32_t k = 0; k < t->npending; k++) {
+      unmatched_points++;
+      t->pending[k].flow->points[t->pending[k].point].resolved = 1;
+      point_resolved(t->pending[k].flow);
+    }
+    t->npending = 0;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Report
+// ---------------------------------------------------------------------------
+
+static double ticks_to_us = 1e-3;
+
+static double us(uint64_t ticks) { return (double)ticks * ticks_to_us; }
+
+static int cmp_stage_time(const void *a, const void *b) {
+  const stage_t *x = *(stage_t *const *)a, *y = *(stage_t *const *)b;
+  uint64_t tx = x->wait.sum + x->exec.sum, ty = y->wait.sum + y->exec.sum;
+  return tx > ty ? -1 : tx < ty;
+}
+
+static int cmp_slow(const void *a, const void *b) {
+  const slow_flow_t *x = a, *y = b;
+  return x->total > y->total ? -1 : x->total < y->total;
+}
+
+static void print_path(const slow_flow_t *s) {
+  // Consecutive stages with the same name on the same thread print as one
+  // line; long chains keep their first and last lines.
+  const uint32_t max_lines = 24;
+  uint32_t lines = 0;
+  for (uint32_t i = 0; i < s->nsteps;) {
+    uint32_t j = i + 1;
+    while (j < s->nsteps && s->steps[j].stage == s->steps[i].stage &&
+           s->steps[j].tid == s->steps[i].tid)
+      j++;
+    lines++;
+    i = j;
+  }
+  uint32_t line = 0;
+  uint64_t origin = s->steps[0].start;
+  for (uint32_t i = 0; i < s->nsteps;) {
+    uint32_t j = i + 1;
+    uint64_t wait = s->steps[i].wait, exec = s->steps[i].exec;
+    while (j < s->nsteps && s->steps[j].stage == s->steps[i].stage &&
+           s->steps[j].tid == s->steps[i].tid) {
+      wait += s->steps[j].wait;
+      exec += s->steps[j].exec;
+      j++;
+    }
+    if (lines > max_lines && line == max_lines / 2)
+      printf("      ... %u more\n", lines - max_lines);
+    if (lines <= max_lines || line < max_lines / 2 ||
+        line >= lines - max_lines / 2) {
+      char count[16] = "";
+      if (j - i > 1)
+        snprintf(count, sizeof(count), " x%u", j - i);
+      printf("    %+12.1f  %-28s%-6s tid %-8llu wait %10.1f  exec %10.1f\n",
+             us(s->steps[i].start - origin), stages[s->steps[i].stage].name,
+             count, (unsigned long long)s->steps[i].tid, us(wait), us(exec));
+    }
+    line++;
+    i = j;
+  }
+}
+
+static void report(void) {
+  printf("%llu flows completed, %zu in flight at the end, %llu abandoned "
+         "(id reused before the end)\n",
+         (unsigned long long)completed, live_flows,
+         (unsigned long long)abandoned);
+  printf("%llu flow points, %llu without an enclosing span\n\n",
+         (unsigned long long)total_points,
+         (unsigned long long)unmatched_points);
+  if (completed == 0)
+    return;
+
+  const hist_t *h = &total_hist;
+  printf("end-to-end latency (us)\n");
+  printf("  %10s %10s %10s %10s %10s %10s %10s\n", "min", "p50", "p90", "p99",
+         "p99.9", "max", "mean");
+  printf("  %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n\n", us(h->min),
+         us(hist_quantile(h, 0.5)), us(hist_quantile(h, 0.9)),
+         us(hist_quantile(h, 0.99)), us(hist_quantile(h, 0.999)), us(h->max),
+         us(h->sum) / (double)h->count);
+
+  stage_t **order = fxt_malloc(stage_count * sizeof(stage_t *));
+  uint64_t grand = 0;
+  for (uint32_t i = 0; i < stage_count; i++) {
+    order[i] = &stages[i];
+    grand += stages[i].wait.sum + stages[i].exec.sum;
+  }
+  qsort(order, stage_count, sizeof(stage_t *), cmp_stage_time);
+  printf("stages by share of total latency (us)\n");
+  printf("  %-28s %10s %6s %10s %10s %10s %10s\n", "stage", "count", "share",
+         "wait p50", "wait p99", "exec p50", "exec p99");
+  for (uint32_t i = 0; i < stage_count; i++) {
+    const stage_t *st = order[i];
+    if (st->exec.count == 0)
+      continue;
+    double share = grand ? 100.0 * (double)(st->wait.sum + st->exec.sum) /
+                               (double)grand
+                         : 0;
+    printf("  %-28.28s %10llu %5.1f%% %10.1f %10.1f %10.1f %10.1f\n",
+           st->name, (unsigned long long)st->exec.count, share,
+           us(hist_quantile(&st->wait, 0.5)), us(hist_quantile(&st->wait, 0.99)),
+           us(hist_quantile(&st->exec, 0.5)),
+           us(hist_quantile(&st->exec, 0.99)));
+  }
+  free(order);
+
+  qsort(slowest, slowest_count, sizeof(slow_flow_t), cmp_slow);
+  for (size_t i = 0; i < slowest_count; i++) {
+    const slow_flow_t *s = &slowest[i];
+    printf("\nslowest #%zu: flow 0x%llx, %.1f us (wait %.1f, exec %.1f), "
+           "%u stages\n",
+           i + 1, (unsigned long long)s->id, us(s->total), us(s->wait),
+           us(s->exec), s->nsteps);
+    print_path(s);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: ftr-flows [-n N] INPUT\n"
+                  "  -n N  show the critical path of the N slowest flows "
+                  "(default 5)\n");
+}
+
+int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      slowest_max = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (optind + 1 != argc) {
+    usage();
+    return 2;
+  }
+  slowest = fxt_calloc(slowest_max ? slowest_max : 1, sizeof(slow_flow_t));
+
+  fxt_reader_t r;
+  if (fxt_open(&r, argv[optind]) < 0) {
+    fprintf(stderr, "ftr-flows: cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  int rc;
+  while ((rc = fxt_next(&r)) > 0) {
+    const uint64_t *rec = r.rec;
+    switch (fxt_bits(rec[0], 0, 4)) {
+    case FXT_REC_INIT:
+      if (r.words >= 2 && rec[1])
+        ticks_to_us = 1e6 / (double)rec[1];
+      break;
+    case FXT_REC_STRING:
+      define_string(rec, r.words);
+      break;
+    case FXT_REC_THREAD: {
+      unsigned idx = fxt_bits(rec[0], 16, 8);
+      if (idx && r.words >= 3) {
+        in_threads[idx].pid = rec[1];
+        in_threads[idx].tid = rec[2];
+      }
+      break;
+    }
+    case FXT_REC_EVENT: {
+      fxt_event_t ev;
+      if (fxt_parse_event(rec, r.words, &ev) < 0)
+        break;
+      if (ev.thread_ref) {
+        ev.pid = in_threads[ev.thread_ref].pid;
+        ev.tid = in_threads[ev.thread_ref].tid;
+      }
+      switch (ev.event_type) {
+      case FXT_EV_COMPLETE:
+        if (ev.trailer_at < r.words)
+          add_span(thread_of(ev.pid, ev.tid), ev.ts, rec[ev.trailer_at]);
+        break;
+      case FXT_EV_FLOW_BEGIN:
+      case FXT_EV_FLOW_STEP:
+      case FXT_EV_FLOW_END:
+        if (ev.trailer_at < r.words)
+          add_point(thread_of(ev.pid, ev.tid), &ev, stage_of(rec, &ev),
+                    rec[ev.trailer_at]);
+        break;
+      }
+      break;
+    }
+    }
+  }
+  fxt_close(&r);
+  if (rc < 0)
+    fprintf(stderr, "ftr-flows: truncated record, ignoring the rest\n");
+  finish_pending();
+  report();
+  return 0;
+}
@@ -0,0 +1,531 @@
+// ftr-merge — merge FXT traces from several processes or hosts into one.
+//
+//   ftr-merge [-m] -o merged.fxt[.gz] a.fxt[.gz] b.fxt[.gz] ...
+//
+// Every input is read twice as a stream: once to collect its tick rate, its
+// "ftr.clock_sync" points and the pids it uses, and once to rewrite it into
+// the output. Timestamps are moved onto a common nanosecond timebase
+// (CLOCK_REALTIME by default, CLOCK_MONOTONIC with -m for traces from a single
+// host) by interpolating between sync points. String and thread references
+// are renumbered into one output table that is rebuilt from scratch whenever
+// it fills up, so memory stays bounded by the table sizes rather than the
+// trace sizes.
+
+#include "fxt.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *const fxt_tool = "ftr-merge";
+
+#define MAX_STRINGS 0x7FFF
+#define MAX_THREADS 0xFF
+#define MAX_PIDS 1024
+#define STR_HASH_SIZE 0x10000
+
+// Sync points closer than this fraction of a second are folded together, so
+// that interpolation never runs over a segment dominated by read jitter.
+#define SYNC_MIN_SPACING_DIV 10
+
+typedef struct {
+  uint64_t ticks;
+  uint64_t ns;
+} sync_point_t;
+
+typedef struct {
+  const char *path;
+  uint64_t ticks_per_sec;
+  sync_point_t *syncs;
+  size_t nsyncs, cap;
+  size_t cursor; // last segment used, traces are mostly in time order
+  uint64_t pids[MAX_PIDS];
+  size_t npids;
+  uint64_t pid_offset;
+} input_t;
+
+// Input string/thread tables, valid while the input is being rewritten.
+typedef struct {
+  char *s;
+  size_t len;
+  uint16_t out_idx;
+  uint32_t epoch; // output table epoch `out_idx` belongs to
+} in_string_t;
+
+typedef struct {
+  uint64_t pid, tid;
+  int valid;
+  uint8_t out_ref;
+  uint32_t epoch;
+} in_thread_t;
+
+static in_string_t in_strings[MAX_STRINGS + 1];
+static in_thread_t in_threads[MAX_THREADS + 1];
+
+// Output tables. Entries are only appended; when a table is full it is reset
+// and its epoch bumped, which invalidates every cached input mapping. The
+// output string table owns copies of its keys.
+static struct {
+  char *s;
+  size_t len;
+} out_strings[MAX_STRINGS + 1];
+static uint16_t out_string_count = 0;
+static uint16_t out_string_hash[STR_HASH_SIZE];
+static uint32_t out_string_epoch = 1;
+
+static uint8_t out_thread_count = 0;
+static uint32_t out_thread_epoch = 1;
+
+static int use_monotonic = 0;
+static fxt_writer_t out;
+
+static uint32_t str_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// ---------------------------------------------------------------------------
+// Pass 1: tick rate, sync points and pids
+// ---------------------------------------------------------------------------
+
+static void add_pid(input_t *in, uint64_t pid) {
+  for (size_t i = 0; i < in->npids; i++)
+    if (in->pids[i] == pid)
+      return;
+  if (in->npids < MAX_PIDS)
+    in->pids[in->npids++] = pid;
+}
+
+static void add_sync(input_t *in, uint64_t ticks, uint64_t ns) {
+  if (in->nsyncs == in->cap) {
+    in->cap = in->cap ? in->cap * 2 : 64;
+    in->syncs = fxt_realloc(in->syncs, in->cap * sizeof(sync_point_t));
+  }
+  in->syncs[in->nsyncs++] = (sync_point_t){ticks, ns};
+}
+
+static int is_clock_sync(const uint64_t *rec, const fxt_event_t *ev) {
+  return ev->event_type == FXT_EV_COUNTER &&
+         fxt_inline_eq(rec, ev->name_at, ev->name_ref, "ftr.clock_sync");
+}
+
+static void scan_sync(input_t *in, const uint64_t *rec, size_t words,
+                      const fxt_event_t *ev) {
+  const char *want = use_monotonic ? "monotonic_ns" : "realtime_ns";
+  size_t at = ev->args_at;
+  for (unsigned i = 0; i < ev->arg_count; i++) {
+    fxt_arg_t a;
+    if (fxt_next_arg(rec, words, &at, &a) < 0)
+      return;
+    if (a.type == FXT_ARG_UINT64 &&
+        fxt_inline_eq(rec, a.name_at, a.name_ref, want)) {
+      add_sync(in, ev->ts, rec[a.value_at]);
+      return;
+    }
+  }
+}
+
+static int cmp_sync(const void *a, const void *b) {
+  const sync_point_t *x = a, *y = b;
+  return x->ticks < y->ticks ? -1 : x->ticks > y->ticks;
+}
+
+static int scan_input(input_t *in) {
+  fxt_reader_t r;
+  if (fxt_open(&r, in->path) < 0) {
+    fprintf(stderr, "ftr-merge: cannot open %s\n", in->path);
+    return -1;
+  }
+  in->ticks_per_sec = 1000000000ULL;
+  int rc;
+  while ((rc = fxt_next(&r)) > 0) {
+    const uint64_t *rec = r.rec;
+    switch (fxt_bits(rec[0], 0, 4)) {
+    case FXT_REC_INIT:
+      if (r.words >= 2 && rec[1])
+        in->ticks_per_sec = rec[1];
+      break;
+    case FXT_REC_THREAD:
+      if (r.words >= 3)
+        add_pid(in, rec[1]);
+      break;
+    case FXT_REC_KOBJ:
+      if (fxt_bits(rec[0], 16, 8) == 1 && r.words >= 2)
+        add_pid(in, rec[1]);
+      break;
+    case FXT_REC_EVENT: {
+      fxt_event_t ev;
+      if (fxt_parse_event(rec, r.words, &ev) < 0)
+        break;
+      if (ev.thread_ref == 0)
+        add_pid(in, ev.pid);
+      if (is_clock_sync(rec, &ev))
+        scan_sync(in, rec, r.words, &ev);
+      break;
+    }
+    }
+  }
+  fxt_close(&r);
+  if (rc < 0)
+    fprintf(stderr, "ftr-merge: %s: truncated record, ignoring the rest\n",
+            in->path);
+
+  qsort(in->syncs, in->nsyncs, sizeof(sync_point_t), cmp_sync);
+  uint64_t min_spacing = in->ticks_per_sec / SYNC_MIN_SPACING_DIV;
+  size_t kept = 0;
+  for (size_t i = 0; i < in->nsyncs; i++) {
+    int last = i + 1 == in->nsyncs;
+    if (kept > 0 && in->syncs[i].ticks - in->syncs[kept - 1].ticks <
+                        min_spacing) {
+      // Too close to the previous kept point: the final point still wins so
+      // the end of the trace is anchored.
+      if (last && kept > 1)
+        in->syncs[kept - 1] = in->syncs[i];
+      continue;
+    }
+    in->syncs[kept++] = in->syncs[i];
+  }
+  in->nsyncs = kept;
+  if (in->nsyncs == 0)
+    fprintf(stderr,
+            "ftr-merge: %s has no clock sync points, its timestamps will "
+            "only be relative\n",
+            in->path);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Timebase conversion
+// ---------------------------------------------------------------------------
+
+static uint64_t extrapolate(const input_t *in, const sync_point_t *p,
+                            uint64_t ticks) {
+  double dt = (double)(int64_t)(ticks - p->ticks);
+  return p->ns + (uint64_t)(int64_t)(dt * 1e9 / (double)in->ticks_per_sec);
+}
+
+static uint64_t to_ns(input_t *in, uint64_t ticks) {
+  if (in->nsyncs == 0) {
+    sync_point_t origin = {0, 0};
+    return extrapolate(in, &origin, ticks);
+  }
+  const sync_point_t *s = in->syncs;
+  size_t n = in->nsyncs;
+  if (n == 1 || ticks <= s[0].ticks)
+    return extrapolate(in, &s[0], ticks);
+  if (ticks >= s[n - 1].ticks)
+    return extrapolate(in, &s[n - 1], ticks);
+
+  size_t k = in->cursor;
+  if (!(s[k].ticks <= ticks && ticks < s[k + 1].ticks)) {
+    size_t lo = 0, hi = n - 1; // s[lo].ticks <= ticks < s[hi].ticks
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (s[mid].ticks <= ticks)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    k = in->cursor = lo;
+  }
+  double frac = (double)(ticks - s[k].ticks) /
+                (double)(s[k + 1].ticks - s[k].ticks);
+  double span = (double)(int64_t)(s[k + 1].ns - s[k].ns);
+  return s[k].ns + (uint64_t)(int64_t)(frac * span);
+}
+
+// ---------------------------------------------------------------------------
+// Pass 2: rewriting
+// ---------------------------------------------------------------------------
+
+static void reset_out_strings(void) {
+  for (uint16_t i = 1; i <= out_string_count; i++)
+    free(out_strings[i].s);
+  out_string_count = 0;
+  memset(out_string_hash, 0, sizeof(out_string_hash));
+  out_string_epoch++;
+}
+
+static uint16_t out_intern(const char *s, size_t len) {
+  uint32_t slot = str_hash(s, len) & (STR_HASH_SIZE - 1);
+  for (;;) {
+    uint16_t idx = out_string_hash[slot];
+    if (idx == 0)
+      break;
+    if (out_strings[idx].len == len && memcmp(out_strings[idx].s, s, len) == 0)
+      return idx;
+    slot = (slot + 1) & (STR_HASH_SIZE - 1);
+  }
+  uint16_t idx = ++out_string_count;
+  out_strings[idx].s = fxt_malloc(len + 1);
+  memcpy(out_strings[idx].s, s, len + 1);
+  out_strings[idx].len = len;
+  out_string_hash[slot] = idx;
+  fxt_write_string(&out, idx, s, len);
+  return idx;
+}
+
+static uint16_t remap_str(uint16_t ref) {
+  if (ref == 0 || fxt_ref_inline(ref))
+    return ref;
+  in_string_t *e = &in_strings[ref & 0x7FFF];
+  if (!e->s)
+    return 0; // dangling in the input
+  if (e->epoch != out_string_epoch) {
+    e->out_idx = out_intern(e->s, e->len);
+    e->epoch = out_string_epoch;
+  }
+  return e->out_idx;
+}
+
+static uint8_t remap_thread(input_t *in, unsigned ref) {
+  if (ref == 0)
+    return 0;
+  in_thread_t *t = &in_threads[ref];
+  if (!t->valid)
+    return 0;
+  if (t->epoch != out_thread_epoch) {
+    t->out_ref = ++out_thread_count;
+    t->epoch = out_thread_epoch;
+    uint64_t rec[3];
+    rec[0] = FXT_REC_THREAD | (3ULL << 4) | ((uint64_t)t->out_ref << 16);
+    rec[1] = t->pid + in->pid_offset;
+    rec[2] = t->tid;
+    fxt_write(&out, rec, 3);
+  }
+  return t->out_ref;
+}
+
+// Make sure a whole record's worth of new references fits in the output
+// tables; otherwise start them over before rewriting it.
+static void reserve_refs(void) {
+  if (out_string_count + 2 + 2 * 15 > MAX_STRINGS)
+    reset_out_strings();
+  if (out_thread_count + 1 > MAX_THREADS) {
+    out_thread_count = 0;
+    out_thread_epoch++;
+  }
+}
+
+static uint64_t set_bits(uint64_t w, unsigned lo, unsigned n, uint64_t v) {
+  uint64_t mask = ((1ULL << n) - 1) << lo;
+  return (w & ~mask) | ((v << lo) & mask);
+}
+
+static void remap_args(uint64_t *rec, size_t words, size_t at,
+                       unsigned count, uint64_t koid_offset) {
+  for (unsigned i = 0; i < count; i++) {
+    size_t hdr_at = at;
+    fxt_arg_t a;
+    if (fxt_next_arg(rec, words, &at, &a) < 0)
+      return;
+    uint64_t h = set_bits(rec[hdr_at], 16, 16, remap_str(a.name_ref));
+    if (a.type == FXT_ARG_STRING)
+      h = set_bits(h, 32, 16, remap_str((uint16_t)fxt_bits(h, 32, 16)));
+    else if (a.type == FXT_ARG_KOID && a.value_at < words)
+      rec[a.value_at] += koid_offset;
+    rec[hdr_at] = h;
+  }
+}
+
+static void rewrite_event(input_t *in, uint64_t *rec, size_t words) {
+  fxt_event_t ev;
+  if (fxt_parse_event(rec, words, &ev) < 0 || is_clock_sync(rec, &ev))
+    return;
+
+  uint64_t h = rec[0];
+  h = set_bits(h, 24, 8, remap_thread(in, ev.thread_ref));
+  h = set_bits(h, 32, 16, remap_str(ev.category_ref));
+  h = set_bits(h, 48, 16, remap_str(ev.name_ref));
+  rec[0] = h;
+  rec[1] = to_ns(in, ev.ts);
+  if (ev.thread_ref == 0)
+    rec[2] += in->pid_offset;
+  remap_args(rec, words, ev.args_at, ev.arg_count, in->pid_offset);
+  if (ev.event_type == FXT_EV_COMPLETE && ev.trailer_at < words)
+    rec[ev.trailer_at] = to_ns(in, rec[ev.trailer_at]);
+  fxt_write(&out, rec, words);
+}
+
+static void rewrite_kobj(input_t *in, uint64_t *rec, size_t words) {
+  uint64_t h = rec[0];
+  uint16_t name_ref = (uint16_t)fxt_bits(h, 24, 16);
+  unsigned nargs = fxt_bits(h, 40, 4);
+  if (words < 2)
+    return;
+  rec[0] = set_bits(h, 24, 16, remap_str(name_ref));
+  if (fxt_bits(h, 16, 8) == 1) // process
+    rec[1] += in->pid_offset;
+  remap_args(rec, words, 2 + fxt_ref_words(name_ref), nargs, in->pid_offset);
+  fxt_write(&out, rec, words);
+}
+
+static void rewrite_userobj(input_t *in, uint64_t *rec, size_t words) {
+  uint64_t h = rec[0];
+  unsigned thread_ref = fxt_bits(h, 16, 8);
+  uint16_t name_ref = (uint16_t)fxt_bits(h, 24, 16);
+  unsigned nargs = fxt_bits(h, 40, 4);
+  size_t at = 2;
+  if (thread_ref == 0) {
+    if (words < 4)
+      return;
+    rec[2] += in->pid_offset;
+    at += 2;
+  }
+  h = set_bits(h, 16, 8, remap_thread(in, thread_ref));
+  rec[0] = set_bits(h, 24, 16, remap_str(name_ref));
+  remap_args(rec, words, at + fxt_ref_words(name_ref), nargs, in->pid_offset);
+  fxt_write(&out, rec, words);
+}
+
+static void rewrite_log(input_t *in, uint64_t *rec, size_t words) {
+  unsigned thread_ref = fxt_bits(rec[0], 32, 8);
+  if (words < 2)
+    return;
+  rec[0] = set_bits(rec[0], 32, 8, remap_thread(in, thread_ref));
+  rec[1] = to_ns(in, rec[1]);
+  if (thread_ref == 0 && words >= 4)
+    rec[2] += in->pid_offset;
+  fxt_write(&out, rec, words);
+}
+
+static void define_string(const uint64_t *rec, size_t words) {
+  unsigned idx = fxt_bits(rec[0], 16, 15);
+  size_t len = fxt_bits(rec[0], 32, 15);
+  if (idx == 0 || (len + 7) / 8 + 1 > words)
+    return;
+  in_string_t *e = &in_strings[idx];
+  free(e->s);
+  e->s = fxt_malloc(len + 1);
+  memcpy(e->s, rec + 1, len);
+  e->s[len] = '\0';
+  e->len = len;
+  e->epoch = 0;
+}
+
+static int merge_input(input_t *in) {
+  fxt_reader_t r;
+  if (fxt_open(&r, in->path) < 0)
+    return -1;
+  memset(in_threads, 0, sizeof(in_threads));
+  for (size_t i = 0; i <= MAX_STRINGS; i++) {
+    free(in_strings[i].s);
+    in_strings[i] = (in_string_t){0};
+  }
+
+  int rc;
+  size_t nrecords = 0;
+  while ((rc = fxt_next(&r)) > 0) {
+    uint64_t *rec = r.rec;
+    size_t words = r.words;
+    nrecords++;
+    reserve_refs();
+    switch (fxt_bits(rec[0], 0, 4)) {
+    case FXT_REC_METADATA:
+      if (rec[0] != FXT_MAGIC)
+        fxt_write(&out, rec, words);
+      break;
+    case FXT_REC_INIT:
+      break;
+    case FXT_REC_STRING:
+      define_string(rec, words);
+      break;
+    case FXT_REC_THREAD: {
+      unsigned idx = fxt_bits(rec[0], 16, 8);
+      if (idx && words >= 3)
+        in_threads[idx] = (in_thread_t){rec[1], rec[2], 1, 0, 0};
+      break;
+    }
+    case FXT_REC_EVENT:
+      rewrite_event(in, rec, words);
+      break;
+    case FXT_REC_USEROBJ:
+      rewrite_userobj(in, rec, words);
+      break;
+    case FXT_REC_KOBJ:
+      rewrite_kobj(in, rec, words);
+      break;
+    case FXT_REC_LOG:
+      rewrite_log(in, rec, words);
+      break;
+    default:
+      fxt_write(&out, rec, words);
+      break;
+    }
+  }
+  fxt_close(&r);
+  fprintf(stderr, "ftr-merge: %s: %zu records, %zu sync points%s\n", in->path,
+          nrecords, in->nsyncs, in->pid_offset ? ", pids remapped" : "");
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: ftr-merge [-m] -o OUTPUT INPUT...\n"
+          "  -o OUTPUT  merged trace (.gz compresses)\n"
+          "  -m         align on CLOCK_MONOTONIC instead of CLOCK_REALTIME\n"
+          "             (only meaningful for traces from the same host)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *out_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "mo:h")) != -1) {
+    switch (opt) {
+    case 'm':
+      use_monotonic = 1;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!out_path || optind >= argc) {
+    usage();
+    return 2;
+  }
+
+  size_t ninputs = (size_t)(argc - optind);
+  input_t *inputs = fxt_calloc(ninputs, sizeof(input_t));
+  for (size_t i = 0; i < ninputs; i++) {
+    inputs[i].path = argv[optind + i];
+    if (scan_input(&inputs[i]) < 0)
+      return 1;
+    // Keep processes from different inputs apart when their pids collide.
+    // Offsets stay below 2^32 since Linux pids fit in 22 bits.
+    for (size_t j = 0; j < i && !inputs[i].pid_offset; j++)
+      for (size_t a = 0; a < inputs[i].npids && !inputs[i].pid_offset; a++)
+        for (size_t b = 0; b < inputs[j].npids; b++)
+          if (inputs[i].pids[a] + inputs[i].pid_offset ==
+              inputs[j].pids[b] + inputs[j].pid_offset) {
+            inputs[i].pid_offset = (uint64_t)i << 22;
+            break;
+          }
+  }
+
+  if (fxt_create(&out, out_path) < 0) {
+    fprintf(stderr, "ftr-merge: cannot create %s\n", out_path);
+    return 1;
+  }
+  uint64_t header[3] = {FXT_MAGIC, FXT_REC_INIT | (2ULL << 4), 1000000000ULL};
+  fxt_write(&out, header, 3);
+
+  int status = 0;
+  for (size_t i = 0; i < ninputs; i++) {
+    if (merge_input(&inputs[i]) < 0) {
+      fprintf(stderr, "ftr-merge: cannot reopen %s\n", inputs[i].path);
+      status = 1;
+    }
+    free(inputs[i].syncs);
+  }
+  free(inputs);
+  if (fxt_finish(&out) != 0)
+    status = 1;
+  return status;
+}
@@ -0,0 +1,377 @@
+// ftr-symbolize — resolve address-named spans from ftr_instrument.
+//
+//   ftr-symbolize -o named.fxt[.gz] trace.fxt[.gz]
+//
+// Streams the trace once. "ftr.module" records describe where each module
+// was loaded; ftr_instrument always writes them before the first name that
+// falls inside the module. Event names of the form "@0x<hex>", inline or in
+// string records, are rewritten to the demangled name of the ELF symbol
+// covering that address, or "<module>+0x<offset>" when the module has no
+// symbol for it. Symbols come from .symtab, falling back to .dynsym for
+// stripped binaries.
+
+#include "fxt.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *const fxt_tool = "ftr-symbolize";
+
+// From the C++ runtime (the tool is linked with the C++ linker).
+extern char *__cxa_demangle(const char *mangled, char *buf, size_t *len,
+                            int *status);
+
+typedef struct {
+  uint64_t addr, size;
+  const char *name; // points into the module's mapping
+} sym_t;
+
+typedef struct {
+  char *path;
+  uint64_t bias, start, end;
+  int loaded;
+  void *map;
+  size_t map_size;
+  sym_t *syms;
+  size_t nsyms;
+} module_t;
+
+static module_t *modules = NULL;
+static size_t module_count = 0, module_cap = 0;
+
+// Names already worked out, by address: instrumented spans repeat a few
+// thousand addresses millions of times. Open addressing, cleared whenever a
+// module is added since a later load may cover the same addresses.
+typedef struct {
+  uint64_t addr; // 0 = empty
+  char *name;    // NULL when no module covers the address
+} name_entry_t;
+
+static name_entry_t *names = NULL;
+static size_t names_count = 0, names_cap = 0;
+
+// Longest name written inline into an event record.
+#define MAX_INLINE_NAME 1024
+
+static int cmp_sym(const void *a, const void *b) {
+  const sym_t *x = a, *y = b;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void load_symbols(module_t *m) {
+  m->loaded = 1;
+  int fd = open(m->path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return;
+  }
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+  m->map = map;
+  m->map_size = (size_t)st.st_size;
+
+  const unsigned char *base = map;
+  const Elf64_Ehdr *eh = map;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 ||
+      eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+      eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > m->map_size)
+    return;
+  const Elf64_Shdr *sh = (const Elf64_Shdr *)(base + eh->e_shoff);
+
+  const Elf64_Shdr *symtab = NULL;
+  for (int i = 0; i < eh->e_shnum; i++) {
+    if (sh[i].sh_type == SHT_SYMTAB) {
+      symtab = &sh[i];
+      break;
+    }
+    if (sh[i].sh_type == SHT_DYNSYM && !symtab)
+      symtab = &sh[i];
+  }
+  if (!symtab || symtab->sh_link >= eh->e_shnum)
+    return;
+  const Elf64_Shdr *strtab = &sh[symtab->sh_link];
+  if (symtab->sh_offset + symtab->sh_size > m->map_size ||
+      strtab->sh_offset + strtab->sh_size > m->map_size)
+    return;
+
+  const Elf64_Sym *syms = (const Elf64_Sym *)(base + symtab->sh_offset);
+  size_t n = symtab->sh_size / sizeof(Elf64_Sym);
+  const char *strs = (const char *)(base + strtab->sh_offset);
+  m->syms = fxt_malloc(n * sizeof(sym_t));
+  for (size_t i = 0; i < n; i++) {
+    if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0 ||
+        syms[i].st_name >= strtab->sh_size)
+      continue;
+    m->syms[m->nsyms++] =
+        (sym_t){syms[i].st_value, syms[i].st_size, strs + syms[i].st_name};
+  }
+  qsort(m->syms, m->nsyms, sizeof(sym_t), cmp_sym);
+}
+
+static const sym_t *find_symbol(module_t *m, uint64_t vaddr) {
+  if (!m->loaded)
+    load_symbols(m);
+  size_t lo = 0, hi = m->nsyms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (m->syms[mid].addr <= vaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return NULL;
+  const sym_t *s = &m->syms[lo - 1];
+  if (vaddr == s->addr || vaddr < s->addr + s->size)
+    return s;
+  return NULL;
+}
+
+static void add_module(const uint64_t *rec, size_t words,
+                       const fxt_event_t *ev) {
+  module_t m = {0};
+  size_t at = ev->args_at;
+  for (unsigned i = 0; i < ev->arg_count; i++) {
+    fxt_arg_t a;
+    if (fxt_next_arg(rec, words, &at, &a) < 0)
+      return;
+    if (a.type == FXT_ARG_STRING &&
+        fxt_inline_eq(rec, a.name_at, a.name_ref, "path")) {
+      uint16_t ref = (uint16_t)fxt_bits(a.header, 32, 16);
+      if (!fxt_ref_inline(ref))
+        continue;
+      size_t len = ref & 0x7FFF;
+      m.path = fxt_malloc(len + 1);
+      memcpy(m.path, rec + a.value_at, len);
+      m.path[len] = '\0';
+    } else if (fxt_inline_eq(rec, a.name_at, a.name_ref, "load_bias")) {
+      m.bias = rec[a.value_at];
+    } else if (fxt_inline_eq(rec, a.name_at, a.name_ref, "start")) {
+      m.start = rec[a.value_at];
+    } else if (fxt_inline_eq(rec, a.name_at, a.name_ref, "size")) {
+      m.end = m.start + rec[a.value_at];
+    }
+  }
+  if (!m.path)
+    return;
+  if (module_count == module_cap) {
+    module_cap = module_cap ? module_cap * 2 : 16;
+    modules = fxt_realloc(modules, module_cap * sizeof(module_t));
+  }
+  modules[module_count++] = m;
+
+  for (size_t i = 0; i < names_cap; i++)
+    free(names[i].name);
+  memset(names, 0, names_cap * sizeof(name_entry_t));
+  names_count = 0;
+}
+
+// Parse "@0x<hex>"; returns 1 and sets *addr on a match.
+static int parse_address_name(const char *s, size_t len, uint64_t *addr) {
+  if (len < 4 || len > 3 + 16 || memcmp(s, "@0x", 3) != 0)
+    return 0;
+  uint64_t v = 0;
+  for (size_t i = 3; i < len; i++) {
+    char c = s[i];
+    int d = c >= '0' && c <= '9'   ? c - '0'
+            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                   : -1;
+    if (d < 0)
+      return 0;
+    v = v << 4 | (uint64_t)d;
+  }
+  *addr = v;
+  return 1;
+}
+
+static size_t resolved = 0, unresolved = 0;
+
+// Work out the name of the function at `addr`, or NULL if no module covers
+// it.
+static char *resolve_name(uint64_t addr) {
+  module_t *m = NULL;
+  for (size_t i = module_count; i-- > 0;) // later loads win
+    if (addr >= modules[i].start && addr < modules[i].end) {
+      m = &modules[i];
+      break;
+    }
+  if (!m) {
+    unresolved++;
+    return NULL;
+  }
+
+  const sym_t *s = find_symbol(m, addr - m->bias);
+  if (s) {
+    int status = -1;
+    char *demangled = NULL;
+    if (strncmp(s->name, "_Z", 2) == 0)
+      demangled = __cxa_demangle(s->name, NULL, NULL, &status);
+    resolved++;
+    if (status == 0)
+      return demangled;
+    free(demangled);
+    return fxt_strdup(s->name);
+  }
+  char fallback[512];
+  const char *slash = strrchr(m->path, '/');
+  snprintf(fallback, sizeof(fallback), "%s+0x%llx",
+           slash ? slash + 1 : m->path, (unsigned long long)(addr - m->bias));
+  unresolved++;
+  return fxt_strdup(fallback);
+}
+
+static const char *lookup_name(uint64_t addr) {
+  if (2 * (names_count + 1) > names_cap) {
+    size_t cap = names_cap ? names_cap * 2 : 1024;
+    name_entry_t *grown = fxt_calloc(cap, sizeof(name_entry_t));
+    for (size_t i = 0; i < names_cap; i++) {
+      if (!names[i].addr)
+        continue;
+      size_t k = (size_t)(names[i].addr * 0x9E3779B97F4A7C15ULL) & (cap - 1);
+      while (grown[k].addr)
+        k = (k + 1) & (cap - 1);
+      grown[k] = names[i];
+    }
+    free(names);
+    names = grown;
+    names_cap = cap;
+  }
+  size_t k = (size_t)(addr * 0x9E3779B97F4A7C15ULL) & (names_cap - 1);
+  while (names[k].addr && names[k].addr != addr)
+    k = (k + 1) & (names_cap - 1);
+  if (!names[k].addr) {
+    names[k].addr = addr;
+    names[k].name = resolve_name(addr);
+    names_count++;
+  }
+  return names[k].name;
+}
+
+static void symbolize_string(fxt_writer_t *out, const uint64_t *rec,
+                             size_t words) {
+  uint16_t idx = (uint16_t)fxt_bits(rec[0], 16, 15);
+  size_t len = fxt_bits(rec[0], 32, 15);
+  uint64_t addr;
+  const char *name = NULL;
+  if ((len + 7) / 8 + 1 <= words &&
+      parse_address_name((const char *)(rec + 1), len, &addr))
+    name = lookup_name(addr);
+  if (!name) {
+    fxt_write(out, rec, words);
+    return;
+  }
+  fxt_write_string(out, idx, name, strlen(name));
+}
+
+// Rewrite an event whose inline name is an address, resizing the record to
+// fit the symbol.
+static void symbolize_event(fxt_writer_t *out, const uint64_t *rec,
+                            size_t words, const fxt_event_t *ev) {
+  size_t len = ev->name_ref & 0x7FFF;
+  uint64_t addr;
+  const char *name = NULL;
+  if (fxt_ref_inline(ev->name_ref) &&
+      parse_address_name((const char *)(rec + ev->name_at), len, &addr))
+    name = lookup_name(addr);
+  if (!name) {
+    fxt_write(out, rec, words);
+    return;
+  }
+
+  size_t new_len = strlen(name);
+  if (new_len > MAX_INLINE_NAME)
+    new_len = MAX_INLINE_NAME;
+  size_t old_words = (len + 7) / 8, new_words = (new_len + 7) / 8;
+  size_t tail = words - ev->name_at - old_words;
+  uint64_t buf[4096];
+  if (words - old_words + new_words >= 4096 || new_words == 0) {
+    fxt_write(out, rec, words); // the symbol would not fit
+    return;
+  }
+  uint64_t h = rec[0];
+  h &= ~((0xFFFULL << 4) | (0xFFFFULL << 48));
+  h |= (uint64_t)(words - old_words + new_words) << 4;
+  h |= (uint64_t)(0x8000 | new_len) << 48;
+  buf[0] = h;
+  memcpy(buf + 1, rec + 1, (ev->name_at - 1) * 8);
+  buf[ev->name_at + new_words - 1] = 0; // zero the padding
+  memcpy(buf + ev->name_at, name, new_len);
+  memcpy(buf + ev->name_at + new_words, rec + ev->name_at + old_words,
+         tail * 8);
+  fxt_write(out, buf, words - old_words + new_words);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: ftr-symbolize -o OUTPUT INPUT\n");
+}
+
+int main(int argc, char **argv) {
+  const char *out_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:h")) != -1) {
+    switch (opt) {
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (!out_path || optind + 1 != argc) {
+    usage();
+    return 2;
+  }
+
+  fxt_reader_t r;
+  if (fxt_open(&r, argv[optind]) < 0) {
+    fprintf(stderr, "ftr-symbolize: cannot open %s\n", argv[optind]);
+    return 1;
+  }
+  fxt_writer_t out;
+  if (fxt_create(&out, out_path) < 0) {
+    fprintf(stderr, "ftr-symbolize: cannot create %s\n", out_path);
+    return 1;
+  }
+
+  int rc;
+  while ((rc = fxt_next(&r)) > 0) {
+    const uint64_t *rec = r.rec;
+    switch (fxt_bits(rec[0], 0, 4)) {
+    case FXT_REC_STRING:
+      symbolize_string(&out, rec, r.words);
+      break;
+    case FXT_REC_EVENT: {
+      fxt_event_t ev;
+      if (fxt_parse_event(rec, r.words, &ev) < 0) {
+        fxt_write(&out, rec, r.words);
+      } else if (ev.event_type == FXT_EV_INSTANT &&
+                 fxt_inline_eq(rec, ev.name_at, ev.name_ref, "ftr.module")) {
+        add_module(rec, r.words, &ev);
+        fxt_write(&out, rec, r.words);
+      } else {
+        symbolize_event(&out, rec, r.words, &ev);
+      }
+      break;
+    }
+    default:
+      fxt_write(&out, rec, r.words);
+      break;
+    }
+  }
+  fxt_close(&r);
+  int status = fxt_finish(&out) == 0 && rc == 0 ? 0 : 1;
+  fprintf(stderr, "ftr-symbolize: %zu names resolved, %zu unresolved\n",
+          resolved, unresolved);
+  return status;
+}
@@ -0,0 +1,191 @@
+#include "fxt.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void out_of_memory(void) {
+  fprintf(stderr, "%s: out of memory\n", fxt_tool);
+  exit(1);
+}
+
+void *fxt_malloc(size_t n) {
+  void *p = malloc(n ? n : 1);
+  if (!p)
+    out_of_memory();
+  return p;
+}
+
+void *fxt_calloc(size_t n, size_t size) {
+  void *p = calloc(n ? n : 1, size ? size : 1);
+  if (!p)
+    out_of_memory();
+  return p;
+}
+
+void *fxt_realloc(void *p, size_t n) {
+  p = realloc(p, n ? n : 1);
+  if (!p)
+    out_of_memory();
+  return p;
+}
+
+char *fxt_strdup(const char *s) {
+  char *p = strdup(s);
+  if (!p)
+    out_of_memory();
+  return p;
+}
+
+static int has_gz_suffix(const char *path) {
+  size_t len = strlen(path);
+  return len > 3 && strcmp(path + len - 3, ".gz") == 0;
+}
+
+int fxt_open(fxt_reader_t *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  if (has_gz_suffix(path)) {
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "gzip -dc '%s'", path);
+    r->fp = popen(cmd, "r");
+    r->is_pipe = 1;
+  } else {
+    r->fp = fopen(path, "rb");
+  }
+  return r->fp ? 0 : -1;
+}
+
+static void reserve(fxt_reader_t *r, size_t words) {
+  if (words <= r->cap)
+    return;
+  size_t cap = r->cap ? r->cap : 64;
+  while (cap < words)
+    cap *= 2;
+  r->rec = fxt_realloc(r->rec, cap * 8);
+  r->cap = cap;
+}
+
+int fxt_next(fxt_reader_t *r) {
+  reserve(r, 1);
+  size_t got = fread(r->rec, 8, 1, r->fp);
+  if (got != 1)
+    return 0;
+
+  uint64_t h = r->rec[0];
+  size_t words = fxt_bits(h, 4, 12);
+  if (fxt_bits(h, 0, 4) == FXT_REC_LARGE)
+    words = fxt_bits(h, 4, 32);
+  if (words == 0)
+    return -1;
+  reserve(r, words);
+  if (words > 1 && fread(r->rec + 1, 8, words - 1, r->fp) != words - 1)
+    return -1;
+  r->words = words;
+  return 1;
+}
+
+void fxt_close(fxt_reader_t *r) {
+  if (r->fp) {
+    if (r->is_pipe)
+      pclose(r->fp);
+    else
+      fclose(r->fp);
+  }
+  free(r->rec);
+  memset(r, 0, sizeof(*r));
+}
+
+int fxt_create(fxt_writer_t *w, const char *path) {
+  memset(w, 0, sizeof(*w));
+  if (has_gz_suffix(path)) {
+    char cmd[4096];
+    snprintf(cmd, sizeof(cmd), "gzip > '%s'", path);
+    w->fp = popen(cmd, "w");
+    w->is_pipe = 1;
+  } else {
+    w->fp = fopen(path, "wb");
+  }
+  return w->fp ? 0 : -1;
+}
+
+void fxt_write(fxt_writer_t *w, const uint64_t *words, size_t n) {
+  fwrite(words, 8, n, w->fp);
+}
+
+void fxt_write_string(fxt_writer_t *w, uint16_t idx, const char *s,
+                      size_t len) {
+  if (len > 0x7FFF)
+    len = 0x7FFF;
+  size_t str_words = (len + 7) / 8;
+  uint64_t h = FXT_REC_STRING;
+  h |= (uint64_t)(1 + str_words) << 4;
+  h |= (uint64_t)(idx & 0x7FFF) << 16;
+  h |= (uint64_t)len << 32;
+  fwrite(&h, 8, 1, w->fp);
+  fwrite(s, 1, len, w->fp);
+  static const char zeros[8] = {0};
+  fwrite(zeros, 1, str_words * 8 - len, w->fp);
+}
+
+int fxt_finish(fxt_writer_t *w) {
+  if (!w->fp)
+    return -1;
+  int rc = w->is_pipe ? pclose(w->fp) : fclose(w->fp);
+  w->fp = NULL;
+  return rc;
+}
+
+int fxt_parse_event(const uint64_t *rec, size_t words, fxt_event_t *ev) {
+  uint64_t h = rec[0];
+  memset(ev, 0, sizeof(*ev));
+  ev->event_type = fxt_bits(h, 16, 4);
+  ev->arg_count = fxt_bits(h, 20, 4);
+  ev->thread_ref = fxt_bits(h, 24, 8);
+  ev->category_ref = (uint16_t)fxt_bits(h, 32, 16);
+  ev->name_ref = (uint16_t)fxt_bits(h, 48, 16);
+
+  size_t at = 1;
+  if (at >= words)
+    return -1;
+  ev->ts = rec[at++];
+  if (ev->thread_ref == 0) {
+    if (at + 2 > words)
+      return -1;
+    ev->pid = rec[at++];
+    ev->tid = rec[at++];
+  }
+  ev->category_at = at;
+  at += fxt_ref_words(ev->category_ref);
+  ev->name_at = at;
+  at += fxt_ref_words(ev->name_ref);
+  ev->args_at = at;
+  for (unsigned i = 0; i < ev->arg_count; i++) {
+    fxt_arg_t a;
+    if (fxt_next_arg(rec, words, &at, &a) < 0)
+      return -1;
+  }
+  ev->trailer_at = at;
+  return at <= words ? 0 : -1;
+}
+
+int fxt_next_arg(const uint64_t *rec, size_t words, size_t *at, fxt_arg_t *a) {
+  if (*at >= words)
+    return -1;
+  uint64_t h = rec[*at];
+  size_t size = fxt_bits(h, 4, 12);
+  if (size == 0 || *at + size > words)
+    return -1;
+  a->header = h;
+  a->type = fxt_bits(h, 0, 4);
+  a->name_ref = (uint16_t)fxt_bits(h, 16, 16);
+  a->name_at = *at + 1;
+  a->value_at = a->name_at + fxt_ref_words(a->name_ref);
+  *at += size;
+  return 0;
+}
+
+int fxt_inline_eq(const uint64_t *rec, size_t at, uint16_t ref,
+                  const char *s) {
+  if (!fxt_ref_inline(ref))
+    return 0;
+  size_t len = ref & 0x7FFF;
+  return strlen(s) == len && memcmp(rec + at, s, len) == 0;
+}
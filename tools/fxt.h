@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Streaming FXT reader/writer shared by the offline tools. Records are read
+// one at a time into a reusable word buffer, so memory use does not depend on
+// the size of the trace. Paths ending in ".gz" are piped through gzip.
+
+// Each tool defines its name here, for error messages.
+extern const char *const fxt_tool;
+
+// Allocators that print "<tool>: out of memory" and exit(1) on failure.
+void *fxt_malloc(size_t n);
+void *fxt_calloc(size_t n, size_t size);
+void *fxt_realloc(void *p, size_t n);
+char *fxt_strdup(const char *s);
+
+#define FXT_MAGIC 0x0016547846040010ULL
+
+enum {
+  FXT_REC_METADATA = 0,
+  FXT_REC_INIT = 1,
+  FXT_REC_STRING = 2,
+  FXT_REC_THREAD = 3,
+  FXT_REC_EVENT = 4,
+  FXT_REC_USEROBJ = 6,
+  FXT_REC_KOBJ = 7,
+  FXT_REC_LOG = 9,
+  FXT_REC_LARGE = 15,
+};
+
+enum {
+  FXT_EV_INSTANT = 0,
+  FXT_EV_COUNTER = 1,
+  FXT_EV_BEGIN = 2,
+  FXT_EV_END = 3,
+  FXT_EV_COMPLETE = 4,
+  FXT_EV_FLOW_BEGIN = 8,
+  FXT_EV_FLOW_STEP = 9,
+  FXT_EV_FLOW_END = 10,
+};
+
+enum {
+  FXT_ARG_NULL = 0,
+  FXT_ARG_INT32 = 1,
+  FXT_ARG_UINT32 = 2,
+  FXT_ARG_INT64 = 3,
+  FXT_ARG_UINT64 = 4,
+  FXT_ARG_DOUBLE = 5,
+  FXT_ARG_STRING = 6,
+  FXT_ARG_POINTER = 7,
+  FXT_ARG_KOID = 8,
+  FXT_ARG_BOOL = 9,
+};
+
+static inline unsigned fxt_bits(uint64_t w, unsigned lo, unsigned n) {
+  return (unsigned)((w >> lo) & ((1ULL << n) - 1));
+}
+
+static inline int fxt_ref_inline(uint16_t ref) { return (ref & 0x8000) != 0; }
+static inline size_t fxt_ref_words(uint16_t ref) {
+  return fxt_ref_inline(ref) ? ((ref & 0x7FFF) + 7) / 8 : 0;
+}
+
+typedef struct {
+  FILE *fp;
+  int is_pipe;
+  uint64_t *rec; // current record, `words` long
+  size_t words;
+  size_t cap;
+} fxt_reader_t;
+
+// Returns 0 on success, -1 if the file can't be opened.
+int fxt_open(fxt_reader_t *r, const char *path);
+// Read the next record. Returns 1 if a record is available, 0 at end of
+// input and -1 on a truncated or malformed record.
+int fxt_next(fxt_reader_t *r);
+void fxt_close(fxt_reader_t *r);
+
+typedef struct {
+  FILE *fp;
+  int is_pipe;
+} fxt_writer_t;
+
+int fxt_create(fxt_writer_t *w, const char *path);
+void fxt_write(fxt_writer_t *w, const uint64_t *words, size_t n);
+void fxt_write_string(fxt_writer_t *w, uint16_t idx, const char *s,
+                      size_t len);
+int fxt_finish(fxt_writer_t *w);
+
+// Decoded view of an event record. Offsets are word indexes into the record;
+// fields after the optional inline pid/tid and strings are left for the
+// caller to interpret.
+typedef struct {
+  unsigned event_type;
+  unsigned arg_count;
+  unsigned thread_ref;
+  uint16_t category_ref;
+  uint16_t name_ref;
+  uint64_t ts;
+  uint64_t pid, tid;  // valid when thread_ref == 0
+  size_t category_at; // word index of inline category, if any
+  size_t name_at;     // word index of inline name, if any
+  size_t args_at;     // word index of the first argument
+  size_t trailer_at;  // word index after the last argument
+} fxt_event_t;
+
+// Returns 0 on success, -1 if the record is malformed.
+int fxt_parse_event(const uint64_t *rec, size_t words, fxt_event_t *ev);
+
+// Argument iteration. `at` is advanced past the argument on success.
+typedef struct {
+  unsigned type;
+  uint16_t name_ref;
+  size_t name_at;  // word index of inline name, if any
+  size_t value_at; // word index of the (first) value word, if any
+  uint64_t header;
+} fxt_arg_t;
+
+int fxt_next_arg(const uint64_t *rec, size_t words, size_t *at, fxt_arg_t *a);
+
+// Compare an argument name or event name against `s`. Only inline refs can be
+// matched without a string table, which is what ftr uses for its own
+// metadata records.
+int fxt_inline_eq(const uint64_t *rec, size_t at, uint16_t ref, const char *s);